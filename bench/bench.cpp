@@ -0,0 +1,244 @@
+/*
+    File: bench.cpp
+    Purpose: Time e20sim and simcache on E20 programs and report their
+        throughput, so speedups can be measured against a baseline
+*/
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+    Mean, sample standard deviation and minimum of a list of times.
+*/
+struct run_times
+{
+    vector<double> seconds;
+
+    double mean() const
+    {
+        double sum = 0;
+        for (double s : seconds)
+            sum += s;
+        return sum / seconds.size();
+    }
+
+    double stddev() const
+    {
+        if (seconds.size() < 2)
+            return 0;
+        double m = mean(), sum = 0;
+        for (double s : seconds)
+            sum += (s - m) * (s - m);
+        return sqrt(sum / (seconds.size() - 1));
+    }
+
+    double min() const
+    {
+        double least = seconds[0];
+        for (double s : seconds)
+            least = s < least ? s : least;
+        return least;
+    }
+};
+
+/*
+    Runs args[0] with its output thrown away and waits for it.
+
+    @param seconds Set to the wall-clock time the process took
+    @return false if it couldn't be started or didn't exit with status 0
+*/
+bool time_command(const vector<string> &args, double &seconds)
+{
+    vector<char *> argv;
+    for (const string &arg : args)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    auto start = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid)
+        return false;
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+    Runs simcache once with only event counts to learn how many
+    instructions the program runs and how many cache events the models
+    handle on the way.
+
+    @return false if simcache failed or its output couldn't be read
+*/
+bool count_work(const string &simcache, const string &cache, const string &program, uint64_t &instructions,
+                uint64_t &events)
+{
+    string command = "'" + simcache + "' --cache " + cache + " --log counts --top 0 '" + program + "' 2>&1";
+    FILE *in = popen(command.c_str(), "r");
+    if (in == nullptr)
+        return false;
+    instructions = 0;
+    events = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), in) != nullptr)
+    {
+        int level;
+        unsigned long long hits, misses, sw, cycles, count;
+        if (sscanf(line, "Cache L%d hits %llu, misses %llu, sw %llu", &level, &hits, &misses, &sw) == 4)
+            events += hits + misses + sw;
+        else if (sscanf(line, "Cycles: %llu for %llu instructions", &cycles, &count) == 2)
+            instructions = count;
+    }
+    return pclose(in) == 0 && instructions > 0;
+}
+
+int main(int argc, char *argv[])
+{
+    /*
+        Parse the command-line arguments
+    */
+    vector<string> programs;
+    string e20sim = "./e20sim";
+    string simcache = "./simcache";
+    string cache = "64,2,4,512,4,8";
+    int runs = 5;
+    bool csv = false;
+    bool do_help = false;
+    bool arg_error = false;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg(argv[i]);
+        if (arg.rfind("-", 0) == 0)
+        {
+            if (arg == "-h" || arg == "--help")
+                do_help = true;
+            else if (arg == "--csv")
+                csv = true;
+            else if (arg == "--runs" || arg == "--e20sim" || arg == "--simcache" || arg == "--cache")
+            {
+                i++;
+                if (i >= argc)
+                    arg_error = true;
+                else if (arg == "--runs")
+                    runs = atoi(argv[i]);
+                else if (arg == "--e20sim")
+                    e20sim = argv[i];
+                else if (arg == "--simcache")
+                    simcache = argv[i];
+                else
+                    cache = argv[i];
+            }
+            else
+                arg_error = true;
+        }
+        else
+            programs.push_back(arg);
+    }
+    if (programs.empty() || runs < 1)
+        arg_error = true;
+
+    if (arg_error || do_help)
+    {
+        cerr << "usage " << argv[0] << " [-h] [--runs N] [--e20sim PATH] [--simcache PATH] [--cache CACHE]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--csv] program..." << endl
+             << endl;
+        cerr << "Time e20sim and simcache on E20 programs" << endl
+             << endl;
+        cerr << "positional arguments:" << endl;
+        cerr << "  program     Machine code files, e.g. bench/*.bin" << endl
+             << endl;
+        cerr << "optional arguments:" << endl;
+        cerr << "  -h, --help  show this help message and exit" << endl;
+        cerr << "  --runs N    Timed runs of each tool per program, after one untimed" << endl;
+        cerr << "              warm-up run (default 5)" << endl;
+        cerr << "  --e20sim PATH    e20sim to time (default ./e20sim)" << endl;
+        cerr << "  --simcache PATH  simcache to time (default ./simcache)" << endl;
+        cerr << "  --cache CACHE    Cache configuration simcache runs with, as for its" << endl;
+        cerr << "              --cache (default 64,2,4,512,4,8). simcache only counts" << endl;
+        cerr << "              events, so the log doesn't dominate the time" << endl;
+        cerr << "  --csv       Print the results as csv instead of a table" << endl;
+        return 1;
+    }
+
+    if (csv)
+        cout << "program,tool,instructions,events,runs,mean_ms,stddev_ms,min_ms,mips,ns_per_instr,mevents_per_s"
+             << endl;
+    else
+        cout << left << setw(16) << "program" << setw(10) << "tool" << right << setw(12) << "instrs"
+             << setw(10) << "mean ms" << setw(9) << "sd ms" << setw(9) << "min ms" << setw(9) << "MIPS"
+             << setw(10) << "ns/instr" << setw(11) << "Mevents/s" << endl;
+    cout << fixed;
+    for (const string &program : programs)
+    {
+        uint64_t instructions, events;
+        if (!count_work(simcache, cache, program, instructions, events))
+        {
+            cerr << "Can't count the work in " << program << " with " << simcache << endl;
+            return 1;
+        }
+        string name = program.substr(program.find_last_of('/') + 1);
+
+        vector<vector<string>> commands = {
+            {e20sim, program},
+            {simcache, "--cache", cache, "--log", "counts", "--top", "0", program}};
+        for (const vector<string> &command : commands)
+        {
+            bool cache_model = command[0] == simcache;
+            run_times times;
+            for (int run = 0; run <= runs; ++run)
+            {
+                double seconds;
+                if (!time_command(command, seconds))
+                {
+                    cerr << "Running " << command[0] << " on " << program << " failed" << endl;
+                    return 1;
+                }
+                if (run > 0)
+                    times.seconds.push_back(seconds);
+            }
+            double mean = times.mean();
+            double mips = instructions / mean / 1e6;
+            double ns = mean * 1e9 / instructions;
+            string tool = cache_model ? "simcache" : "e20sim";
+            if (csv)
+            {
+                cout << setprecision(3) << name << "," << tool << "," << instructions << ","
+                     << (cache_model ? events : 0) << "," << runs << "," << mean * 1e3 << ","
+                     << times.stddev() * 1e3 << "," << times.min() * 1e3 << "," << mips << "," << ns << ",";
+                if (cache_model)
+                    cout << events / mean / 1e6;
+                cout << endl;
+                continue;
+            }
+            cout << left << setw(16) << name << setw(10) << tool << right << setw(12) << instructions
+                 << setprecision(2) << setw(10) << mean * 1e3 << setw(9) << times.stddev() * 1e3 << setw(9)
+                 << times.min() * 1e3 << setprecision(1) << setw(9) << mips << setprecision(2) << setw(10) << ns;
+            if (cache_model)
+                cout << setprecision(1) << setw(11) << events / mean / 1e6;
+            cout << endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,478 @@
+/*
+    File: e20aot.cpp
+    Purpose: Translate an E20 machine code file ahead of time into a C++
+    program that runs it natively and prints the same final state as e20sim
+*/
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include "libe20.h"
+
+using namespace std;
+
+uint16_t memory[MEM_SIZE] = {0};
+
+/*
+    Loads an E20 program into memory.
+    Returns the number of words loaded; exits on any error.
+*/
+size_t load_machine_code(const string &filename, uint16_t mem[]) {
+    string error;
+    size_t words;
+    if (!read_program(filename, mem, error, &words)) {
+        cerr << error << endl;
+        exit(1);
+    }
+    return words;
+}
+
+/*
+    Writes the first program_size words of memory as an .e20img image.
+*/
+void emit_image(ostream &out, size_t program_size) {
+    image_header header = {};
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.words = program_size;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(memory), program_size * sizeof(uint16_t));
+}
+
+// Extract bits from an instruction
+uint16_t extract_bits(unsigned instruction, int inner, int outer) {
+    unsigned val = (1 << (outer - inner + 1)) - 1;
+    return (instruction >> inner) & val;
+}
+
+// Sign extend 7-bit immediate
+uint16_t sign_extend(unsigned value) {
+    if (value & 0b1000000) {
+        value |= 0b1111111110000000;  // Sign-extend to 16 bits
+    }
+    return value & 0xFFFF;
+}
+
+// True for J, JAL, JEQ and JR, the instructions that end a basic block
+bool is_jump(uint16_t instruction) {
+    uint16_t opcode = extract_bits(instruction, 13, 15);
+    if (opcode == 0b010 || opcode == 0b011 || opcode == 0b110)
+        return true;
+    return opcode == 0b000 && extract_bits(instruction, 0, 3) == 0b1000;
+}
+
+// A basic block found by walking the control flow from pc 0
+struct basic_block {
+    uint16_t start;
+    uint16_t length;
+};
+
+/*
+    Finds every basic block reachable from pc 0 through fall-through, J,
+    JAL and JEQ edges. The word after each JAL is added too, since that is
+    where a matching JR will usually return. Blocks stop at the end of
+    memory; the runtime interprets anything past it.
+*/
+vector<basic_block> find_blocks() {
+    vector<basic_block> blocks;
+    vector<bool> seen(MEM_SIZE, false);
+    vector<uint16_t> work = {0};
+
+    while (!work.empty()) {
+        uint16_t start = work.back();
+        work.pop_back();
+        if (seen[start])
+            continue;
+        seen[start] = true;
+
+        size_t end = start;
+        while (end + 1 < MEM_SIZE && !is_jump(memory[end]))
+            end++;
+        blocks.push_back({start, uint16_t(end - start + 1)});
+
+        uint16_t last = memory[end];
+        uint16_t opcode = extract_bits(last, 13, 15);
+        auto follow = [&](unsigned target) {
+            if (target < MEM_SIZE && !seen[target])
+                work.push_back(target);
+        };
+        if (!is_jump(last)) {
+            // ran into the end of memory
+        } else if (opcode == 0b010) {
+            follow(extract_bits(last, 0, 12));
+        } else if (opcode == 0b011) {
+            follow(extract_bits(last, 0, 12));
+            follow(end + 1);
+        } else if (opcode == 0b110) {
+            follow(uint16_t(end + 1 + sign_extend(extract_bits(last, 0, 6))));
+            follow(end + 1);
+        }
+    }
+    return blocks;
+}
+
+// Name of the local holding a register, or a literal 0 for $0
+string reg_name(uint16_t reg) {
+    return reg == 0 ? string("0") : "r" + to_string(reg);
+}
+
+/*
+    Emits the return of a jump from pc to target, marking it as a halt
+    when the jump lands on itself.
+*/
+string emit_jump(const string &target, uint16_t pc) {
+    return "{ uint16_t t = " + target + "; " + "WRITE_BACK return (t & " + to_string(MEM_SIZE - 1) +
+           ") == " + to_string(pc) + " ? HALTED | t : t; }";
+}
+
+/*
+    Emits one C++ function for a basic block. Registers the block uses are
+    copied into locals on entry and written back before every exit. The
+    function returns the next pc, or'ed with HALTED when the program stops.
+*/
+void emit_block(ostream &out, const basic_block &b) {
+    bool used[NUM_REGS] = {false};
+    bool written[NUM_REGS] = {false};
+    for (uint16_t pc = b.start; pc < b.start + b.length; pc++) {
+        uint16_t in = memory[pc];
+        uint16_t opcode = extract_bits(in, 13, 15);
+        uint16_t ra = extract_bits(in, 10, 12), rb = extract_bits(in, 7, 9), rc = extract_bits(in, 4, 6);
+        switch (opcode) {
+            case 0b000:
+                used[ra] = used[rb] = true;
+                if (extract_bits(in, 0, 3) <= 0b0100)
+                    used[rc] = written[rc] = true;
+                break;
+            case 0b001: case 0b100: case 0b111:
+                used[ra] = used[rb] = written[rb] = true;
+                break;
+            case 0b011:
+                used[7] = written[7] = true;
+                break;
+            case 0b101: case 0b110:
+                used[ra] = used[rb] = true;
+                break;
+        }
+    }
+    used[0] = written[0] = false;
+
+    out << "static unsigned block_" << b.start << "() {\n";
+    for (size_t reg = 1; reg < NUM_REGS; reg++)
+        if (used[reg])
+            out << "    uint16_t r" << reg << " = regs[" << reg << "];\n";
+    out << "#define WRITE_BACK";
+    for (size_t reg = 1; reg < NUM_REGS; reg++)
+        if (written[reg])
+            out << " regs[" << reg << "] = r" << reg << ";";
+    out << "\n";
+
+    for (uint16_t pc = b.start; pc < b.start + b.length; pc++) {
+        uint16_t in = memory[pc];
+        uint16_t opcode = extract_bits(in, 13, 15);
+        uint16_t ra = extract_bits(in, 10, 12), rb = extract_bits(in, 7, 9), rc = extract_bits(in, 4, 6);
+        string a = reg_name(ra), bb = reg_name(rb), c = reg_name(rc);
+        string imm = to_string(sign_extend(extract_bits(in, 0, 6)));
+        string addr = "(" + a + " + " + imm + ") & " + to_string(MEM_SIZE - 1);
+        string imm13 = to_string(extract_bits(in, 0, 12));
+
+        out << "    ";
+        switch (opcode) {
+            case 0b000: {
+                static const char *const ops[] = {" + ", " - ", " | ", " & ", " < "};
+                uint16_t func = extract_bits(in, 0, 3);
+                if (func == 0b1000)
+                    out << emit_jump("uint16_t(" + a + " & " + to_string(MEM_SIZE - 1) + ")", pc);
+                else if (func <= 0b0100 && rc != 0)
+                    out << c << " = " << a << ops[func] << bb << ";";
+                else
+                    out << ";";
+                break;
+            }
+            case 0b001:
+                if (rb != 0)
+                    out << bb << " = " << a << " + " << imm << ";";
+                break;
+            case 0b010:
+                out << emit_jump(imm13, pc);
+                break;
+            case 0b011:
+                out << "r7 = " << uint16_t(pc + 1) << "; " << emit_jump(imm13, pc);
+                break;
+            case 0b100:
+                if (rb != 0)
+                    out << bb << " = memory[" << addr << "];";
+                break;
+            case 0b101:
+                out << "if (store(" << addr << ", " << bb << ")) { WRITE_BACK return " << pc + 1 << "; }";
+                break;
+            case 0b110: {
+                string target = to_string(uint16_t(pc + 1 + sign_extend(extract_bits(in, 0, 6))));
+                if (ra == rb)
+                    out << emit_jump(target, pc);
+                else
+                    out << "if (" << a << " == " << bb << ") " << emit_jump(target, pc) << "\n"
+                        << "    WRITE_BACK return " << pc + 1 << ";";
+                break;
+            }
+            case 0b111:
+                if (rb != 0)
+                    out << bb << " = " << a << " < " << imm << "u;";
+                break;
+        }
+        out << "  // pc " << pc << "\n";
+    }
+    if (!is_jump(memory[b.start + b.length - 1]))
+        out << "    WRITE_BACK return " << b.start + b.length << ";\n";
+    out << "#undef WRITE_BACK\n}\n\n";
+}
+
+// Runtime shared by every translated program: memory, the interpreter used
+// for anything that was not translated, and the final state printer. The
+// preload goes through libe20.h's loader, the same one the tools use.
+const char *const runtime_prologue = R"(#include <iostream>
+#include <string>
+#include <iomanip>
+#include <cstdlib>
+#include "libe20.h"
+
+using namespace std;
+
+unsigned const static HALTED = 1 << 16;
+
+uint16_t memory[MEM_SIZE] = {0};
+uint16_t regs[NUM_REGS] = {0};
+// Words that belong to a translated block
+bool code_word[MEM_SIZE] = {false};
+// Set once translated code no longer matches memory; from then on
+// everything runs in the interpreter
+bool code_modified = false;
+
+/*
+    Stores a word, noticing writes that change translated code.
+    Returns true when the caller has to leave translated code.
+*/
+static inline bool store(unsigned addr, uint16_t value) {
+    if (code_word[addr] && memory[addr] != value) {
+        memory[addr] = value;
+        code_modified = true;
+        return true;
+    }
+    memory[addr] = value;
+    return false;
+}
+
+// Loads a preload over the program image; exits on any error
+void load_machine_code(const string &filename, uint16_t mem[]) {
+    string error;
+    if (!read_program(filename, mem, error)) {
+        cerr << error << endl;
+        exit(1);
+    }
+}
+
+void print_state(uint16_t pc, uint16_t regs[], uint16_t memory[], size_t memquantity) {
+    cout << setfill(' ');
+    cout << "Final state:" << endl;
+    cout << "\tpc=" << setw(5) << pc << endl;
+
+    for (size_t reg = 0; reg < NUM_REGS; reg++)
+        cout << "\t$" << reg << "=" << setw(5) << regs[reg] << endl;
+
+    cout << setfill('0');
+    bool cr = false;
+    for (size_t count = 0; count < memquantity; count++) {
+        cout << hex << setw(4) << memory[count] << " ";
+        cr = true;
+        if (count % 8 == 7) {
+            cout << endl;
+            cr = false;
+        }
+    }
+    if (cr)
+        cout << endl;
+}
+
+/*
+    Interprets from pc up to and including the next jump.
+    Returns the next pc, or'ed with HALTED when the program stops.
+*/
+static unsigned interpret(uint16_t pc) {
+    for (;;) {
+        uint16_t in = memory[pc % MEM_SIZE];
+        uint16_t op = in >> 13, ra = (in >> 10) & 7, rb = (in >> 7) & 7, rc = (in >> 4) & 7;
+        uint16_t imm = in & 0x7F;
+        if (imm & 0x40)
+            imm |= 0xFF80;
+        uint16_t next = pc + 1;
+        bool jump = false;
+
+        switch (op) {
+            case 0:
+                switch (in & 0xF) {
+                    case 0: regs[rc] = regs[ra] + regs[rb]; break;
+                    case 1: regs[rc] = regs[ra] - regs[rb]; break;
+                    case 2: regs[rc] = regs[ra] | regs[rb]; break;
+                    case 3: regs[rc] = regs[ra] & regs[rb]; break;
+                    case 4: regs[rc] = regs[ra] < regs[rb]; break;
+                    case 8: next = regs[ra] & (MEM_SIZE - 1); jump = true; break;
+                }
+                break;
+            case 1: regs[rb] = regs[ra] + imm; break;
+            case 2: next = in & 0x1FFF; jump = true; break;
+            case 3: regs[7] = pc + 1; next = in & 0x1FFF; jump = true; break;
+            case 4: regs[rb] = memory[(regs[ra] + imm) & (MEM_SIZE - 1)]; break;
+            case 5: store((regs[ra] + imm) & (MEM_SIZE - 1), regs[rb]); break;
+            case 6:
+                if (regs[ra] == regs[rb])
+                    next = pc + 1 + imm;
+                jump = true;
+                break;
+            case 7: regs[rb] = regs[ra] < imm; break;
+        }
+        regs[0] = 0;
+
+        if (next % MEM_SIZE == pc)
+            return HALTED | next;
+        if (jump)
+            return next;
+        pc = next;
+    }
+}
+
+)";
+
+// Entry point of the translated program
+const char *const runtime_main = R"(
+int main(int argc, char *argv[]) {
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+        cerr << "usage " << argv[0] << " [preload]" << endl;
+        cerr << "Run translated E20 program; preload is an optional machine code" << endl;
+        cerr << "file or .e20img image loaded over the program image" << endl;
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(program_image) / sizeof(program_image[0]); i++)
+        memory[i] = program_image[i];
+    for (const auto &range : code_ranges)
+        for (size_t i = range[0]; i < range[0] + range[1]; i++)
+            code_word[i] = true;
+
+    if (argc == 2) {
+        load_machine_code(argv[1], memory);
+        for (size_t i = 0; i < MEM_SIZE; i++)
+            if (code_word[i] && memory[i] != (i < sizeof(program_image) / sizeof(program_image[0]) ? program_image[i] : 0))
+                code_modified = true;
+    }
+
+    unsigned pc = 0;
+    while (!(pc & HALTED)) {
+        if (code_modified || pc >= MEM_SIZE)
+            pc = interpret(pc);
+        else
+            pc = run_block(pc);
+    }
+
+    print_state(pc & 0xFFFF, regs, memory, 128);
+    return 0;
+}
+)";
+
+/*
+    Writes the whole translated program for the loaded image.
+*/
+void emit_program(ostream &out, size_t program_size, const vector<basic_block> &blocks) {
+    out << "// Generated by e20aot. Do not edit.\n";
+    out << runtime_prologue;
+
+    out << "static const uint16_t program_image[" << (program_size ? program_size : 1) << "] = {";
+    for (size_t i = 0; i < program_size; i++)
+        out << (i % 12 == 0 ? "\n    " : " ") << memory[i] << ",";
+    out << "\n};\n\n";
+
+    out << "static const unsigned code_ranges[][2] = {\n";
+    for (const basic_block &b : blocks)
+        out << "    {" << b.start << ", " << b.length << "},\n";
+    out << "};\n\n";
+
+    for (const basic_block &b : blocks)
+        emit_block(out, b);
+
+    out << "static unsigned run_block(unsigned pc) {\n";
+    out << "    switch (pc) {\n";
+    for (const basic_block &b : blocks)
+        out << "        case " << b.start << ": return block_" << b.start << "();\n";
+    out << "        default: return interpret(pc);\n";
+    out << "    }\n";
+    out << "}\n";
+
+    out << runtime_main;
+}
+
+int main(int argc, char *argv[]) {
+    // Parse command-line arguments
+    char *filename = nullptr;
+    char *outname = nullptr;
+    bool do_help = false;
+    bool arg_error = false;
+    bool image = false;
+
+    for (int i = 1; i < argc; i++) {
+        string arg(argv[i]);
+        if (arg.rfind("-", 0) == 0) {
+            if (arg == "-h" || arg == "--help")
+                do_help = true;
+            else if (arg == "-o" && i + 1 < argc)
+                outname = argv[++i];
+            else if (arg == "--image")
+                image = true;
+            else
+                arg_error = true;
+        } else {
+            if (filename == nullptr)
+                filename = argv[i];
+            else
+                arg_error = true;
+        }
+    }
+
+    if (arg_error || do_help || filename == nullptr) {
+        cerr << "usage " << argv[0] << " [-h] [--image] [-o OUTPUT] filename" << endl;
+        cerr << "Translate E20 machine code into a C++ program" << endl;
+        cerr << "  -o OUTPUT  write the translation to OUTPUT instead of stdout" << endl;
+        cerr << "  --image    write the program as a raw .e20img image instead, which" << endl;
+        cerr << "             e20sim, simcache and translated programs load in one read" << endl;
+        return 1;
+    }
+
+    size_t program_size = load_machine_code(filename, memory);
+    if (image) {
+        if (outname == nullptr) {
+            emit_image(cout, program_size);
+            return 0;
+        }
+        ofstream out(outname, ios::binary);
+        if (!out.is_open()) {
+            cerr << "Can't open file " << outname << endl;
+            return 1;
+        }
+        emit_image(out, program_size);
+        return 0;
+    }
+    vector<basic_block> blocks = find_blocks();
+
+    if (outname == nullptr) {
+        emit_program(cout, program_size, blocks);
+        return 0;
+    }
+    ofstream out(outname);
+    if (!out.is_open()) {
+        cerr << "Can't open file " << outname << endl;
+        return 1;
+    }
+    emit_program(out, program_size, blocks);
+    return 0;
+}
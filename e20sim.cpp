@@ -11,73 +11,115 @@ sim.cpp
 #include <vector>
 #include <fstream>
 #include <iomanip>
-#include <regex>
 #include <cstdlib>
+#include <sstream>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include "libe20.h"
 
 using namespace std;
 
-// Some helpful constant values
-size_t const static NUM_REGS = 8;
-size_t const static MEM_SIZE = 1 << 13;
-size_t const static REG_SIZE = 1 << 16;
-
-uint16_t memory[MEM_SIZE] = {0};
-uint16_t registers[NUM_REGS] = {0};
-uint16_t pc = 0;
 /*
-    Loads an E20 machine code file into memory.
+    Loads an E20 program into memory.
 */
-void load_machine_code(ifstream &f, uint16_t mem[]) {
-    regex machine_code_re("^ram\\[(\\d+)\\] = 16'b(\\d+);.*$");
-    size_t expectedaddr = 0;
-    string line;
+void load_machine_code(const string &filename, uint16_t mem[]) {
+    string error;
+    if (!read_program(filename, mem, error)) {
+        cerr << error << endl;
+        exit(1);
+    }
+}
 
-    while (getline(f, line)) {
-        smatch sm;
-        if (!regex_match(line, sm, machine_code_re)) {
-            cerr << "Can't parse line: " << line << endl;
-            exit(1);
-        }
-        size_t addr = stoi(sm[1], nullptr, 10);
-        unsigned instr = stoi(sm[2], nullptr, 2);
+// Size of each of simcache's cache levels in a checkpoint, which e20sim skips
+size_t const static CHECKPOINT_LEVEL_SIZE = 16;
 
-        if (addr != expectedaddr) {
-            cerr << "Memory addresses encountered out of sequence: " << addr << endl;
-            exit(1);
-        }
-        if (addr >= MEM_SIZE) {
-            cerr << "Program too big for memory" << endl;
-            exit(1);
-        }
+/*
+    Writes memory, registers and pc with a single write. On failure, stores
+    the message in error and returns false.
+*/
+bool write_checkpoint(const string &filename, const uint16_t memory[], const uint16_t regs[], uint16_t pc,
+                      uint64_t instructions, string &error) {
+    struct {
+        checkpoint_header header;
+        uint16_t memory[MEM_SIZE];
+    } blob = {};
+    memcpy(blob.header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    blob.header.version = CHECKPOINT_VERSION;
+    blob.header.pc = pc;
+    memcpy(blob.header.regs, regs, sizeof(blob.header.regs));
+    blob.header.instructions = instructions;
+    memcpy(blob.memory, memory, sizeof(blob.memory));
 
-        expectedaddr++;
-        mem[addr] = instr;
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && write(fd, &blob, sizeof(blob)) == ssize_t(sizeof(blob));
+    if (fd >= 0)
+        ok = close(fd) == 0 && ok;
+    if (!ok)
+        error = "Can't write file " + filename;
+    return ok;
+}
+
+/*
+    Reads memory, registers and pc from a checkpoint written by e20sim or
+    simcache, ignoring any cache contents. On failure, stores the message
+    in error and returns false.
+*/
+bool read_checkpoint(const string &filename, uint16_t memory[], uint16_t regs[], uint16_t &pc,
+                     uint64_t &instructions, string &error) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0)
+            close(fd);
+        error = "Can't open file " + filename;
+        return false;
+    }
+    checkpoint_header header;
+    struct iovec parts[2] = {{&header, sizeof(header)}, {memory, MEM_SIZE * sizeof(uint16_t)}};
+    ssize_t fixed = sizeof(header) + MEM_SIZE * sizeof(uint16_t);
+    bool ok = readv(fd, parts, 2) == fixed
+        && memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) == 0 && header.version == CHECKPOINT_VERSION
+        && uint64_t(st.st_size) == fixed + uint64_t(header.levels) * CHECKPOINT_LEVEL_SIZE + header.cache_bytes;
+    close(fd);
+    if (!ok) {
+        error = "Not a checkpoint file: " + filename;
+        return false;
     }
+    memcpy(regs, header.regs, sizeof(header.regs));
+    pc = header.pc;
+    instructions = header.instructions;
+    return true;
 }
 
 /*
     Prints the current state of the simulator.
 */
-void print_state(uint16_t pc, uint16_t regs[], uint16_t memory[], size_t memquantity) {
-    cout << setfill(' ');
-    cout << "Final state:" << endl;
-    cout << "\tpc=" << setw(5) << pc << endl;
+void print_state(uint16_t pc, uint16_t regs[], uint16_t memory[], size_t memquantity, ostream &out = cout) {
+    out << setfill(' ');
+    out << "Final state:" << endl;
+    out << "\tpc=" << setw(5) << pc << endl;
 
     for (size_t reg = 0; reg < NUM_REGS; reg++)
-        cout << "\t$" << reg << "=" << setw(5) << regs[reg] << endl;
+        out << "\t$" << reg << "=" << setw(5) << regs[reg] << endl;
 
-    cout << setfill('0');
+    out << setfill('0');
     bool cr = false;
     for (size_t count = 0; count < memquantity; count++) {
-        cout << hex << setw(4) << memory[count] << " ";
+        out << hex << setw(4) << memory[count] << " ";
         cr = true;
         if (count % 8 == 7) {
-            cout << endl;
+            out << endl;
             cr = false;
         }
     }
     if (cr)
-        cout << endl;
+        out << endl;
 }
 
 // Extract bits from an instruction
@@ -93,168 +135,1404 @@ uint16_t sign_extend(unsigned value) {
     }
     return value & 0xFFFF;
 }
-//helper function that executes one instruction
-unsigned execute_instruction(uint16_t pc, uint16_t memory[], uint16_t registers[]) {
-    uint16_t instruction = memory[pc % MEM_SIZE];
-    //3 bit opcode
-    uint16_t opcode = extract_bits(instruction, 13, 15);
-    uint16_t next_pc = pc + 1;
+// Handlers a predecoded instruction can dispatch to. OP_DECODE marks a slot
+// that has not been decoded yet (or was overwritten by SW).
+enum decoded_op : uint8_t {
+    OP_DECODE, OP_NOP,
+    OP_ADD, OP_SUB, OP_OR, OP_AND, OP_SLT, OP_JR,
+    OP_ADDI, OP_J, OP_JAL, OP_LW, OP_SW, OP_JEQ, OP_SLTI,
+    NUM_DECODED_OPS,
+    // Ends a translated block that runs straight into the next one
+    OP_FALLTHROUGH = NUM_DECODED_OPS,
+    NUM_MICRO_OPS
+};
 
-    uint16_t ander = 0xFFFF;
+// One instruction with its fields already extracted and sign extended
+struct decoded_instr {
+    uint8_t op;
+    uint8_t ra, rb, rd;
+    uint16_t imm;
+};
 
-    uint16_t rg1, rg2, regDst, imm, imm4;
-    unsigned addr;
+/*
+    Decodes one instruction word into its handler and operands.
+    Writes to $0 are turned into OP_NOP here so the handlers never
+    have to re-zero the register.
+*/
+decoded_instr decode_instruction(uint16_t instruction) {
+    decoded_instr d = {};
+    uint16_t opcode = extract_bits(instruction, 13, 15);
+    d.ra = extract_bits(instruction, 10, 12);
+    d.rb = extract_bits(instruction, 7, 9);
 
     switch (opcode) {
-        case 0b000:  // ADD, SUB, OR, AND, SLT, JR
-            rg1 = extract_bits(instruction, 10, 12);
-            rg2 = extract_bits(instruction, 7, 9);
-            regDst = extract_bits(instruction, 4, 6);
-            imm4 = extract_bits(instruction, 0, 3);
-
-            if (regDst != 0) {
-                switch (imm4) {
-                    //add
-                    case 0b0000: registers[regDst] = (registers[rg1] + registers[rg2]) & ander; break;
-                    //minus
-                    case 0b0001: registers[regDst] = (registers[rg1] - registers[rg2]) & ander; break;
-                    //or
-                    case 0b0010: registers[regDst] = (registers[rg1] | registers[rg2]) & ander; break;
-                    //and
-                    case 0b0011: registers[regDst] = (registers[rg1] & registers[rg2]) & ander; break;
-                    //jr
-                    case 0b0100: registers[regDst] = (registers[rg1] < registers[rg2]) ? 1 : 0; break;
-                }
-            }
-            if (imm4 == 0b1000) {  // JR (Jump Register)
-                next_pc = registers[rg1] & 0x1FFF;
+        case 0b000:
+            d.rd = extract_bits(instruction, 4, 6);
+            switch (extract_bits(instruction, 0, 3)) {
+                case 0b0000: d.op = OP_ADD; break;
+                case 0b0001: d.op = OP_SUB; break;
+                case 0b0010: d.op = OP_OR; break;
+                case 0b0011: d.op = OP_AND; break;
+                case 0b0100: d.op = OP_SLT; break;
+                case 0b1000: d.op = OP_JR; break;
+                default: d.op = OP_NOP; break;
             }
+            if (d.rd == 0 && d.op != OP_JR)
+                d.op = OP_NOP;
             break;
+        case 0b001: d.op = d.rb ? OP_ADDI : OP_NOP; break;
+        case 0b010: d.op = OP_J; break;
+        case 0b011: d.op = OP_JAL; break;
+        case 0b100: d.op = d.rb ? OP_LW : OP_NOP; break;
+        case 0b101: d.op = OP_SW; break;
+        case 0b110: d.op = OP_JEQ; break;
+        case 0b111: d.op = d.rb ? OP_SLTI : OP_NOP; break;
+    }
 
-        case 0b001:  // ADDI (Add Immediate)
-            rg1 = extract_bits(instruction, 10, 12);
-            regDst = extract_bits(instruction, 7, 9);
-            //important so we can add negatives
-            imm = sign_extend(extract_bits(instruction, 0, 6));
-            //no writing to reg0
-            if (regDst != 0) {
-                registers[regDst] = (registers[rg1] + imm) & 0xFFFF;
-            }
-            break;
+    if (opcode == 0b010 || opcode == 0b011)
+        d.imm = extract_bits(instruction, 0, 12);
+    else
+        d.imm = sign_extend(extract_bits(instruction, 0, 6));
+    return d;
+}
 
-        case 0b010:  // J (Jump)
-            imm = extract_bits(instruction, 0, 12);
-            next_pc = imm;
-            break;
+// Longest straight-line run translated into one block
+size_t const static MAX_BLOCK_LEN = 64;
 
-        case 0b011:  // JAL (Jump and Link)
-            imm = extract_bits(instruction, 0, 12);
-            registers[7] = pc + 1;  // Store return address
-            next_pc = imm;
-            break;
+// A micro-op is a decoded instruction plus its offset from the block start
+struct micro_op {
+    uint8_t op;
+    uint8_t ra, rb, rd;
+    uint16_t imm;
+    uint16_t offset;
+};
 
-        case 0b100:  // LW (Load Word)
-            rg1 = extract_bits(instruction, 10, 12);
-            regDst = extract_bits(instruction, 7, 9);
-            imm = sign_extend(extract_bits(instruction, 0, 6));
-            //memory overload
-            addr = (registers[rg1] + imm) & (MEM_SIZE - 1);
-            if (regDst != 0) {
-                registers[regDst] = memory[addr];
-            }
-            break;
+// Cached link from a block exit to the block that ran next
+struct block_link {
+    struct translated_block *block;
+    uint16_t target;
+    unsigned generation;
+};
 
-        case 0b101:  // SW (Store Word)
-            rg1 = extract_bits(instruction, 10, 12);
-            rg2 = extract_bits(instruction, 7, 9);
-            imm = sign_extend(extract_bits(instruction, 0, 6));
-            addr = (registers[rg1] + imm) & (MEM_SIZE - 1);
-            //write to memory
-            memory[addr] = registers[rg2];
-            break;
+/*
+    A basic block translated into micro-ops. ops holds the straight-line
+    instructions with NOPs dropped, followed by the J/JAL/JR/JEQ that ends
+    the block, or by OP_FALLTHROUGH when the block was cut at MAX_BLOCK_LEN
+    or the end of memory. links[0] is the jump (or only) successor,
+    links[1] the JEQ fall-through.
+*/
+struct translated_block {
+    uint16_t start;
+    uint16_t length;
+    vector<micro_op> ops;
+    block_link links[2];
+    // Set once the J ending the block is found not to close a counted loop
+    bool not_counted;
+    // Times each link was left by while profiling, not yet added to the
+    // per-pc counts
+    uint64_t exits[2];
+};
 
-        case 0b110:  // JEQ (Jump if Equal)
-            rg1 = extract_bits(instruction, 10, 12);
-            rg2 = extract_bits(instruction, 7, 9);
-            imm = sign_extend(extract_bits(instruction, 0, 6));
-            //geck if reg values are equal
-            if (registers[rg1] == registers[rg2]) {
-                next_pc = pc + 1 + imm;
-            }
-            break;
+/*
+    Everything one simulated E20 needs: its memory, registers and pc, plus
+    the decoded instructions and translated blocks cached for it. Machines
+    share nothing, so several can run at once on different threads.
+*/
+struct machine_state {
+    uint16_t memory[MEM_SIZE] = {0};
+    uint16_t registers[NUM_REGS] = {0};
+    uint16_t pc = 0;
+
+    decoded_instr decoded[MEM_SIZE] = {};
+    translated_block *block_cache[MEM_SIZE] = {};
+    // Number of translated blocks covering each memory word
+    uint8_t code_refs[MEM_SIZE] = {0};
+    // Bumped whenever a block is thrown away; links from an older generation are stale.
+    // Starts at 1 so the zeroed links of a new block (to pc 0) never look current
+    unsigned block_generation = 1;
+
+    machine_state() = default;
+    machine_state(const machine_state &) = delete;
+    machine_state &operator=(const machine_state &) = delete;
+    ~machine_state() {
+        for (translated_block *b : block_cache)
+            delete b;
+    }
+};
+
+/**
+ * Simulates the execution of E20 machine code.
+ */
+void simulate(machine_state &m) {
+    flat_memory memory{m.memory};
+    no_hook hook;
+    bool halted;
+    run_e20_for(memory, m.registers, m.pc, hook, UINT64_MAX, halted);
+}
+
+/**
+ * Simulates like simulate(), but stops once instructions (counted from the
+ * start of the program) reaches at_instr, or just before pc reaches at_pc.
+ * Returns true if the machine halted first.
+ */
+bool simulate_until(machine_state &m, uint64_t &instructions, uint64_t at_instr, int at_pc) {
+    flat_memory memory{m.memory};
+    no_hook hook;
+    bool halted = false;
+    while (instructions < at_instr && m.pc != at_pc && !halted)
+        instructions += run_e20_for(memory, m.registers, m.pc, hook, 1, halted);
+    return halted;
+}
+
+// Instruction kinds the profile's mix counts, one per opcode or function
+enum instr_class : uint8_t {
+    CLASS_ADD, CLASS_SUB, CLASS_OR, CLASS_AND, CLASS_SLT, CLASS_JR, CLASS_OTHER,
+    CLASS_ADDI, CLASS_J, CLASS_JAL, CLASS_LW, CLASS_SW, CLASS_JEQ, CLASS_SLTI,
+    NUM_INSTR_CLASSES
+};
+
+const char *const CLASS_NAMES[NUM_INSTR_CLASSES] = {
+    "add", "sub", "or", "and", "slt", "jr", "other",
+    "addi", "j", "jal", "lw", "sw", "jeq", "slti"};
+
+// Classifies an instruction word; op 0 with an unused function is "other"
+instr_class classify_instruction(uint16_t instruction) {
+    static const instr_class functions[16] = {
+        CLASS_ADD, CLASS_SUB, CLASS_OR, CLASS_AND, CLASS_SLT, CLASS_OTHER, CLASS_OTHER, CLASS_OTHER,
+        CLASS_JR, CLASS_OTHER, CLASS_OTHER, CLASS_OTHER, CLASS_OTHER, CLASS_OTHER, CLASS_OTHER, CLASS_OTHER};
+    static const instr_class opcodes[8] = {
+        CLASS_OTHER, CLASS_ADDI, CLASS_J, CLASS_JAL, CLASS_LW, CLASS_SW, CLASS_JEQ, CLASS_SLTI};
+    uint16_t opcode = extract_bits(instruction, 13, 15);
+    return opcode == 0 ? functions[extract_bits(instruction, 0, 3)] : opcodes[opcode];
+}
+
+/*
+    Disassembles the instruction at pc, giving jump and branch targets as
+    absolute addresses.
+*/
+string disassemble(uint16_t instruction, uint16_t pc) {
+    instr_class c = classify_instruction(instruction);
+    unsigned ra = extract_bits(instruction, 10, 12);
+    unsigned rb = extract_bits(instruction, 7, 9);
+    unsigned rd = extract_bits(instruction, 4, 6);
+    int16_t imm = sign_extend(extract_bits(instruction, 0, 6));
+    unsigned imm13 = extract_bits(instruction, 0, 12);
+    ostringstream out;
+    out << CLASS_NAMES[c];
+    switch (c) {
+        case CLASS_JR: out << " $" << ra; break;
+        case CLASS_OTHER: out << " 0x" << hex << instruction; break;
+        case CLASS_J:
+        case CLASS_JAL: out << " " << imm13; break;
+        case CLASS_ADDI:
+        case CLASS_SLTI: out << " $" << rb << ", $" << ra << ", " << imm; break;
+        case CLASS_LW:
+        case CLASS_SW: out << " $" << rb << ", " << imm << "($" << ra << ")"; break;
+        case CLASS_JEQ: out << " $" << ra << ", $" << rb << ", " << ((pc + 1 + imm) & (MEM_SIZE - 1)); break;
+        default: out << " $" << rd << ", $" << ra << ", $" << rb; break;
+    }
+    return out.str();
+}
+
+// Sections of the profile report list this many of their hottest entries
+size_t const static PROFILE_TOP = 20;
+// Calls nested deeper than this are charged to the deepest context
+size_t const static MAX_CALL_DEPTH = 1024;
+// JALs and JRs logged before they are followed through the contexts
+size_t const static CALL_LOG_CHUNK = 1 << 16;
+
+// A function entered from a particular chain of callers
+struct call_context {
+    uint32_t parent;
+    uint16_t entry;
+    uint64_t instructions; // run in this context itself, not in its callees
+    uint32_t last_child;   // the context it called last, 0 for none yet
+};
+
+// A JAL or JR taken while following calls, and the instructions run up to it
+struct call_event {
+    uint64_t instructions;
+    uint16_t pc;
+    uint16_t target;
+    bool jal;
+};
+
+/*
+    The counters of a profile. Every counter is a flat array over the
+    address space. J and JEQ targets are fixed, so loops are only worked
+    out when the run finishes.
+
+    The opcode mix and loops come from the per-pc counts at the end. A
+    word's counts are folded in before a SW overwrites it, so
+    self-modifying code is still counted as the instructions that
+    actually ran.
+
+    Calls are JALs and returns are JRs to the address on top of the
+    shadow stack of return addresses; each distinct chain of calls gets
+    a context for the folded stacks. A JAL to the very next word (the
+    usual way to read pc) isn't a call. The run only logs its JALs and
+    JRs, and the log is followed through the contexts a chunk at a time.
+*/
+struct profiler {
+    const uint16_t *memory;
+    vector<uint64_t> counts = vector<uint64_t>(MEM_SIZE);       // executions per pc
+    vector<uint64_t> taken = vector<uint64_t>(MEM_SIZE);        // jumps made by the instruction at pc
+    vector<uint64_t> folded = vector<uint64_t>(MEM_SIZE);       // of counts, already in mix
+    vector<uint64_t> folded_taken = vector<uint64_t>(MEM_SIZE); // of taken, already in back_edges
+    vector<uint64_t> back_edges = vector<uint64_t>(MEM_SIZE);   // backward J/JEQs to each loop head
+    vector<uint16_t> loop_end = vector<uint16_t>(MEM_SIZE);     // furthest J/JEQ back to each head
+    uint64_t mix[NUM_INSTR_CLASSES] = {};
+    uint64_t instructions = 0;
+
+    vector<call_event> calls = vector<call_event>(CALL_LOG_CHUNK);
+    size_t logged = 0; // of calls, not yet followed
+    vector<call_context> contexts = {{0, 0, 0, 0}};
+    unordered_map<uint64_t, uint32_t> children; // (parent << 16 | entry) -> context
+    vector<uint16_t> returns;
+    uint32_t context = 0;
+    uint64_t context_start = 0;
+
+    explicit profiler(const uint16_t memory[]) : memory(memory) {}
 
-        case 0b111:  // SLTI (Set Less Than Immediate)
-            rg1 = extract_bits(instruction, 10, 12);
-            regDst = extract_bits(instruction, 7, 9);
-            imm = sign_extend(extract_bits(instruction, 0, 6));
-            if (regDst != 0) {
-                registers[regDst] = (registers[rg1] < imm) ? 1 : 0;
+    void log_call(uint16_t pc, uint16_t target, bool jal) {
+        calls[logged++] = {instructions, pc, target, jal};
+        if (logged == CALL_LOG_CHUNK)
+            follow_calls();
+    }
+
+    // Folds addr's counts into the mix and loops before its word changes
+    void fold(uint16_t addr) {
+        uint16_t instr = memory[addr];
+        instr_class c = classify_instruction(instr);
+        mix[c] += counts[addr] - folded[addr];
+        folded[addr] = counts[addr];
+
+        uint16_t target = c == CLASS_J ? extract_bits(instr, 0, 12)
+                                       : (addr + 1 + sign_extend(extract_bits(instr, 0, 6))) % MEM_SIZE;
+        if ((c == CLASS_J || c == CLASS_JEQ) && target < addr) {
+            back_edges[target] += taken[addr] - folded_taken[addr];
+            loop_end[target] = max(loop_end[target], addr);
+        }
+        folded_taken[addr] = taken[addr];
+    }
+
+    // Called once the run has halted and every count is in, before the
+    // counters are read
+    void finish() {
+        follow_calls();
+        instructions = 0;
+        for (uint16_t addr = 0; addr < MEM_SIZE; addr++) {
+            instructions += counts[addr];
+            if (counts[addr] != folded[addr] || taken[addr] != folded_taken[addr])
+                fold(addr);
+        }
+        charge(instructions);
+    }
+
+private:
+    __attribute__((noinline)) void follow_calls() {
+        for (size_t i = 0; i < logged; i++) {
+            const call_event &e = calls[i];
+            uint16_t to = e.target % MEM_SIZE;
+            if (e.jal && to != e.pc && e.target != uint16_t(e.pc + 1) && returns.size() < MAX_CALL_DEPTH) {
+                charge(e.instructions);
+                context = child(to);
+                returns.push_back(e.pc + 1);
+            } else if (!e.jal && e.target != e.pc && !returns.empty() && returns.back() == e.target) {
+                charge(e.instructions);
+                context = contexts[context].parent;
+                returns.pop_back();
             }
-            break;
+        }
+        logged = 0;
+    }
+
+    // The context for a call from the current one to entry
+    uint32_t child(uint16_t entry) {
+        uint32_t last = contexts[context].last_child;
+        if (last != 0 && contexts[last].entry == entry)
+            return last;
+        uint64_t key = uint64_t(context) << 16 | entry;
+        auto it = children.find(key);
+        if (it == children.end()) {
+            it = children.emplace(key, contexts.size()).first;
+            contexts.push_back({context, entry, 0, 0});
+        }
+        contexts[context].last_child = it->second;
+        return it->second;
+    }
+
+    // Charges the instructions since the last call or return to the current context
+    void charge(uint64_t now) {
+        contexts[context].instructions += now - context_start;
+        context_start = now;
+    }
+};
+
+/*
+    Prints the opcode mix, hottest instructions, JEQ outcomes and hot
+    loops of a finished profile, each sorted hottest first.
+*/
+void print_profile(const profiler &p, ostream &out) {
+    auto percent = [&](uint64_t n) { return p.instructions ? 100.0 * n / p.instructions : 0.0; };
+    auto hottest = [](vector<uint16_t> &pcs, const vector<uint64_t> &key) {
+        stable_sort(pcs.begin(), pcs.end(), [&](uint16_t a, uint16_t b) { return key[a] > key[b]; });
+        if (pcs.size() > PROFILE_TOP)
+            pcs.resize(PROFILE_TOP);
+    };
+    out << fixed << setprecision(2) << setfill(' ');
+    out << "Profile: " << p.instructions << " instructions" << endl;
+
+    out << "Instruction mix:" << endl;
+    vector<int> classes;
+    for (int c = 0; c < NUM_INSTR_CLASSES; c++)
+        if (p.mix[c])
+            classes.push_back(c);
+    stable_sort(classes.begin(), classes.end(), [&](int a, int b) { return p.mix[a] > p.mix[b]; });
+    for (int c : classes)
+        out << "  " << left << setw(6) << CLASS_NAMES[c] << right << setw(14) << p.mix[c] << setw(8)
+            << percent(p.mix[c]) << "%" << endl;
+
+    vector<uint16_t> ran, branches, heads;
+    for (uint16_t pc = 0; pc < MEM_SIZE; pc++) {
+        if (p.counts[pc])
+            ran.push_back(pc);
+        if (p.counts[pc] && classify_instruction(p.memory[pc]) == CLASS_JEQ)
+            branches.push_back(pc);
+        if (p.back_edges[pc])
+            heads.push_back(pc);
+    }
+
+    out << "Hottest instructions:" << endl;
+    out << "     pc           count        %  instruction" << endl;
+    hottest(ran, p.counts);
+    for (uint16_t pc : ran)
+        out << setw(7) << pc << setw(16) << p.counts[pc] << setw(9) << percent(p.counts[pc]) << "  "
+            << disassemble(p.memory[pc], pc) << endl;
+
+    out << "Branches (jeq):" << endl;
+    out << "     pc        executed           taken       not taken  taken %" << endl;
+    hottest(branches, p.counts);
+    for (uint16_t pc : branches)
+        out << setw(7) << pc << setw(16) << p.counts[pc] << setw(16) << p.taken[pc] << setw(16)
+            << p.counts[pc] - p.taken[pc] << setw(9) << 100.0 * p.taken[pc] / p.counts[pc] << endl;
+
+    out << "Hot loops:" << endl;
+    out << "   head     end      back edges    instructions        %" << endl;
+    vector<uint64_t> body(MEM_SIZE);
+    for (uint16_t head : heads)
+        for (uint16_t pc = head; pc <= p.loop_end[head]; pc++)
+            body[head] += p.counts[pc];
+    hottest(heads, body);
+    for (uint16_t head : heads)
+        out << setw(7) << head << setw(8) << p.loop_end[head] << setw(16) << p.back_edges[head] << setw(16)
+            << body[head] << setw(9) << percent(body[head]) << endl;
+}
+
+/*
+    Writes one line per calling context that ran any instructions, in the
+    folded-stack format flame graph tools read: the chain of functions
+    from "main" down, separated by semicolons, then the instruction count.
+    Functions are named by their entry address.
+*/
+bool write_folded_stacks(const profiler &p, const string &filename) {
+    ofstream out(filename);
+    if (!out.is_open())
+        return false;
+    for (size_t id = 0; id < p.contexts.size(); id++) {
+        if (!p.contexts[id].instructions)
+            continue;
+        string stack;
+        for (size_t c = id; c != 0; c = p.contexts[c].parent)
+            stack = ";fn_" + to_string(p.contexts[c].entry) + stack;
+        out << "main" << stack << " " << p.contexts[id].instructions << "\n";
+    }
+    return bool(out.flush());
+}
+
+/*
+    Skips the iterations of the counted loop that the J at tail closes by
+    jumping back to head, if it is one, as run_e20_for does. Out of line,
+    so the dispatch loops that call it keep their registers.
 
+    @param budget Instructions left before the run's limit, or UINT64_MAX
+        for none; the skipped ones are taken off it
+    @return false if it isn't a counted loop
+*/
+__attribute__((noinline)) bool skip_loop_back(machine_state &m, uint16_t head, uint16_t tail, uint64_t &budget) {
+    flat_memory memory{m.memory};
+    uint64_t length = tail - head + 1;
+    uint64_t trips;
+    if (!skip_counted_loop(memory, m.registers, head, tail, budget == UINT64_MAX ? budget : budget / length, trips))
+        return false;
+    if (budget != UINT64_MAX)
+        budget -= trips * length;
+    return true;
+}
+
+// GCC and Clang support labels as values, which lets every handler jump
+// straight to the next one. Other compilers get the same handlers in a switch.
+#if defined(__GNUC__)
+#define E20_THREADED_DISPATCH 1
+#endif
+
+/**
+ * Simulates the execution of E20 machine code from the predecoded table.
+ * Each word is decoded the first time it is executed; SW resets the slot it
+ * writes so self-modifying programs see their new instructions. A J back to
+ * the top of a counted loop skips its iterations, as run_e20_for does.
+ * If Limited, stops before the instruction that would overrun budget, and
+ * takes the instructions run off budget. Returns true if the machine halted.
+ */
+template <bool Limited>
+bool run_predecoded(machine_state &m, uint64_t &budget_io) {
+    uint16_t *regs = m.registers;
+    uint16_t *memory = m.memory;
+    decoded_instr *decoded = m.decoded;
+    uint16_t cur = m.pc;
+    uint16_t target;
+    const decoded_instr *d;
+    rejected_tails rejected;
+    uint64_t budget = Limited ? budget_io : UINT64_MAX;
+
+#ifdef E20_THREADED_DISPATCH
+    static void *const handlers[NUM_DECODED_OPS] = {
+        &&do_OP_DECODE, &&do_OP_NOP,
+        &&do_OP_ADD, &&do_OP_SUB, &&do_OP_OR, &&do_OP_AND, &&do_OP_SLT, &&do_OP_JR,
+        &&do_OP_ADDI, &&do_OP_J, &&do_OP_JAL, &&do_OP_LW, &&do_OP_SW, &&do_OP_JEQ, &&do_OP_SLTI,
+    };
+#define HANDLER(op) do_##op:
+#define NEXT_INSTRUCTION                        \
+    do {                                        \
+        if (Limited && budget-- == 0)           \
+            goto out_of_budget;                 \
+        d = &decoded[cur & (MEM_SIZE - 1)];     \
+        goto *handlers[d->op];                  \
+    } while (0)
+
+    NEXT_INSTRUCTION;
+#else
+#define HANDLER(op) case op:
+#define NEXT_INSTRUCTION continue
+
+    for (;;) {
+        if (Limited && budget-- == 0)
+            goto out_of_budget;
+        d = &decoded[cur & (MEM_SIZE - 1)];
+        switch (d->op) {
+#endif
+
+    HANDLER(OP_DECODE)
+        decoded[cur & (MEM_SIZE - 1)] = decode_instruction(memory[cur & (MEM_SIZE - 1)]);
+        // Decoding isn't an instruction; the word is dispatched again
+        if (Limited)
+            budget++;
+        NEXT_INSTRUCTION;
+    HANDLER(OP_NOP)
+        cur++;
+        NEXT_INSTRUCTION;
+    HANDLER(OP_ADD)
+        regs[d->rd] = regs[d->ra] + regs[d->rb];
+        cur++;
+        NEXT_INSTRUCTION;
+    HANDLER(OP_SUB)
+        regs[d->rd] = regs[d->ra] - regs[d->rb];
+        cur++;
+        NEXT_INSTRUCTION;
+    HANDLER(OP_OR)
+        regs[d->rd] = regs[d->ra] | regs[d->rb];
+        cur++;
+        NEXT_INSTRUCTION;
+    HANDLER(OP_AND)
+        regs[d->rd] = regs[d->ra] & regs[d->rb];
+        cur++;
+        NEXT_INSTRUCTION;
+    HANDLER(OP_SLT)
+        regs[d->rd] = regs[d->ra] < regs[d->rb];
+        cur++;
+        NEXT_INSTRUCTION;
+    HANDLER(OP_JR)
+        target = regs[d->ra] & (MEM_SIZE - 1);
+        if (target == cur)
+            goto halted;
+        cur = target;
+        NEXT_INSTRUCTION;
+    HANDLER(OP_ADDI)
+        regs[d->rb] = regs[d->ra] + d->imm;
+        cur++;
+        NEXT_INSTRUCTION;
+    HANDLER(OP_J)
+        target = d->imm;
+        if (target == cur)
+            goto halted;
+        if (target < cur && !rejected.has(cur) && !skip_loop_back(m, target, cur, budget))
+            rejected.add(cur);
+        cur = target;
+        NEXT_INSTRUCTION;
+    HANDLER(OP_JAL)
+        regs[7] = cur + 1;
+        target = d->imm;
+        if (target == cur)
+            goto halted;
+        cur = target;
+        NEXT_INSTRUCTION;
+    HANDLER(OP_LW)
+        regs[d->rb] = memory[(regs[d->ra] + d->imm) & (MEM_SIZE - 1)];
+        cur++;
+        NEXT_INSTRUCTION;
+    HANDLER(OP_SW) {
+        unsigned addr = (regs[d->ra] + d->imm) & (MEM_SIZE - 1);
+        memory[addr] = regs[d->rb];
+        decoded[addr].op = OP_DECODE;
+        rejected.remove(addr);
+        cur++;
+        NEXT_INSTRUCTION;
+    }
+    HANDLER(OP_JEQ)
+        if (regs[d->ra] != regs[d->rb]) {
+            cur++;
+            NEXT_INSTRUCTION;
+        }
+        target = cur + 1 + d->imm;
+        if ((target & (MEM_SIZE - 1)) == cur)
+            goto halted;
+        cur = target;
+        NEXT_INSTRUCTION;
+    HANDLER(OP_SLTI)
+        regs[d->rb] = regs[d->ra] < d->imm;
+        cur++;
+        NEXT_INSTRUCTION;
+
+#ifndef E20_THREADED_DISPATCH
         default:
-            cerr << "Unknown opcode " << opcode << " at pc=" << pc << endl;
+            cerr << "Unknown handler " << unsigned(d->op) << " at pc=" << cur << endl;
             exit(EXIT_FAILURE);
+        }
+    }
+#endif
+
+#undef HANDLER
+#undef NEXT_INSTRUCTION
+
+halted:
+    m.pc = target;
+    if (Limited)
+        budget_io = budget;
+    return true;
+
+out_of_budget:
+    m.pc = cur;
+    budget_io = 0;
+    return false;
+}
+
+void simulate_predecoded(machine_state &m) {
+    uint64_t budget = UINT64_MAX;
+    run_predecoded<false>(m, budget);
+}
+
+/*
+    Translates the basic block starting at memory word start.
+*/
+translated_block *translate_block(machine_state &m, uint16_t start) {
+    translated_block *b = new translated_block();
+    b->start = start;
+
+    uint16_t offset = 0;
+    bool ended = false;
+    while (!ended && offset < MAX_BLOCK_LEN && start + offset < MEM_SIZE) {
+        decoded_instr d = decode_instruction(m.memory[start + offset]);
+        micro_op u = {d.op, d.ra, d.rb, d.rd, d.imm, offset};
+        offset++;
+        ended = d.op == OP_J || d.op == OP_JAL || d.op == OP_JR || d.op == OP_JEQ;
+        if (d.op != OP_NOP)
+            b->ops.push_back(u);
     }
+    b->length = offset;
+    if (!ended)
+        b->ops.push_back({OP_FALLTHROUGH, 0, 0, 0, 0, uint16_t(offset - 1)});
 
-    registers[0] = 0;  // Ensure register 0 is immutable
-    return next_pc;
+    for (size_t i = 0; i < b->length; i++)
+        m.code_refs[start + i]++;
+    m.block_cache[start] = b;
+    return b;
 }
 
+/*
+    Throws away every translated block that covers memory word addr.
+*/
+void invalidate_blocks(machine_state &m, unsigned addr) {
+    unsigned first = addr >= MAX_BLOCK_LEN ? addr - MAX_BLOCK_LEN + 1 : 0;
+    for (unsigned start = first; start <= addr; start++) {
+        translated_block *b = m.block_cache[start];
+        if (b == nullptr || start + b->length <= addr)
+            continue;
+        for (size_t i = 0; i < b->length; i++)
+            m.code_refs[start + i]--;
+        m.block_cache[start] = nullptr;
+        delete b;
+    }
+    m.block_generation++;
+}
+
+// What run_blocks does for a plain run: nothing, and counted loops are skipped
+struct no_block_profile {
+    uint64_t budget = UINT64_MAX; // never runs out
+
+    bool enter(translated_block *) { return true; }
+    void leave(translated_block *, int) {}
+    void jump(uint8_t, uint16_t, uint16_t) {}
+    void sw(machine_state &, translated_block *, uint16_t, unsigned) {}
+
+    bool skip_loop(machine_state &m, uint16_t head, uint16_t tail) {
+        return skip_loop_back(m, head, tail, budget);
+    }
+};
+
+/*
+    Stops run_blocks once budget instructions have run. A block is only
+    entered if all of it fits in what is left, so run_blocks can stop
+    short of the limit; the caller runs the rest one instruction at a
+    time. A SW that leaves its block early gives back the words skipped.
+*/
+struct limited_block_profile {
+    uint64_t budget;
+
+    bool enter(translated_block *b) {
+        if (budget < b->length)
+            return false;
+        budget -= b->length;
+        return true;
+    }
+
+    void leave(translated_block *, int) {}
+    void jump(uint8_t, uint16_t, uint16_t) {}
+
+    void sw(machine_state &, translated_block *b, uint16_t offset, unsigned) {
+        budget += b->length - offset - 1u;
+    }
+
+    bool skip_loop(machine_state &m, uint16_t head, uint16_t tail) {
+        return skip_loop_back(m, head, tail, budget);
+    }
+};
+
+/*
+    Feeds a profiler from run_blocks. Leaving a block by one of its links
+    costs one increment of that link's exit count. Every instruction of
+    a block runs each time it is left that way, and a jump ending it is
+    taken each time it is left by links[0]; the counts become per-pc
+    counts only when the block is flushed, which happens before a SW
+    could change or throw away the words it covers, and at the end. A
+    SW that leaves its block early counts the words up to it there and
+    then. A skipped counted loop adds its iterations to the counts of
+    its words.
+
+    With Calls, leaving a block also adds to the instruction count, and
+    JALs and JRs are logged for the folded stacks.
+*/
+template <bool Calls>
+struct block_profile {
+    profiler &p;
+
+    bool enter(translated_block *) { return true; }
+
+    void leave(translated_block *b, int exit) {
+        b->exits[exit]++;
+        if (Calls)
+            p.instructions += b->length;
+    }
+
+    void jump(uint8_t op, uint16_t pc, uint16_t target) {
+        if (Calls && (op == OP_JAL || op == OP_JR))
+            p.log_call(pc, target, op == OP_JAL);
+    }
+
+    // Called before the SW at b's offset stores into translated code at
+    // addr, so run_blocks leaves b after it and throws away the blocks
+    // covering addr. Their words are folded now, while they still hold
+    // the instructions that ran; every word with counts not yet folded
+    // is then covered by a block that is still there, so a SW anywhere
+    // else needs nothing.
+    __attribute__((noinline)) void sw(machine_state &m, translated_block *b, uint16_t offset, unsigned addr) {
+        flush(b);
+        for (size_t i = 0; i <= offset; i++)
+            p.counts[b->start + i]++;
+        if (Calls)
+            p.instructions += offset + 1u;
+        unsigned first = addr >= MAX_BLOCK_LEN ? addr - MAX_BLOCK_LEN + 1 : 0;
+        for (unsigned start = first; start <= addr; start++) {
+            translated_block *gone = m.block_cache[start];
+            if (gone == nullptr || start + gone->length <= addr)
+                continue;
+            flush(gone);
+            for (size_t i = 0; i < gone->length; i++)
+                p.fold(start + i);
+        }
+    }
+
+    __attribute__((noinline)) bool skip_loop(machine_state &m, uint16_t head, uint16_t tail) {
+        flat_memory memory{m.memory};
+        uint64_t trips;
+        if (!skip_counted_loop(memory, m.registers, head, tail, UINT64_MAX, trips))
+            return false;
+        // Folded right away, as a block may not cover all of the loop
+        p.taken[tail] += trips;
+        for (uint16_t pc = head; pc <= tail; pc++) {
+            p.counts[pc] += trips;
+            p.fold(pc);
+        }
+        if (Calls)
+            p.instructions += trips * (tail - head + 1);
+        return true;
+    }
+
+    void flush(translated_block *b) {
+        for (size_t i = 0; i < b->length; i++)
+            p.counts[b->start + i] += b->exits[0] + b->exits[1];
+        if (b->ops.back().op != OP_FALLTHROUGH)
+            p.taken[b->start + b->length - 1] += b->exits[0];
+        b->exits[0] = b->exits[1] = 0;
+    }
+
+    // Flushes every block, then lets the profiler fold its counts
+    void finish(machine_state &m) {
+        for (translated_block *b : m.block_cache)
+            if (b != nullptr)
+                flush(b);
+        p.finish();
+    }
+};
+
 /**
- * Simulates the execution of E20 machine code.
+ * Simulates the execution of E20 machine code one translated block at a time.
+ * A block remembers which block ran after each of its exits, so hot loops go
+ * from block to block without looking anything up. SW into a translated
+ * range throws the affected blocks away and leaves the current block.
+ * Counted loops are skipped at their J back to the top, as in run_e20_for,
+ * through Profile (no_block_profile, limited_block_profile or
+ * block_profile). Stops before a block Profile won't enter.
+ * Returns true if the machine halted.
  */
-void simulate() {
+template <class Profile>
+bool run_blocks(machine_state &m, Profile &profile) {
+    uint16_t *regs = m.registers;
+    uint16_t *memory = m.memory;
+    const uint8_t *code_refs = m.code_refs;
+    uint16_t cur = m.pc;
+    // base is the full 16 bit pc of the block entry; it differs from
+    // b->start only after a JEQ has carried pc past the end of memory
+    uint16_t base;
+    uint16_t target;
+    unsigned addr;
+    translated_block *b;
+    block_link *link;
+    const micro_op *u;
+
+#ifdef E20_THREADED_DISPATCH
+    static void *const handlers[NUM_MICRO_OPS] = {
+        &&do_OP_DECODE, &&do_OP_NOP,
+        &&do_OP_ADD, &&do_OP_SUB, &&do_OP_OR, &&do_OP_AND, &&do_OP_SLT, &&do_OP_JR,
+        &&do_OP_ADDI, &&do_OP_J, &&do_OP_JAL, &&do_OP_LW, &&do_OP_SW, &&do_OP_JEQ, &&do_OP_SLTI,
+        &&do_OP_FALLTHROUGH,
+    };
+#define HANDLER(op) do_##op:
+#define NEXT_MICRO_OP goto *handlers[(++u)->op]
+#define RUN_BLOCK goto *handlers[u->op]
+#else
+#define HANDLER(op) case op:
+#define NEXT_MICRO_OP u++; continue
+#define RUN_BLOCK
+#endif
+
+    b = m.block_cache[cur & (MEM_SIZE - 1)];
+    if (b == nullptr)
+        b = translate_block(m, cur & (MEM_SIZE - 1));
+
+enter:
+    base = cur;
+    if (!profile.enter(b)) {
+        m.pc = cur;
+        return false;
+    }
+    u = b->ops.data();
+    RUN_BLOCK;
+
+#ifndef E20_THREADED_DISPATCH
+    for (;;) {
+        switch (u->op) {
+#endif
+
+    HANDLER(OP_ADD)
+        regs[u->rd] = regs[u->ra] + regs[u->rb];
+        NEXT_MICRO_OP;
+    HANDLER(OP_SUB)
+        regs[u->rd] = regs[u->ra] - regs[u->rb];
+        NEXT_MICRO_OP;
+    HANDLER(OP_OR)
+        regs[u->rd] = regs[u->ra] | regs[u->rb];
+        NEXT_MICRO_OP;
+    HANDLER(OP_AND)
+        regs[u->rd] = regs[u->ra] & regs[u->rb];
+        NEXT_MICRO_OP;
+    HANDLER(OP_SLT)
+        regs[u->rd] = regs[u->ra] < regs[u->rb];
+        NEXT_MICRO_OP;
+    HANDLER(OP_ADDI)
+        regs[u->rb] = regs[u->ra] + u->imm;
+        NEXT_MICRO_OP;
+    HANDLER(OP_LW)
+        regs[u->rb] = memory[(regs[u->ra] + u->imm) & (MEM_SIZE - 1)];
+        NEXT_MICRO_OP;
+    HANDLER(OP_SLTI)
+        regs[u->rb] = regs[u->ra] < u->imm;
+        NEXT_MICRO_OP;
+    HANDLER(OP_SW)
+        addr = (regs[u->ra] + u->imm) & (MEM_SIZE - 1);
+        if (code_refs[addr] == 0) {
+            memory[addr] = regs[u->rb];
+            NEXT_MICRO_OP;
+        }
+        // b may be gone after this, so leave right away
+        profile.sw(m, b, u->offset, addr);
+        memory[addr] = regs[u->rb];
+        cur = base + u->offset + 1;
+        invalidate_blocks(m, addr);
+        link = nullptr;
+        goto dispatch;
+
+    HANDLER(OP_J)
+        target = u->imm;
+        if (target < uint16_t(base + u->offset) && !b->not_counted)
+            b->not_counted = !profile.skip_loop(m, target, uint16_t(base + u->offset));
+        link = &b->links[0];
+        goto leave;
+    HANDLER(OP_JAL)
+        regs[7] = uint16_t(base + u->offset + 1);
+        target = u->imm;
+        link = &b->links[0];
+        goto leave;
+    HANDLER(OP_JR)
+        target = regs[u->ra] & (MEM_SIZE - 1);
+        link = &b->links[0];
+        goto leave;
+    HANDLER(OP_JEQ)
+        if (regs[u->ra] != regs[u->rb]) {
+            cur = base + u->offset + 1;
+            link = &b->links[1];
+            profile.leave(b, 1);
+            goto dispatch;
+        }
+        target = base + u->offset + 1 + u->imm;
+        link = &b->links[0];
+        goto leave;
+    HANDLER(OP_FALLTHROUGH)
+        cur = base + b->length;
+        link = &b->links[0];
+        profile.leave(b, 0);
+        goto dispatch;
+
+    HANDLER(OP_DECODE)
+    HANDLER(OP_NOP)
+        // never emitted into a block
+        cerr << "Bad micro-op at pc=" << base + u->offset << endl;
+        exit(EXIT_FAILURE);
+
+#ifndef E20_THREADED_DISPATCH
+        }
+    }
+#endif
+
+#undef HANDLER
+#undef NEXT_MICRO_OP
+#undef RUN_BLOCK
+
+leave:
+    profile.leave(b, 0);
+    profile.jump(u->op, uint16_t(base + u->offset), target);
+    if ((target & (MEM_SIZE - 1)) == uint16_t(base + u->offset)) {
+        m.pc = target;
+        return true;
+    }
+    cur = target;
+
+dispatch:
+    if (link != nullptr && link->generation == m.block_generation &&
+        link->target == (cur & (MEM_SIZE - 1))) {
+        b = link->block;
+        goto enter;
+    }
+    {
+        translated_block *next = m.block_cache[cur & (MEM_SIZE - 1)];
+        if (next == nullptr)
+            next = translate_block(m, cur & (MEM_SIZE - 1));
+        if (link != nullptr)
+            *link = {next, uint16_t(cur & (MEM_SIZE - 1)), m.block_generation};
+        b = next;
+    }
+    goto enter;
+}
+
+void simulate_blocks(machine_state &m) {
+    no_block_profile profile;
+    run_blocks(m, profile);
+}
+
+/*
+    Runs a loaded machine to completion on the block engine with p
+    profiling it, following calls too if Calls.
+*/
+template <bool Calls>
+void simulate_profiled(machine_state &m, profiler &p) {
+    block_profile<Calls> profile{p};
+    run_blocks(m, profile);
+    profile.finish(m);
+}
+
+/*
+    Runs a loaded machine to completion with the named engine.
+*/
+void run_machine(machine_state &m, const string &engine) {
+    if (engine == "interp")
+        simulate(m);
+    else if (engine == "predecode")
+        simulate_predecoded(m);
+    else
+        simulate_blocks(m);
+}
+
+/*
+    Runs a loaded machine with the named engine until it halts or limit
+    instructions have run, skipping counted loops only as far as the
+    limit. Returns true if it halted.
+*/
+bool run_machine_for(machine_state &m, const string &engine, uint64_t limit) {
     bool halted = false;
+    if (engine == "predecode")
+        halted = run_predecoded<true>(m, limit);
+    else if (engine != "interp") {
+        limited_block_profile profile{limit};
+        halted = run_blocks(m, profile);
+        limit = profile.budget;
+    }
+    if (!halted) {
+        // The interp engine, or the rest of the limit after the last
+        // block that fit in it
+        flat_memory memory{m.memory};
+        no_hook hook;
+        run_e20_for(memory, m.registers, m.pc, hook, limit, halted);
+    }
+    return halted;
+}
+
+// One program of a batch run and the final state (or error) it produced
+struct batch_job {
+    string filename;
+    string output;
+    bool failed = false;
+};
 
-    //run the code while halt isnt seen
-    while (!halted) {
-        unsigned next_pc = execute_instruction(pc, memory, registers);
+/*
+    Loads and runs one batch program on a fresh machine.
+*/
+void run_batch_job(batch_job &job, const string &engine) {
+    unique_ptr<machine_state> m(new machine_state());
+    if (!read_program(job.filename, m->memory, job.output)) {
+        job.failed = true;
+        return;
+    }
+    run_machine(*m, engine);
+
+    ostringstream out;
+    print_state(m->pc, m->registers, m->memory, 128, out);
+    job.output = out.str();
+}
+
+// A worker's share of the batch. The owner takes jobs from the back;
+// workers that run out steal from the front of someone else's queue.
+struct job_queue {
+    mutex lock;
+    deque<size_t> jobs;
+};
+
+/*
+    Runs every job on num_workers threads and hands each finished job to
+    write_result in the original order, from the calling thread.
+*/
+void run_batch(vector<batch_job> &jobs, const string &engine, unsigned num_workers,
+               void (*write_result)(const batch_job &, const string &), const string &outdir) {
+    vector<job_queue> queues(num_workers);
+    // Contiguous slices, so each worker mostly finishes jobs in order
+    for (size_t i = 0; i < jobs.size(); i++)
+        queues[i * num_workers / jobs.size()].jobs.push_front(i);
+
+    mutex done_lock;
+    condition_variable done_cv;
+    vector<bool> done(jobs.size(), false);
+
+    auto take = [&](unsigned self, size_t &job) {
+        {
+            lock_guard<mutex> guard(queues[self].lock);
+            if (!queues[self].jobs.empty()) {
+                job = queues[self].jobs.back();
+                queues[self].jobs.pop_back();
+                return true;
+            }
+        }
+        for (unsigned k = 1; k < num_workers; k++) {
+            job_queue &victim = queues[(self + k) % num_workers];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.jobs.empty()) {
+                job = victim.jobs.front();
+                victim.jobs.pop_front();
+                return true;
+            }
+        }
+        return false;
+    };
+
+    vector<thread> workers;
+    for (unsigned w = 0; w < num_workers; w++) {
+        workers.emplace_back([&, w]() {
+            size_t job;
+            while (take(w, job)) {
+                run_batch_job(jobs[job], engine);
+                lock_guard<mutex> guard(done_lock);
+                done[job] = true;
+                done_cv.notify_one();
+            }
+        });
+    }
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        {
+            unique_lock<mutex> guard(done_lock);
+            done_cv.wait(guard, [&]() { return done[i]; });
+        }
+        write_result(jobs[i], outdir);
+        jobs[i].output.clear();
+        jobs[i].output.shrink_to_fit();
+    }
+    for (thread &t : workers)
+        t.join();
+}
+
+// The file in an output directory a batch program's state goes to: its basename with .out
+string batch_output_name(const string &filename) {
+    string name = filename.substr(filename.find_last_of('/') + 1);
+    return name.substr(0, name.find_last_of('.')) + ".out";
+}
+
+/*
+    Writes a finished batch job: to outdir/<name>.out when an output
+    directory was given, otherwise to stdout under a header line.
+    Errors go to stderr either way.
+*/
+void write_batch_result(const batch_job &job, const string &outdir) {
+    if (job.failed) {
+        cerr << job.filename << ": " << job.output << endl;
+        return;
+    }
+    if (outdir.empty()) {
+        cout << "==> " << job.filename << " <==" << endl << job.output;
+        return;
+    }
+
+    string name = batch_output_name(job.filename);
+    ofstream out(outdir + "/" + name);
+    if (!out.is_open()) {
+        cerr << "Can't open file " << outdir << "/" << name << endl;
+        return;
+    }
+    out << job.output;
+}
+
+// One run of an input sweep: the registers and memory words it starts with
+struct sweep_input {
+    string line;
+    vector<pair<size_t, uint16_t>> regs;
+    vector<pair<uint16_t, uint16_t>> words;
+};
 
-        if (next_pc % MEM_SIZE == pc) {
-            halted = true;
+/*
+    Parses one line of an inputs file: space-separated $R=VALUE and
+    ADDR=VALUE settings, in any base strtoul reads. On failure, stores
+    the message in error and returns false.
+*/
+bool parse_sweep_input(const string &line, sweep_input &input, string &error) {
+    istringstream in(line);
+    string item;
+    input.line = line;
+    while (in >> item) {
+        bool is_reg = item[0] == '$';
+        size_t eq = item.find('=');
+        char *end;
+        unsigned long key = strtoul(item.c_str() + is_reg, &end, 0);
+        bool ok = eq != string::npos && eq > size_t(is_reg) && end == item.c_str() + eq
+            && key < (is_reg ? NUM_REGS : MEM_SIZE);
+        unsigned long value = ok ? strtoul(item.c_str() + eq + 1, &end, 0) : 0;
+        if (!ok || *end != '\0' || end == item.c_str() + eq + 1 || value > UINT16_MAX) {
+            error = "Bad input setting: " + item;
+            return false;
         }
+        if (is_reg)
+            input.regs.push_back({key, value});
+        else
+            input.words.push_back({uint16_t(key), uint16_t(value)});
+    }
+    return true;
+}
 
-        pc = next_pc;
+/*
+    Runs the program once per input, E20_LANES runs at a time in
+    lockstep, and prints each final state under a header line giving
+    its inputs.
+*/
+void run_sweep(const uint16_t program[], const vector<sweep_input> &inputs) {
+    unique_ptr<e20_lockstep> machines(new e20_lockstep());
+    for (size_t first = 0; first < inputs.size(); first += E20_LANES) {
+        int lanes = min(inputs.size() - first, size_t(E20_LANES));
+        machines->load(program, MEM_SIZE, lanes);
+        for (int lane = 0; lane < lanes; lane++) {
+            for (const auto &reg : inputs[first + lane].regs)
+                machines->set_reg(lane, reg.first, reg.second);
+            for (const auto &word : inputs[first + lane].words)
+                machines->write(lane, word.first, word.second);
+        }
+        machines->run();
+
+        for (int lane = 0; lane < lanes; lane++) {
+            uint16_t regs[NUM_REGS], memory[128];
+            for (size_t i = 0; i < NUM_REGS; i++)
+                regs[i] = machines->reg(lane, i);
+            for (uint16_t addr = 0; addr < 128; addr++)
+                memory[addr] = machines->read(lane, addr);
+            ostringstream out;
+            print_state(machines->pc[lane], regs, memory, 128, out);
+            cout << "==> " << inputs[first + lane].line << " <==" << endl << out.str();
+        }
     }
 }
+
 int main(int argc, char *argv[]) {
     // Parse command-line arguments
-    char *filename = nullptr;
+    vector<string> filenames;
     bool do_help = false;
     bool arg_error = false;
+    bool batch = false;
+    string engine = "block";
+    string manifest;
+    string outdir;
+    unsigned num_workers = thread::hardware_concurrency();
+    string checkpoint;
+    string restore;
+    uint64_t at_instr = UINT64_MAX;
+    int at_pc = -1;
+    uint64_t limit = UINT64_MAX;
+    bool profile = false;
+    string folded;
+    string inputs;
 
     for (int i = 1; i < argc; i++) {
         string arg(argv[i]);
         if (arg.rfind("-", 0) == 0) {
             if (arg == "-h" || arg == "--help")
                 do_help = true;
+            else if (arg == "--engine" && i + 1 < argc)
+                engine = argv[++i];
+            else if (arg == "--batch")
+                batch = true;
+            else if (arg == "--manifest" && i + 1 < argc)
+                manifest = argv[++i], batch = true;
+            else if (arg == "--outdir" && i + 1 < argc)
+                outdir = argv[++i];
+            else if (arg == "--jobs" && i + 1 < argc)
+                num_workers = atoi(argv[++i]);
+            else if (arg == "--checkpoint" && i + 1 < argc)
+                checkpoint = argv[++i];
+            else if (arg == "--at-instr" && i + 1 < argc)
+                at_instr = strtoull(argv[++i], nullptr, 10);
+            else if (arg == "--at-pc" && i + 1 < argc)
+                at_pc = strtoul(argv[++i], nullptr, 0);
+            else if (arg == "--limit" && i + 1 < argc)
+                limit = strtoull(argv[++i], nullptr, 10);
+            else if (arg == "--restore" && i + 1 < argc)
+                restore = argv[++i];
+            else if (arg == "--profile")
+                profile = true;
+            else if (arg == "--folded" && i + 1 < argc)
+                folded = argv[++i], profile = true;
+            else if (arg == "--inputs" && i + 1 < argc)
+                inputs = argv[++i];
             else
                 arg_error = true;
         } else {
-            if (filename == nullptr)
-                filename = argv[i];
-            else
-                arg_error = true;
+            filenames.push_back(argv[i]);
         }
     }
 
-    if (arg_error || do_help || filename == nullptr) {
-        cerr << "usage " << argv[0] << " [-h] filename" << endl;
+    if (engine != "block" && engine != "predecode" && engine != "interp")
+        arg_error = true;
+    if (!batch && (filenames.size() != (restore.empty() ? 1 : 0) || !outdir.empty()))
+        arg_error = true;
+    if (batch && (!checkpoint.empty() || !restore.empty() || profile))
+        arg_error = true;
+    if (checkpoint.empty() != (at_instr == UINT64_MAX && at_pc == -1))
+        arg_error = true;
+    if (batch && filenames.empty() && manifest.empty())
+        arg_error = true;
+    if (!inputs.empty() && (batch || !checkpoint.empty() || !restore.empty() || profile))
+        arg_error = true;
+    if (limit != UINT64_MAX && (batch || !inputs.empty() || profile))
+        arg_error = true;
+    // Profiles come from the block engine only
+    if (profile && engine != "block")
+        arg_error = true;
+
+    if (arg_error || do_help) {
+        cerr << "usage " << argv[0] << " [-h] [--engine ENGINE] [--checkpoint FILE (--at-instr N | --at-pc PC)]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--limit N | --profile [--folded FILE]]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " (filename | --restore FILE)" << endl;
+        cerr << "      " << argv[0] << " --batch [--engine ENGINE] [--manifest FILE] [--jobs N]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << "         [--outdir DIR] [filename ...]" << endl;
+        cerr << "      " << argv[0] << " --inputs FILE filename" << endl;
         cerr << "Simulate E20 machine" << endl;
+        cerr << "  --engine ENGINE  block (default): run chained translated basic blocks" << endl;
+        cerr << "                   predecode: decode each word once and dispatch from" << endl;
+        cerr << "                   the decoded table" << endl;
+        cerr << "                   interp: decode every instruction as it executes" << endl;
+        cerr << "  --batch          run every filename (and every file listed in the" << endl;
+        cerr << "                   manifest, one per line) on a pool of threads" << endl;
+        cerr << "  --manifest FILE  file listing programs to run; implies --batch" << endl;
+        cerr << "  --jobs N         number of worker threads (default: one per core)" << endl;
+        cerr << "  --outdir DIR     write each final state to DIR/<name>.out instead of" << endl;
+        cerr << "                   printing them all to stdout in order" << endl;
+        cerr << "  --checkpoint FILE  save memory, registers and pc to FILE once N" << endl;
+        cerr << "                   instructions have run (--at-instr N) or just before" << endl;
+        cerr << "                   pc first reaches PC (--at-pc PC), then carry on" << endl;
+        cerr << "  --limit N        stop once N instructions have run, counting from the" << endl;
+        cerr << "                   start of the program, and print the state then if it" << endl;
+        cerr << "                   hasn't halted" << endl;
+        cerr << "  --restore FILE   resume from a checkpoint written by e20sim or simcache" << endl;
+        cerr << "                   instead of loading a program" << endl;
+        cerr << "  --profile        run on the block engine and print the opcode mix, the" << endl;
+        cerr << "                   hottest instructions, JEQ outcomes and hot loops to" << endl;
+        cerr << "                   stderr (only the part of the run after any checkpoint);" << endl;
+        cerr << "                   not with another --engine" << endl;
+        cerr << "  --folded FILE    write the profile's call stacks (from JAL/JR) to FILE" << endl;
+        cerr << "                   in folded-stack format for flame graphs; implies --profile" << endl;
+        cerr << "  --inputs FILE    run the program once per line of FILE, starting from the" << endl;
+        cerr << "                   $R=VALUE and ADDR=VALUE settings on the line, several" << endl;
+        cerr << "                   runs at a time in lockstep" << endl;
         return 1;
     }
 
-    ifstream f(filename);
-    if (!f.is_open()) {
-        cerr << "Can't open file " << filename << endl;
+    if (batch) {
+        if (!manifest.empty()) {
+            ifstream f(manifest);
+            if (!f.is_open()) {
+                cerr << "Can't open file " << manifest << endl;
+                return 1;
+            }
+            string line;
+            while (getline(f, line))
+                if (!line.empty() && line[0] != '#')
+                    filenames.push_back(line);
+        }
+
+        vector<batch_job> jobs(filenames.size());
+        for (size_t i = 0; i < filenames.size(); i++)
+            jobs[i].filename = filenames[i];
+        if (!outdir.empty()) {
+            // a/x.bin and b/x.bin, or x.bin and x.txt, would overwrite each other's x.out
+            unordered_map<string, string> owners;
+            for (const string &filename : filenames) {
+                auto it = owners.emplace(batch_output_name(filename), filename).first;
+                if (it->second != filename) {
+                    cerr << "Both " << it->second << " and " << filename << " would write " << outdir << "/"
+                         << it->first << endl;
+                    return 1;
+                }
+            }
+        }
+        if (num_workers == 0)
+            num_workers = 1;
+        if (num_workers > jobs.size())
+            num_workers = jobs.size();
+
+        if (!jobs.empty())
+            run_batch(jobs, engine, num_workers, write_batch_result, outdir);
+        for (const batch_job &job : jobs)
+            if (job.failed)
+                return 1;
+        return 0;
+    }
+
+    if (!inputs.empty()) {
+        ifstream f(inputs);
+        if (!f.is_open()) {
+            cerr << "Can't open file " << inputs << endl;
+            return 1;
+        }
+        vector<sweep_input> runs;
+        string line, error;
+        while (getline(f, line)) {
+            if (line.empty() || line[0] == '#')
+                continue;
+            runs.emplace_back();
+            if (!parse_sweep_input(line, runs.back(), error)) {
+                cerr << error << endl;
+                return 1;
+            }
+        }
+        unique_ptr<uint16_t[]> program(new uint16_t[MEM_SIZE]());
+        load_machine_code(filenames[0], program.get());
+        run_sweep(program.get(), runs);
+        return 0;
+    }
+
+    // Load machine code (or a checkpoint) into memory
+    unique_ptr<machine_state> m(new machine_state());
+    uint64_t instructions = 0;
+    string error;
+    if (restore.empty())
+        load_machine_code(filenames[0], m->memory);
+    else if (!read_checkpoint(restore, m->memory, m->registers, m->pc, instructions, error)) {
+        cerr << error << endl;
         return 1;
     }
 
-    // Load machine code into memory
-    load_machine_code(f, memory);
-    simulate();
-    // Print final state
-    print_state(pc, registers, memory, 128);
+    // Interpret up to the checkpoint, then hand over to the engine
+    if (!checkpoint.empty()) {
+        if (simulate_until(*m, instructions, at_instr, at_pc)) {
+            cerr << "Program halted before the checkpoint" << endl;
+            return 1;
+        }
+        if (!write_checkpoint(checkpoint, m->memory, m->registers, m->pc, instructions, error)) {
+            cerr << error << endl;
+            return 1;
+        }
+    }
+    if (!profile) {
+        if (limit == UINT64_MAX)
+            run_machine(*m, engine);
+        else if (instructions >= limit || !run_machine_for(*m, engine, limit - instructions))
+            cerr << "Program didn't halt within " << limit << " instructions" << endl;
+        // Print final state
+        print_state(m->pc, m->registers, m->memory, 128);
+        return 0;
+    }
+
+    unique_ptr<profiler> p(new profiler(m->memory));
+    if (folded.empty())
+        simulate_profiled<false>(*m, *p);
+    else
+        simulate_profiled<true>(*m, *p);
+    print_state(m->pc, m->registers, m->memory, 128);
+    print_profile(*p, cerr);
+    if (!folded.empty() && !write_folded_stacks(*p, folded)) {
+        cerr << "Can't write file " << folded << endl;
+        return 1;
+    }
     return 0;
 }
@@ -0,0 +1,1175 @@
+/*
+    File: libe20.h
+    Purpose: The E20 machine e20sim and simcache share, and an embeddable
+        engine for driving it from other programs such as fuzzers and
+        test harnesses without starting a process per run
+*/
+#ifndef LIBE20_H
+#define LIBE20_H
+
+#include <cstddef>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Some helpful constant values
+size_t const static NUM_REGS = 8;
+size_t const static MEM_SIZE = 1 << 13;
+size_t const static REG_SIZE = 1 << 16;
+
+/*
+    Parses one line of machine code, accepting exactly what the regex
+    ^ram\[(\d+)\] = 16'b(\d+);.*$ and stoi used to.
+
+    @param p First character of the line
+    @param end End of the line, excluding the newline
+    @param addr Set to the address of the word
+    @param instr Set to the word, read up to the first digit that isn't
+        binary
+
+    @return false if the line doesn't match, has a '\r' after the ';', or
+        holds a number stoi couldn't represent
+*/
+inline bool parse_machine_code_line(const char *p, const char *end, size_t &addr, unsigned &instr)
+{
+    if (end - p < 4 || memcmp(p, "ram[", 4) != 0)
+        return false;
+    p += 4;
+    const char *digits = p;
+    uint64_t value = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        if ((value = value * 10 + (*p - '0')) > INT_MAX)
+            return false;
+    addr = value;
+    if (p == digits || end - p < 8 || memcmp(p, "] = 16'b", 8) != 0)
+        return false;
+    p += 8;
+    digits = p;
+    value = 0;
+    bool binary = true;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+        binary = binary && *p <= '1';
+        if (binary && (value = value * 2 + (*p - '0')) > INT_MAX)
+            return false;
+    }
+    instr = value;
+    if (p == digits || *digits > '1' || p == end || *p != ';')
+        return false;
+    return memchr(p, '\r', end - p) == nullptr;
+}
+
+/*
+    Parses E20 machine code text into mem, one ram[N] = 16'b...; line at
+    a time, without copying the text.
+
+    @param text The machine code
+    @param length Length of text in bytes
+    @param mem Array representing memory into which to read program
+    @param error Set to the message for a bad line, an address out of
+        sequence or a program too big for memory
+    @param words If not null, set to the number of words loaded
+
+    @return false on any of those errors
+*/
+inline bool parse_machine_code(const char *text, size_t length, uint16_t mem[], std::string &error,
+                               size_t *words = nullptr)
+{
+    const char *p = text, *end = text + length;
+    size_t expectedaddr = 0;
+    while (p < end)
+    {
+        const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (eol == nullptr)
+            eol = end;
+        size_t addr;
+        unsigned instr;
+        if (!parse_machine_code_line(p, eol, addr, instr))
+        {
+            error = "Can't parse line: " + std::string(p, eol);
+            return false;
+        }
+        if (addr != expectedaddr)
+        {
+            error = "Memory addresses encountered out of sequence: " + std::to_string(addr);
+            return false;
+        }
+        if (addr >= MEM_SIZE)
+        {
+            error = "Program too big for memory";
+            return false;
+        }
+        expectedaddr++;
+        mem[addr] = instr;
+        p = eol + 1;
+    }
+    if (words != nullptr)
+        *words = expectedaddr;
+    return true;
+}
+
+/*
+    Raw program images (.e20img) start with this header, followed by the
+    words to load at address 0 in host byte order.
+*/
+struct image_header
+{
+    char magic[8]; // "E20IMG\0\0"
+    uint32_t version;
+    uint32_t words;
+};
+
+const char IMAGE_MAGIC[8] = {'E', '2', '0', 'I', 'M', 'G', 0, 0};
+uint32_t const static IMAGE_VERSION = 1;
+
+/*
+    Reads an .e20img image straight into mem with a single readv.
+
+    @param fd The open image file
+    @param length Size of the file in bytes
+    @param filename Name of the image, for the error message
+    @param mem Array representing memory into which to read program
+    @param error Set to a message when the image can't be loaded
+    @param words If not null, set to the number of words loaded
+
+    @return false if the image is too big, truncated or not an image
+*/
+inline bool read_image(int fd, size_t length, const std::string &filename, uint16_t mem[], std::string &error,
+                       size_t *words = nullptr)
+{
+    if (length > sizeof(image_header) + MEM_SIZE * sizeof(uint16_t))
+    {
+        error = "Program too big for memory";
+        return false;
+    }
+    image_header header;
+    struct iovec parts[2] = {{&header, sizeof(header)}, {mem, MEM_SIZE * sizeof(uint16_t)}};
+    ssize_t got = readv(fd, parts, 2);
+    if (got < ssize_t(sizeof(header)) || size_t(got) != length ||
+        memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 || header.version != IMAGE_VERSION ||
+        length != sizeof(header) + header.words * sizeof(uint16_t))
+    {
+        error = "Not an E20 image: " + filename;
+        return false;
+    }
+    if (words != nullptr)
+        *words = header.words;
+    return true;
+}
+
+/*
+    Reads a program into mem: an .e20img image with one read, anything
+    else as machine code text mapped into memory.
+
+    @param filename The program file
+    @param mem Array representing memory into which to read program
+    @param error Set to a message when the program can't be loaded
+    @param words If not null, set to the number of words loaded
+
+    @return false if the file can't be read or isn't a program
+*/
+inline bool read_program(const std::string &filename, uint16_t mem[], std::string &error,
+                         size_t *words = nullptr)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        error = "Can't open file " + filename;
+        return false;
+    }
+
+    bool ok;
+    size_t length = st.st_size;
+    std::string suffix = ".e20img";
+    if (filename.size() >= suffix.size() && filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0)
+    {
+        ok = read_image(fd, length, filename, mem, error, words);
+    }
+    else if (S_ISREG(st.st_mode) && length > 0)
+    {
+        void *text = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED)
+        {
+            error = "Can't map file " + filename;
+            ok = false;
+        }
+        else
+        {
+            ok = parse_machine_code(static_cast<const char *>(text), length, mem, error, words);
+            munmap(text, length);
+        }
+    }
+    else
+    {
+        // Pipes and the like can't be mapped
+        std::string text;
+        char buffer[1 << 16];
+        ssize_t got;
+        while ((got = read(fd, buffer, sizeof(buffer))) > 0)
+            text.append(buffer, got);
+        ok = parse_machine_code(text.data(), text.size(), mem, error, words);
+    }
+    close(fd);
+    return ok;
+}
+
+/*
+    Checkpoint files are one contiguous blob: this header, all MEM_SIZE
+    words of memory, levels 16-byte cache level configurations, then
+    cache_bytes of cache contents. Only simcache writes levels; e20sim
+    skips any it reads. Everything is in host byte order.
+*/
+struct checkpoint_header
+{
+    char magic[8]; // "E20CKPT\0"
+    uint32_t version;
+    uint16_t pc;
+    uint16_t regs[NUM_REGS];
+    uint16_t reserved;
+    uint64_t instructions; // executed before the checkpoint
+    uint32_t levels;
+    uint32_t cache_bytes;
+};
+
+const char CHECKPOINT_MAGIC[8] = {'E', '2', '0', 'C', 'K', 'P', 'T', 0};
+uint32_t const static CHECKPOINT_VERSION = 1;
+
+// Memory for run_e20_for that is just the words
+struct flat_memory
+{
+    uint16_t *words;
+
+    uint16_t load(uint16_t addr) const
+    {
+        return words[addr];
+    }
+
+    void store(uint16_t addr, uint16_t value)
+    {
+        words[addr] = value;
+    }
+};
+
+// A hook for run_e20_for that watches nothing, so loops can be skipped
+struct no_hook
+{
+    static const bool skips_loops = true;
+
+    void step(uint16_t) {}
+    void lw(uint16_t, uint16_t) {}
+    void sw(uint16_t, uint16_t) {}
+    void jump(uint16_t, uint16_t) {}
+    void skip(uint16_t, uint64_t) {}
+};
+
+/*
+    hook_skips_loops<Hook>::value is Hook::skips_loops, or false for a
+    hook that doesn't say. A hook that skips loops has skip(pc, steps).
+    When run_e20_for skips iterations of the loop starting at pc, it
+    calls that once for all of their steps instructions instead of
+    calling step for each. Those instructions load and store nothing,
+    and their only jumps are back to pc.
+*/
+template <class Hook, class = void>
+struct hook_skips_loops : std::false_type
+{
+};
+
+template <class Hook>
+struct hook_skips_loops<Hook, decltype(void(Hook::skips_loops))> : std::integral_constant<bool, Hook::skips_loops>
+{
+};
+
+// Longest loop, in words, that is looked at for skipping
+size_t const static MAX_SKIPPED_LOOP = 32;
+
+/*
+    One bit per word, set on the J at the tail of every loop found not
+    to be counted, so it isn't looked at again. A loop may have several
+    Js back to its head, each with its own bit. The bits are only
+    cleared when the first one is set, so short runs, such as stepping
+    one instruction at a time, don't pay for clearing them.
+*/
+struct rejected_tails
+{
+    uint64_t bits[MEM_SIZE / 64];
+    bool any = false;
+
+    bool has(uint16_t tail) const
+    {
+        return any && (bits[tail % MEM_SIZE / 64] >> tail % 64 & 1);
+    }
+
+    void add(uint16_t tail)
+    {
+        if (!any)
+            memset(bits, 0, sizeof(bits));
+        any = true;
+        bits[tail % MEM_SIZE / 64] |= uint64_t(1) << tail % 64;
+    }
+
+    // Lets the J at addr be looked at again once it is overwritten
+    void remove(uint16_t addr)
+    {
+        if (any)
+            bits[addr % MEM_SIZE / 64] &= ~(uint64_t(1) << addr % 64);
+    }
+};
+
+/*
+    The first n at which d + n * s is 0 modulo 2^16, or UINT64_MAX if
+    there is none.
+*/
+inline uint64_t first_zero(uint16_t d, uint16_t s)
+{
+    if (d == 0)
+        return 0;
+    if (s == 0)
+        return UINT64_MAX;
+    int shift = 0;
+    while (!(s >> shift & 1))
+        shift++;
+    if (d & ((1u << shift) - 1))
+        return UINT64_MAX;
+    // n * (s >> shift) = -d >> shift modulo 2^(16 - shift), and s >> shift is odd
+    uint32_t odd = s >> shift, inverse = odd;
+    for (int i = 0; i < 4; i++)
+        inverse *= 2 - odd * inverse;
+    return (uint32_t(uint16_t(-d)) >> shift) * inverse & ((1u << (16 - shift)) - 1);
+}
+
+/*
+    Skips the whole iterations of a counted loop: the words from head up
+    to the J back to it at tail, which hold only JEQs, no-ops, and ADDIs,
+    ADDs and SUBs that step a register by a constant or by a register
+    the loop doesn't write. Delay loops and countdowns are like this.
+    Every register moves by the same amount each time round, so the
+    first iteration that takes a JEQ comes out of a congruence modulo
+    2^16. The registers at its start come out in closed form. That
+    iteration is left to run, so the loop is left the way it always was.
+
+    A loop no JEQ ever leaves is a spin. It is skipped up to max_trips,
+    but with no limit (max_trips UINT64_MAX) there is nothing to skip
+    to, so it is turned down like any other loop and then runs as it
+    always did.
+
+    @param trips Set to the iterations skipped, at most max_trips
+    @return false if it isn't a counted loop, is longer than
+        MAX_SKIPPED_LOOP, runs off the end of memory or is a spin with
+        no limit
+*/
+template <class Memory>
+bool skip_counted_loop(const Memory &memory, uint16_t regs[], uint16_t head, uint16_t tail, uint64_t max_trips,
+                       uint64_t &trips)
+{
+    if (tail >= MEM_SIZE || head > tail || size_t(tail - head) >= MAX_SKIPPED_LOOP)
+        return false;
+    uint16_t words[MAX_SKIPPED_LOOP];
+    bool written[NUM_REGS] = {};
+    size_t length = tail - head + 1;
+    for (size_t i = 0; i + 1 < length; i++)
+    {
+        uint16_t instr = words[i] = memory.load(head + i);
+        uint16_t regB = instr >> 7 & 0b111;
+        uint16_t regC = instr >> 4 & 0b111;
+        switch (instr >> 13)
+        {
+        case 0:
+            if ((instr & 0b1111) == 8 || (regC != 0 && (instr & 0b1111) >= 2 && (instr & 0b1111) <= 4))
+                return false;
+            if ((instr & 0b1111) <= 1) // add, sub
+                written[regC] = true;
+            break;
+        case 1: // addi
+            if (regB != 0 && (instr >> 10 & 0b111) != regB)
+                return false;
+            written[regB] = true;
+            break;
+        case 6: // jeq
+            break;
+        case 7: // slti
+            if (regB != 0)
+                return false;
+            break;
+        default: // j, jal, lw, sw
+            return false;
+        }
+    }
+    written[0] = false;
+
+    // Work through one iteration, finding the amount each register
+    // steps by and the first iteration each JEQ is taken in
+    uint16_t step[NUM_REGS] = {};
+    uint16_t jeq_diff[MAX_SKIPPED_LOOP];
+    uint8_t jeq_regs[MAX_SKIPPED_LOOP][2];
+    size_t jeqs = 0;
+    for (size_t i = 0; i + 1 < length; i++)
+    {
+        uint16_t instr = words[i];
+        uint16_t regA = instr >> 10 & 0b111;
+        uint16_t regB = instr >> 7 & 0b111;
+        uint16_t regC = instr >> 4 & 0b111;
+        uint16_t imm7 = instr & 0b1111111;
+        if (imm7 & 0b1000000) // sign extend to 16 bits
+            imm7 |= 0b1111111110000000;
+        switch (instr >> 13)
+        {
+        case 0:
+            if (regC == 0 || (instr & 0b1111) > 1)
+                break;
+            if ((instr & 0b1111) == 0 && regA == regC && !written[regB])
+                step[regC] += regs[regB];
+            else if ((instr & 0b1111) == 0 && regB == regC && !written[regA])
+                step[regC] += regs[regA];
+            else if ((instr & 0b1111) == 1 && regA == regC && !written[regB])
+                step[regC] -= regs[regB];
+            else
+                return false;
+            break;
+        case 1: // addi
+            step[regB] += imm7;
+            break;
+        case 6: // jeq
+            jeq_diff[jeqs] = (regs[regA] + step[regA]) - (regs[regB] + step[regB]);
+            jeq_regs[jeqs][0] = regA;
+            jeq_regs[jeqs][1] = regB;
+            jeqs++;
+            break;
+        }
+        step[0] = 0;
+    }
+
+    trips = UINT64_MAX;
+    for (size_t j = 0; j < jeqs; j++)
+    {
+        uint64_t taken = first_zero(jeq_diff[j], step[jeq_regs[j][0]] - step[jeq_regs[j][1]]);
+        trips = taken < trips ? taken : trips;
+    }
+    if (trips == UINT64_MAX && max_trips == UINT64_MAX)
+        return false;
+    if (trips > max_trips)
+        trips = max_trips;
+    for (size_t r = 1; r < NUM_REGS; r++)
+        regs[r] += trips * step[r];
+    return true;
+}
+
+/*
+    Skips what it can of the loop that the J at tail has just jumped back
+    to head, for run_e20_for with a hook that skips loops. It is kept out
+    of line so the interpreter loop around it stays as tight as before.
+
+    @param most Instructions left before the limit, or UINT64_MAX for none
+    @param rejected Gets tail if it isn't a counted loop, so it isn't
+        looked at again
+    @return the number of instructions skipped
+*/
+template <class Memory, class Hook>
+__attribute__((noinline)) uint64_t skip_loop(Memory &memory, uint16_t regs[], uint16_t head, uint16_t tail,
+                                             Hook &hook, uint64_t most, rejected_tails &rejected, std::true_type)
+{
+    uint64_t length = tail - head + 1;
+    uint64_t trips;
+    // Runs stepped a few instructions at a time have no whole iteration to skip
+    if (most != UINT64_MAX && most < length)
+        return 0;
+    if (!skip_counted_loop(memory, regs, head, tail, most == UINT64_MAX ? most : most / length, trips))
+    {
+        rejected.add(tail);
+        return 0;
+    }
+    if (trips > 0)
+        hook.skip(head, trips * length);
+    return trips * length;
+}
+
+template <class Memory, class Hook>
+uint64_t skip_loop(Memory &, uint16_t[], uint16_t, uint16_t, Hook &, uint64_t, rejected_tails &, std::false_type)
+{
+    return 0;
+}
+
+/*
+    Runs e20 until halt or until limit instructions have run, calling
+    hook.step(pc) before every instruction, hook.lw(pc, addr) before every
+    load, hook.sw(pc, addr) before every store and hook.jump(pc, target)
+    for every J, JAL, JR and taken JEQ. Memory is read and written through
+    memory.load(addr) and memory.store(addr, value).
+
+    A jump, JAL, JR or JEQ whose target is its own address halts. JR
+    jumps to the low 13 bits of its register; other pc arithmetic keeps
+    all 16 bits, and instructions are fetched from pc modulo MEM_SIZE.
+
+    For a hook that skips loops, a J back to the top of a counted loop
+    skips its iterations as skip_counted_loop does, calling hook.skip
+    for them. Registers, memory and the count come out as if they ran.
+
+    @param pc_io updated to the next instruction, or left on the halt
+    @param halted set when the run stopped on a halt
+    @return the number of instructions run, counting the halt
+*/
+template <class Memory, class Hook>
+uint64_t run_e20_for(Memory &memory, uint16_t regs[], uint16_t &pc_io, Hook &hook,
+                     uint64_t limit, bool &halted)
+{
+    uint16_t pc = pc_io;
+    bool halt = false;
+    uint64_t steps = 0;
+    rejected_tails rejected;
+    while (!halt && steps < limit)
+    {
+        ++steps;
+        hook.step(pc);
+        uint16_t instr = memory.load(pc % MEM_SIZE);
+        uint16_t opcode = instr >> 13;
+        uint16_t regA = instr >> 10 & 0b111;
+        uint16_t regB = instr >> 7 & 0b111;
+        uint16_t regC = instr >> 4 & 0b111;
+        uint16_t imm13 = instr & 0b1111111111111;
+        uint16_t imm7 = instr & 0b1111111;
+        if (imm7 & 0b1000000) // sign extend to 16 bits
+            imm7 |= 0b1111111110000000;
+        uint16_t mem_addr = (regs[regA] + imm7) & 0b1111111111111;
+        uint16_t target;
+
+        switch (opcode)
+        {
+        case 0:
+            switch (instr & 0b1111)
+            {
+            case 0: // add
+                regs[regC] = regs[regA] + regs[regB];
+                break;
+            case 1: // sub
+                regs[regC] = regs[regA] - regs[regB];
+                break;
+            case 2: // or
+                regs[regC] = regs[regA] | regs[regB];
+                break;
+            case 3: // and
+                regs[regC] = regs[regA] & regs[regB];
+                break;
+            case 4: // slt
+                regs[regC] = (regs[regA] < regs[regB]) ? 1 : 0;
+                break;
+            }
+            if ((instr & 0b1111) == 8) // jr
+            {
+                target = regs[regA] & 0b1111111111111;
+                hook.jump(pc, target);
+                halt = target == pc;
+                pc = target;
+            }
+            else
+                ++pc;
+            break;
+        case 1: // addi
+            regs[regB] = regs[regA] + imm7;
+            ++pc;
+            break;
+        case 2: // j
+            hook.jump(pc, imm13);
+            halt = pc == imm13;
+            if (imm13 < pc && !rejected.has(pc))
+                steps += skip_loop(memory, regs, imm13, pc, hook, limit == UINT64_MAX ? limit : limit - steps,
+                                   rejected, hook_skips_loops<Hook>());
+            pc = imm13;
+            break;
+        case 3: // jal
+            regs[7] = pc + 1;
+            hook.jump(pc, imm13);
+            halt = pc == imm13;
+            pc = imm13;
+            break;
+        case 4: // lw
+            hook.lw(pc, mem_addr);
+            regs[regB] = memory.load(mem_addr);
+            ++pc;
+            break;
+        case 5: // sw
+            hook.sw(pc, mem_addr);
+            memory.store(mem_addr, regs[regB]);
+            rejected.remove(mem_addr);
+            ++pc;
+            break;
+        case 6: // jeq
+            if (regs[regA] == regs[regB])
+            {
+                target = pc + 1 + imm7;
+                hook.jump(pc, target);
+                halt = (target & 0b1111111111111) == pc;
+                pc = target;
+            }
+            else
+                ++pc;
+            break;
+        case 7: // slti
+            regs[regB] = (regs[regA] < imm7) ? 1 : 0;
+            ++pc;
+            break;
+        }
+
+        regs[0] = 0; // Ensure $0 is still 0
+    }
+    pc_io = pc;
+    halted = halt;
+    return steps;
+}
+
+// Why e20_machine::run stopped
+enum run_result
+{
+    RUN_HALTED,
+    RUN_LIMIT
+};
+
+/*
+    One E20 to embed: load a program, run it a step or a bounded number
+    of instructions at a time, read or poke its registers and memory, and
+    put it back the way it was at the last snapshot. Memory remembers
+    which words were stored to since then, so reset copies back only
+    those instead of all MEM_SIZE words, which is what makes running
+    many short inputs through one machine cheap. The machine is about
+    50 KB; allocate it on the heap.
+*/
+struct e20_machine
+{
+    // Memory that lists the words stored to since the last snapshot
+    struct tracked_memory
+    {
+        uint16_t words[MEM_SIZE] = {};
+        uint64_t dirty[MEM_SIZE / 64] = {};
+        uint16_t written[MEM_SIZE]; // the first count addresses are dirty
+        size_t count = 0;
+
+        uint16_t load(uint16_t addr) const
+        {
+            return words[addr];
+        }
+
+        void store(uint16_t addr, uint16_t value)
+        {
+            uint64_t bit = uint64_t(1) << (addr % 64);
+            if (!(dirty[addr / 64] & bit))
+            {
+                dirty[addr / 64] |= bit;
+                written[count++] = addr;
+            }
+            words[addr] = value;
+        }
+    };
+
+    tracked_memory memory;
+    uint16_t regs[NUM_REGS] = {};
+    uint16_t pc = 0;
+    bool halted = false;
+    uint64_t instructions = 0; // run since load
+
+    // What reset goes back to
+    uint16_t saved_words[MEM_SIZE] = {};
+    uint16_t saved_regs[NUM_REGS] = {};
+    uint16_t saved_pc = 0;
+    bool saved_halted = false;
+    uint64_t saved_instructions = 0;
+
+    /*
+        Starts over with image at address 0, zeros everywhere else, and
+        takes the snapshot.
+
+        @return false if the image doesn't fit in memory
+    */
+    bool load(const uint16_t image[], size_t words)
+    {
+        if (words > MEM_SIZE)
+            return false;
+        memset(memory.words, 0, sizeof(memory.words));
+        memcpy(memory.words, image, words * sizeof(uint16_t));
+        memset(regs, 0, sizeof(regs));
+        pc = 0;
+        halted = false;
+        instructions = 0;
+        snapshot();
+        return true;
+    }
+
+    /*
+        Loads a machine code or .e20img file like e20sim does.
+
+        @param error Set to a message when the program can't be loaded
+    */
+    bool load(const std::string &filename, std::string &error)
+    {
+        uint16_t image[MEM_SIZE] = {};
+        return read_program(filename, image, error) && load(image, MEM_SIZE);
+    }
+
+    // Runs one instruction
+    run_result step()
+    {
+        return run(1);
+    }
+
+    /*
+        Runs until the program halts or max_instructions have run,
+        whichever comes first. A halted machine stays halted, on the
+        halt, until reset or load.
+    */
+    run_result run(uint64_t max_instructions)
+    {
+        no_hook hook;
+        return run(max_instructions, hook);
+    }
+
+    // Runs like run(max_instructions), calling hook as run_e20_for does
+    template <class Hook>
+    run_result run(uint64_t max_instructions, Hook &hook)
+    {
+        if (!halted)
+            instructions += run_e20_for(memory, regs, pc, hook, max_instructions, halted);
+        return halted ? RUN_HALTED : RUN_LIMIT;
+    }
+
+    uint16_t reg(size_t i) const
+    {
+        return regs[i];
+    }
+
+    // Writes to $0 are dropped, as they are for instructions
+    void set_reg(size_t i, uint16_t value)
+    {
+        if (i != 0)
+            regs[i] = value;
+    }
+
+    uint16_t read(uint16_t addr) const
+    {
+        return memory.words[addr % MEM_SIZE];
+    }
+
+    // Stores like SW does, so reset undoes it too
+    void write(uint16_t addr, uint16_t value)
+    {
+        memory.store(addr % MEM_SIZE, value);
+    }
+
+    // Makes the current state the one reset returns to
+    void snapshot()
+    {
+        memcpy(saved_words, memory.words, sizeof(saved_words));
+        memcpy(saved_regs, regs, sizeof(saved_regs));
+        saved_pc = pc;
+        saved_halted = halted;
+        saved_instructions = instructions;
+        forget_writes();
+    }
+
+    // Goes back to the last snapshot, copying only the words stored since
+    void reset()
+    {
+        for (size_t i = 0; i < memory.count; ++i)
+            memory.words[memory.written[i]] = saved_words[memory.written[i]];
+        memcpy(regs, saved_regs, sizeof(regs));
+        pc = saved_pc;
+        halted = saved_halted;
+        instructions = saved_instructions;
+        forget_writes();
+    }
+
+    void forget_writes()
+    {
+        for (size_t i = 0; i < memory.count; ++i)
+            memory.dirty[memory.written[i] / 64] = 0;
+        memory.count = 0;
+    }
+};
+
+// Machines an e20_lockstep runs side by side, one SSE2 register of words
+int const static E20_LANES = 8;
+
+/*
+    E20_LANES machines running one program in lockstep, each with its own
+    memory, registers and pc, for sweeping a program over many inputs.
+    Registers are stored as structure-of-arrays (regs[r][lane]) and
+    memory interleaved by lane (memory[addr * E20_LANES + lane]), so the
+    lanes at one pc fetch with a single load and ADD, SUB, OR, AND, SLT,
+    ADDI, SLTI and the JEQ compare each run as one vector operation. LW
+    and SW go lane by lane.
+
+    run() always steps the lanes at the lowest pc together. Lanes that a
+    JEQ or JR sends different ways split up, and the ones left behind
+    catch up and rejoin the others once they reach the same pc. Lanes at
+    one pc whose memories hold different words there run separately.
+    Each lane follows exactly the rules of run_e20_for.
+*/
+struct e20_lockstep
+{
+    alignas(16) uint16_t memory[MEM_SIZE * E20_LANES];
+    alignas(16) uint16_t regs[NUM_REGS][E20_LANES];
+    alignas(16) uint16_t pc[E20_LANES];
+    bool halted[E20_LANES];
+    uint64_t instructions[E20_LANES]; // run by each lane since load
+
+    /*
+        Puts image at address 0 of every lane's memory, with zeros
+        everywhere else, and clears the registers and pcs. Lanes from
+        lanes on start out halted, so they never run.
+
+        @return false if the image doesn't fit in memory
+    */
+    bool load(const uint16_t image[], size_t words, int lanes = E20_LANES)
+    {
+        if (words > MEM_SIZE)
+            return false;
+        memset(memory, 0, sizeof(memory));
+        for (size_t addr = 0; addr < words; ++addr)
+            for (int lane = 0; lane < E20_LANES; ++lane)
+                memory[addr * E20_LANES + lane] = image[addr];
+        memset(regs, 0, sizeof(regs));
+        for (int lane = 0; lane < E20_LANES; ++lane)
+        {
+            pc[lane] = 0;
+            halted[lane] = lane >= lanes;
+            instructions[lane] = 0;
+        }
+        return true;
+    }
+
+    uint16_t reg(int lane, size_t i) const
+    {
+        return regs[i][lane];
+    }
+
+    // Writes to $0 are dropped, as they are for instructions
+    void set_reg(int lane, size_t i, uint16_t value)
+    {
+        if (i != 0)
+            regs[i][lane] = value;
+    }
+
+    uint16_t read(int lane, uint16_t addr) const
+    {
+        return memory[addr % MEM_SIZE * E20_LANES + lane];
+    }
+
+    void write(int lane, uint16_t addr, uint16_t value)
+    {
+        memory[addr % MEM_SIZE * E20_LANES + lane] = value;
+    }
+
+    /*
+        Runs until every lane has halted or max_steps steps have run. A
+        step runs one instruction in each lane of a group, so the lanes
+        together run at most E20_LANES * max_steps instructions.
+    */
+    run_result run(uint64_t max_steps = UINT64_MAX)
+    {
+        unsigned live = 0;
+        for (int lane = 0; lane < E20_LANES; ++lane)
+            if (!halted[lane])
+                live |= 1u << lane;
+        if (live == 0)
+            return RUN_HALTED;
+        // The group is the lanes at the lowest pc, cur. Other live lanes
+        // wait at their own pc for the group to catch up with them.
+        uint16_t cur = lowest_pc(live);
+        unsigned group = lanes_at(live, cur);
+        uint64_t ran = 0; // steps the group has run and not been charged for
+        for (uint64_t steps = 0; steps < max_steps; ++steps)
+        {
+            ++ran;
+            const uint16_t *row = &memory[cur % MEM_SIZE * E20_LANES];
+            uint16_t instr = row[__builtin_ctz(group)];
+            unsigned same = lanes_equal(lanes_of(row), lanes_of(instr)) & group;
+            bool regroup = false;
+            if (same != group)
+            {
+                // Lanes with another word here wait and run it next
+                charge(group, ran - 1);
+                ran = 1;
+                set_pc(group & ~same, cur);
+                group = same;
+                regroup = true;
+            }
+
+            uint16_t opcode = instr >> 13;
+            uint16_t regA = instr >> 10 & 0b111;
+            uint16_t regB = instr >> 7 & 0b111;
+            uint16_t regC = instr >> 4 & 0b111;
+            uint16_t imm13 = instr & 0b1111111111111;
+            uint16_t imm7 = instr & 0b1111111;
+            if (imm7 & 0b1000000) // sign extend to 16 bits
+                imm7 |= 0b1111111110000000;
+            uint16_t next = cur + 1;
+            unsigned taken = 0;  // lanes that jump
+            uint16_t target = 0; // where they go; JR's per lane in targets
+            alignas(16) uint16_t targets[E20_LANES];
+
+            switch (opcode)
+            {
+            case 0:
+                if ((instr & 0b1111) == 8) // jr
+                {
+                    taken = group;
+                    for (int lane = 0; lane < E20_LANES; ++lane)
+                        targets[lane] = regs[regA][lane] & 0b1111111111111;
+                    target = targets[__builtin_ctz(group)];
+                    if ((lanes_equal(lanes_of(targets), lanes_of(target)) & group) != group)
+                        regroup = true;
+                }
+                else if ((instr & 0b1111) <= LANE_SLT && regC != 0)
+                    lanes_alu(instr & 0b1111, regs[regC], lanes_of(regs[regA]), lanes_of(regs[regB]), group);
+                break;
+            case 1: // addi
+                if (regB != 0)
+                    lanes_alu(LANE_ADD, regs[regB], lanes_of(regs[regA]), lanes_of(imm7), group);
+                break;
+            case 2: // j
+                taken = group;
+                target = imm13;
+                break;
+            case 3: // jal
+                lanes_alu(LANE_ADD, regs[7], lanes_of(next), lanes_of(uint16_t(0)), group);
+                taken = group;
+                target = imm13;
+                break;
+            case 4: // lw
+                if (regB != 0)
+                    for (int lane = 0; lane < E20_LANES; ++lane)
+                        if (group >> lane & 1)
+                        {
+                            uint16_t addr = (regs[regA][lane] + imm7) & 0b1111111111111;
+                            regs[regB][lane] = memory[addr * E20_LANES + lane];
+                        }
+                break;
+            case 5: // sw
+                for (int lane = 0; lane < E20_LANES; ++lane)
+                    if (group >> lane & 1)
+                    {
+                        uint16_t addr = (regs[regA][lane] + imm7) & 0b1111111111111;
+                        memory[addr * E20_LANES + lane] = regs[regB][lane];
+                    }
+                break;
+            case 6: // jeq
+                taken = lanes_equal(lanes_of(regs[regA]), lanes_of(regs[regB])) & group;
+                target = cur + 1 + imm7;
+                if (taken != 0 && taken != group)
+                    regroup = true;
+                break;
+            case 7: // slti
+                if (regB != 0)
+                    lanes_alu(LANE_SLT, regs[regB], lanes_of(regs[regA]), lanes_of(imm7), group);
+                break;
+            }
+
+            if (!regroup && taken == 0)
+            {
+                cur = next;
+                // Lanes behind the group are never skipped, so it can only meet them here
+                unsigned joining = live != group ? lanes_at(live & ~group, cur) : 0;
+                if (joining)
+                {
+                    charge(group, ran);
+                    ran = 0;
+                    group |= joining;
+                }
+                continue;
+            }
+            if (!regroup && live == group && (target & 0b1111111111111) != cur)
+            {
+                cur = target;
+                continue;
+            }
+
+            // The group splits, halts or jumps while other lanes wait
+            charge(group, ran);
+            ran = 0;
+            for (int lane = 0; lane < E20_LANES; ++lane)
+            {
+                if (!(group >> lane & 1))
+                    continue;
+                uint16_t to = !(taken >> lane & 1) ? next : opcode == 0 ? targets[lane] : target;
+                if ((taken >> lane & 1) && (to & 0b1111111111111) == cur)
+                {
+                    halted[lane] = true;
+                    live &= ~(1u << lane);
+                    to = cur;
+                }
+                pc[lane] = to;
+            }
+            if (live == 0)
+                return RUN_HALTED;
+            cur = lowest_pc(live);
+            group = lanes_at(live, cur);
+        }
+        charge(group, ran);
+        set_pc(group, cur);
+        return RUN_LIMIT;
+    }
+
+private:
+    enum lane_op
+    {
+        LANE_ADD,
+        LANE_SUB,
+        LANE_OR,
+        LANE_AND,
+        LANE_SLT
+    };
+
+#if defined(__SSE2__)
+    static_assert(E20_LANES == 8, "a register's lanes fill one __m128i");
+    typedef __m128i lane_words;
+
+    static lane_words lanes_of(const uint16_t *row)
+    {
+        return _mm_loadu_si128((const __m128i *)row);
+    }
+
+    static lane_words lanes_of(uint16_t value)
+    {
+        return _mm_set1_epi16(value);
+    }
+
+    // All ones in the lanes of mask, zeros elsewhere
+    static __m128i lanes_mask(unsigned mask)
+    {
+        const __m128i bits = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+        return _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16(mask), bits), bits);
+    }
+
+    // Lanes where a and b are equal, one bit per lane
+    static unsigned lanes_equal(lane_words a, lane_words b)
+    {
+        return _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(a, b), _mm_setzero_si128()));
+    }
+
+    // Sets dst to a op b in the lanes of mask
+    static void lanes_alu(int op, uint16_t *dst, lane_words a, lane_words b, unsigned mask)
+    {
+        // SSE2 only compares signed words, so SLT flips the sign bits first
+        const __m128i bias = _mm_set1_epi16(INT16_MIN);
+        __m128i result;
+        switch (op)
+        {
+        case LANE_ADD:
+            result = _mm_add_epi16(a, b);
+            break;
+        case LANE_SUB:
+            result = _mm_sub_epi16(a, b);
+            break;
+        case LANE_OR:
+            result = _mm_or_si128(a, b);
+            break;
+        case LANE_AND:
+            result = _mm_and_si128(a, b);
+            break;
+        default:
+            result = _mm_srli_epi16(_mm_cmplt_epi16(_mm_xor_si128(a, bias), _mm_xor_si128(b, bias)), 15);
+            break;
+        }
+        if (mask != (1u << E20_LANES) - 1)
+        {
+            __m128i in = lanes_mask(mask);
+            __m128i old = _mm_load_si128((const __m128i *)dst);
+            result = _mm_or_si128(_mm_and_si128(in, result), _mm_andnot_si128(in, old));
+        }
+        _mm_store_si128((__m128i *)dst, result);
+    }
+
+    // The lowest pc of the lanes of mask
+    uint16_t lowest_pc(unsigned mask) const
+    {
+        const __m128i bias = _mm_set1_epi16(INT16_MIN);
+        __m128i pcs = _mm_xor_si128(_mm_loadu_si128((const __m128i *)pc), bias);
+        __m128i m = _mm_or_si128(_mm_and_si128(lanes_mask(mask), pcs), _mm_andnot_si128(lanes_mask(mask), _mm_set1_epi16(INT16_MAX)));
+        m = _mm_min_epi16(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+        m = _mm_min_epi16(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+        m = _mm_min_epi16(m, _mm_srli_epi32(m, 16));
+        return uint16_t(_mm_cvtsi128_si32(m)) ^ 0x8000;
+    }
+#else
+    struct lane_words
+    {
+        uint16_t w[E20_LANES];
+    };
+
+    static lane_words lanes_of(const uint16_t *row)
+    {
+        lane_words v;
+        memcpy(v.w, row, sizeof(v.w));
+        return v;
+    }
+
+    static lane_words lanes_of(uint16_t value)
+    {
+        lane_words v;
+        for (int lane = 0; lane < E20_LANES; ++lane)
+            v.w[lane] = value;
+        return v;
+    }
+
+    static unsigned lanes_equal(lane_words a, lane_words b)
+    {
+        unsigned mask = 0;
+        for (int lane = 0; lane < E20_LANES; ++lane)
+            mask |= unsigned(a.w[lane] == b.w[lane]) << lane;
+        return mask;
+    }
+
+    static void lanes_alu(int op, uint16_t *dst, lane_words a, lane_words b, unsigned mask)
+    {
+        for (int lane = 0; lane < E20_LANES; ++lane)
+        {
+            if (!(mask >> lane & 1))
+                continue;
+            uint16_t x = a.w[lane], y = b.w[lane];
+            dst[lane] = op == LANE_ADD ? x + y : op == LANE_SUB ? x - y : op == LANE_OR ? x | y
+                        : op == LANE_AND ? x & y : x < y;
+        }
+    }
+
+    uint16_t lowest_pc(unsigned mask) const
+    {
+        uint16_t lowest = UINT16_MAX;
+        for (int lane = 0; lane < E20_LANES; ++lane)
+            if ((mask >> lane & 1) && pc[lane] < lowest)
+                lowest = pc[lane];
+        return lowest;
+    }
+#endif
+
+    // The lanes of mask whose pc is at
+    unsigned lanes_at(unsigned mask, uint16_t at) const
+    {
+        return lanes_equal(lanes_of(pc), lanes_of(at)) & mask;
+    }
+
+    void set_pc(unsigned mask, uint16_t at)
+    {
+        for (int lane = 0; lane < E20_LANES; ++lane)
+            if (mask >> lane & 1)
+                pc[lane] = at;
+    }
+
+    void charge(unsigned mask, uint64_t steps)
+    {
+        for (int lane = 0; lane < E20_LANES; ++lane)
+            if (mask >> lane & 1)
+                instructions[lane] += steps;
+    }
+};
+
+#endif
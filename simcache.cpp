@@ -7,508 +7,4125 @@
 #include <iostream>
 #include <string>
 #include <vector>
-#include <fstream>
 #include <limits>
 #include <iomanip>
-#include <regex>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "libe20.h"
 
 using namespace std;
 
-// Some helpful constant values that we'll be using.
-size_t const static NUM_REGS = 8;
-size_t const static MEM_SIZE = 1 << 13;
-size_t const static REG_SIZE = 1 << 16;
+uint16_t memory[MEM_SIZE] = {0};
+uint16_t registers[NUM_REGS] = {0};
+uint16_t pc = 0;
+
+/*
+    Allocator that aligns a vector's storage, so every cache set starts on
+    a SIMD register boundary.
+*/
+template <class T, size_t Alignment>
+struct aligned_allocator
+{
+    typedef T value_type;
+    template <class U>
+    struct rebind
+    {
+        typedef aligned_allocator<U, Alignment> other;
+    };
+
+    aligned_allocator() = default;
+    template <class U>
+    aligned_allocator(const aligned_allocator<U, Alignment> &) {}
+
+    T *allocate(size_t n)
+    {
+        size_t bytes = (n * sizeof(T) + Alignment - 1) / Alignment * Alignment;
+        void *p = aligned_alloc(Alignment, bytes);
+        if (p == nullptr)
+            throw bad_alloc();
+        return static_cast<T *>(p);
+    }
+    void deallocate(T *p, size_t) { free(p); }
+    bool operator==(const aligned_allocator &) const { return true; }
+    bool operator!=(const aligned_allocator &) const { return false; }
+};
+
+/*
+    Bitmask of which of the eight tags starting at tags equal tag.
+*/
+inline unsigned match_tags8(const uint16_t *tags, uint16_t tag)
+{
+#if defined(__SSE2__)
+    __m128i eq = _mm_cmpeq_epi16(_mm_load_si128((const __m128i *)tags), _mm_set1_epi16(tag));
+    return _mm_movemask_epi8(_mm_packs_epi16(eq, _mm_setzero_si128()));
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < 8; ++i)
+        mask |= unsigned(tags[i] == tag) << i;
+    return mask;
+#endif
+}
+
+#if defined(__SSE2__)
+// Lane-wise signed maximum, which SSE2 lacks an instruction for
+inline __m128i max_epi32(__m128i a, __m128i b)
+{
+#if defined(__SSE4_1__)
+    return _mm_max_epi32(a, b);
+#else
+    __m128i greater = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(greater, a), _mm_andnot_si128(greater, b));
+#endif
+}
+#endif
+
+// Replacement policies a cache level can use
+enum replacement_policy
+{
+    POLICY_AGE, // the original last_access counters, the default
+    POLICY_LRU,
+    POLICY_PLRU,
+    POLICY_FIFO,
+    POLICY_RANDOM,
+    POLICY_SRRIP,
+    POLICY_BRRIP,
+    NUM_POLICIES
+};
+
+const char *const POLICY_NAMES[NUM_POLICIES] = {"age", "lru", "plru", "fifo", "random", "srrip", "brrip"};
+
+/*
+    How a cache level handles stores. Write-through passes every store on
+    to the level below, write-back only marks the line dirty and writes
+    it back when it is replaced. An allocating level fills a line on a
+    store miss, reading the rest of the block from below.
+*/
+enum write_policy
+{
+    WRITE_INSTALL, // the original: fill the way the policy picks without a lookup, and write through
+    WRITE_THROUGH_ALLOCATE,
+    WRITE_THROUGH_NO_ALLOCATE,
+    WRITE_BACK_ALLOCATE,
+    WRITE_BACK_NO_ALLOCATE,
+    NUM_WRITE_POLICIES
+};
+
+const char *const WRITE_POLICY_NAMES[NUM_WRITE_POLICIES] = {"install", "wtwa", "wtnwa", "wbwa", "wbnwa"};
+
+/*
+    Looks up a policy by its command-line name in names.
+
+    @return false if there is no such policy
+*/
+template <class Policy, size_t N>
+bool parse_policy(const string &name, const char *const (&names)[N], Policy &policy)
+{
+    for (size_t i = 0; i < N; ++i)
+        if (name == names[i])
+        {
+            policy = Policy(i);
+            return true;
+        }
+    return false;
+}
+
+/*
+    Parses a comma separated list of policy names, one per cache level
+    starting with L1.
+
+    @return false if a name is unknown
+*/
+template <class Policy, size_t N>
+bool parse_policy_list(const string &list, const char *const (&names)[N], vector<Policy> &policies)
+{
+    size_t lastpos = 0;
+    while (lastpos <= list.size())
+    {
+        size_t pos = list.find(',', lastpos);
+        if (pos == string::npos)
+            pos = list.size();
+        Policy policy;
+        if (!parse_policy(list.substr(lastpos, pos - lastpos), names, policy))
+            return false;
+        policies.push_back(policy);
+        lastpos = pos + 1;
+    }
+    return true;
+}
+
+/*
+    The policy of one level given a list from parse_policy_list: the
+    default, the first policy of the enum, when the list is empty, and
+    the last policy listed for every level deeper than the list goes.
+
+    @param depth 0 for L1
+*/
+template <class Policy>
+Policy policy_for_level(const vector<Policy> &policies, size_t depth)
+{
+    if (policies.empty())
+        return Policy(0);
+    return policies[min(depth, policies.size() - 1)];
+}
+
+// Cache geometry: size, associativity, blocksize, and how to replace and write
+struct cache_geometry
+{
+    int size, assoc, blocksize;
+    replacement_policy policy = POLICY_AGE;
+    uint32_t seed = 1;
+    write_policy write = WRITE_INSTALL;
+
+    // Whether the policy can run on this associativity
+    bool policy_fits() const
+    {
+        return policy != POLICY_PLRU || (assoc & (assoc - 1)) == 0;
+    }
+};
+
+/*
+    Every policy below keeps its own per-set metadata and answers two
+    calls from cache_model: touch(row, way) when a load hits way, and
+    replace(row, valid) to pick the way a miss or store fills, which
+    counts as an access to that way. valid points to the set's packed
+    valid bits. state(archive) hands every piece of that metadata to
+    archive(data, count), which either saves or restores it.
+*/
+
+/*
+    The original replacement: a last_access counter per way tracks how
+    long the way has NOT been used, the higher the less recent. A hit ages
+    the ways before it (the original lookup scan stopped at the hit),
+    a fill ages every way. Counters saturate instead of overflowing.
+
+    Each set's counters are padded to `stride` slots so they are whole
+    SIMD registers. Padding never ages, so it never gets picked.
+*/
+struct age_policy
+{
+    int assoc = 0, stride = 0;
+    vector<int32_t, aligned_allocator<int32_t, 16>> last_access;
+
+    age_policy() = default;
+    age_policy(int rows, int assoc, int stride)
+        : assoc(assoc), stride(stride), last_access(size_t(rows) * stride, 0)
+    {
+    }
+
+    void touch(int row, int way)
+    {
+        int32_t *ages = &last_access[size_t(row) * stride];
+#if defined(__SSE2__)
+        __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+        __m128i hit = _mm_set1_epi32(way);
+        __m128i saturated = _mm_set1_epi32(INT32_MAX);
+        for (int i = 0; i < stride; i += 4)
+        {
+            __m128i a = _mm_load_si128((const __m128i *)(ages + i));
+            __m128i older = _mm_andnot_si128(_mm_cmpeq_epi32(a, saturated), _mm_cmpgt_epi32(hit, lanes));
+            a = _mm_sub_epi32(a, older); // older is -1 in the lanes that age
+            a = _mm_andnot_si128(_mm_cmpeq_epi32(hit, lanes), a);
+            _mm_store_si128((__m128i *)(ages + i), a);
+            lanes = _mm_add_epi32(lanes, _mm_set1_epi32(4));
+        }
+#else
+        for (int i = 0; i < way; ++i)
+            ages[i] += ages[i] != INT32_MAX;
+        ages[way] = 0;
+#endif
+    }
+
+    /*
+        Picks the first way holding the largest counter, or way 0 when
+        nothing has aged; counters are never negative, so this is the way
+        a compare-as-you-go scan picks.
+    */
+    int replace(int row, const uint64_t *)
+    {
+        int32_t *ages = &last_access[size_t(row) * stride];
+#if defined(__SSE2__)
+        __m128i lo = _mm_load_si128((const __m128i *)ages);
+        __m128i hi = _mm_load_si128((const __m128i *)(ages + 4));
+        for (int i = 8; i < stride; i += 8)
+        {
+            lo = max_epi32(lo, _mm_load_si128((const __m128i *)(ages + i)));
+            hi = max_epi32(hi, _mm_load_si128((const __m128i *)(ages + i + 4)));
+        }
+        __m128i oldest = max_epi32(lo, hi);
+        oldest = max_epi32(oldest, _mm_shuffle_epi32(oldest, _MM_SHUFFLE(1, 0, 3, 2)));
+        oldest = max_epi32(oldest, _mm_shuffle_epi32(oldest, _MM_SHUFFLE(2, 3, 0, 1)));
+
+        // First lane holding the largest counter, eight lanes at a time
+        int lru = 0;
+        for (int i = 0; i < stride; i += 8)
+        {
+            __m128i lo = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *)(ages + i)), oldest);
+            __m128i hi = _mm_cmpeq_epi32(_mm_load_si128((const __m128i *)(ages + i + 4)), oldest);
+            int mask = _mm_movemask_epi8(_mm_packs_epi16(_mm_packs_epi32(lo, hi), _mm_setzero_si128()));
+            if (mask)
+            {
+                lru = i + __builtin_ctz(mask);
+                break;
+            }
+        }
+
+        __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+        __m128i ways = _mm_set1_epi32(assoc);
+        __m128i picked = _mm_set1_epi32(lru);
+        __m128i saturated = _mm_set1_epi32(INT32_MAX);
+        for (int i = 0; i < stride; i += 4)
+        {
+            __m128i a = _mm_load_si128((const __m128i *)(ages + i));
+            __m128i older = _mm_andnot_si128(_mm_cmpeq_epi32(a, saturated), _mm_cmpgt_epi32(ways, lanes));
+            a = _mm_sub_epi32(a, older);
+            a = _mm_andnot_si128(_mm_cmpeq_epi32(picked, lanes), a);
+            _mm_store_si128((__m128i *)(ages + i), a);
+            lanes = _mm_add_epi32(lanes, _mm_set1_epi32(4));
+        }
+        return lru;
+#else
+        int lru = 0;
+        int lru_last_access = 0;
+        for (int i = 0; i < assoc; ++i)
+        {
+            if (ages[i] > lru_last_access)
+            {
+                lru = i;
+                lru_last_access = ages[i];
+            }
+            ages[i] += ages[i] != INT32_MAX;
+        }
+        ages[lru] = 0;
+        return lru;
+#endif
+    }
+
+    template <class Archive>
+    void state(Archive &archive)
+    {
+        archive(last_access.data(), last_access.size());
+    }
+};
+
+/*
+    True LRU. Each set's ways form a circular doubly linked list from the
+    most recent (head) to the least recent (the way before head), so an
+    access moves one way to the front in constant time. Ways start out
+    ordered so that empty ways fill from way 0 up.
+*/
+struct lru_policy
+{
+    int assoc = 0;
+    vector<uint16_t> older, newer; // neighbours of each way, per set
+    vector<uint16_t> head;         // most recent way of each set
+
+    lru_policy() = default;
+    lru_policy(int rows, int assoc)
+        : assoc(assoc), older(size_t(rows) * assoc), newer(size_t(rows) * assoc), head(rows, assoc - 1)
+    {
+        for (size_t base = 0; base < older.size(); base += assoc)
+            for (int way = 0; way < assoc; ++way)
+            {
+                older[base + way] = way == 0 ? assoc - 1 : way - 1;
+                newer[base + way] = way == assoc - 1 ? 0 : way + 1;
+            }
+    }
+
+    void touch(int row, int way)
+    {
+        uint16_t *set_older = &older[size_t(row) * assoc];
+        uint16_t *set_newer = &newer[size_t(row) * assoc];
+        uint16_t &first = head[row];
+        if (way == first)
+            return;
+        uint16_t last = set_newer[first];
+        if (way != last)
+        {
+            // unlink way, then put it between the least and most recent
+            set_older[set_newer[way]] = set_older[way];
+            set_newer[set_older[way]] = set_newer[way];
+            set_older[way] = first;
+            set_newer[way] = last;
+            set_newer[first] = way;
+            set_older[last] = way;
+        }
+        // the list is circular, so the least recent way becomes the head
+        // just by moving head back one
+        first = way;
+    }
+
+    int replace(int row, const uint64_t *)
+    {
+        int way = newer[size_t(row) * assoc + head[row]];
+        head[row] = way;
+        return way;
+    }
+
+    template <class Archive>
+    void state(Archive &archive)
+    {
+        archive(older.data(), older.size());
+        archive(newer.data(), newer.size());
+        archive(head.data(), head.size());
+    }
+};
+
+/*
+    Tree pseudo-LRU for power-of-two associativity: assoc - 1 bits per set
+    laid out as a heap (node n has children 2n and 2n + 1, way w is leaf
+    assoc + w), each pointing towards the half to evict from next.
+*/
+struct plru_policy
+{
+    int assoc = 0, words = 0;
+    vector<uint64_t> bits;
+
+    plru_policy() = default;
+    plru_policy(int rows, int assoc)
+        : assoc(assoc), words((assoc + 63) / 64), bits(size_t(rows) * words, 0)
+    {
+    }
+
+    void touch(int row, int way)
+    {
+        uint64_t *set_bits = &bits[size_t(row) * words];
+        if (words == 1)
+        {
+            // the whole tree is one word, keep it in a register
+            uint64_t tree = *set_bits;
+            for (int node = assoc + way; node > 1; node /= 2)
+                tree = (tree & ~(uint64_t(1) << (node / 2))) | uint64_t(~node & 1) << (node / 2);
+            *set_bits = tree;
+            return;
+        }
+        for (int node = assoc + way; node > 1; node /= 2)
+        {
+            // point the parent at the sibling subtree
+            int parent = node / 2;
+            uint64_t &word = set_bits[parent / 64];
+            word = (word & ~(uint64_t(1) << (parent % 64))) | uint64_t(~node & 1) << (parent % 64);
+        }
+    }
+
+    int replace(int row, const uint64_t *)
+    {
+        const uint64_t *set_bits = &bits[size_t(row) * words];
+        int node = 1;
+        while (node < assoc)
+            node = 2 * node + (set_bits[node / 64] >> (node % 64) & 1);
+        touch(row, node - assoc);
+        return node - assoc;
+    }
+
+    template <class Archive>
+    void state(Archive &archive)
+    {
+        archive(bits.data(), bits.size());
+    }
+};
+
+/*
+    First in, first out: ways are filled round robin, hits change nothing.
+*/
+struct fifo_policy
+{
+    int assoc = 0;
+    vector<uint16_t> next_fill;
+
+    fifo_policy() = default;
+    fifo_policy(int rows, int assoc) : assoc(assoc), next_fill(rows, 0) {}
+
+    void touch(int, int) {}
+
+    int replace(int row, const uint64_t *)
+    {
+        int way = next_fill[row];
+        next_fill[row] = way + 1 == assoc ? 0 : way + 1;
+        return way;
+    }
+
+    template <class Archive>
+    void state(Archive &archive)
+    {
+        archive(next_fill.data(), next_fill.size());
+    }
+};
+
+/*
+    xorshift32 generator, so seeded runs repeat exactly on every platform.
+*/
+struct xorshift32
+{
+    uint32_t state = 1;
+
+    explicit xorshift32(uint32_t seed = 1) : state(seed * 2654435761u | 1) {}
+
+    uint32_t next()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+};
+
+/*
+    Random replacement: an empty way if the set has one, otherwise a way
+    drawn from a seeded generator. Needs no per-set metadata.
+*/
+struct random_policy
+{
+    int assoc = 0;
+    xorshift32 rng;
+
+    random_policy() = default;
+    random_policy(int assoc, uint32_t seed) : assoc(assoc), rng(seed) {}
+
+    void touch(int, int) {}
+
+    int replace(int, const uint64_t *valid)
+    {
+        for (int word = 0; word * 64 < assoc; ++word)
+            if (~valid[word] != 0)
+            {
+                int way = word * 64 + __builtin_ctzll(~valid[word]);
+                if (way < assoc)
+                    return way;
+            }
+        return rng.next() % assoc;
+    }
+
+    template <class Archive>
+    void state(Archive &archive)
+    {
+        archive(&rng.state, 1);
+    }
+};
+
+/*
+    Static and bimodal re-reference interval prediction (SRRIP/BRRIP): a
+    2-bit prediction per way of how soon it is reused, 0 soonest. Hits
+    predict 0, and the victim is the first way predicted at 3, aging the
+    whole set until one is. SRRIP fills at 2; BRRIP fills at 3 except for
+    one fill in 32, chosen by a seeded generator, so a scan can't flush
+    the set.
+*/
+struct rrip_policy
+{
+    static constexpr uint8_t DISTANT = 3;
+
+    int assoc = 0;
+    bool bimodal = false;
+    xorshift32 rng;
+    vector<uint8_t> prediction;
+
+    rrip_policy() = default;
+    rrip_policy(int rows, int assoc, bool bimodal, uint32_t seed)
+        : assoc(assoc), bimodal(bimodal), rng(seed), prediction(size_t(rows) * assoc, DISTANT)
+    {
+    }
+
+    void touch(int row, int way)
+    {
+        prediction[size_t(row) * assoc + way] = 0;
+    }
+
+    int replace(int row, const uint64_t *)
+    {
+        uint8_t *set = &prediction[size_t(row) * assoc];
+        uint8_t furthest = *max_element(set, set + assoc);
+        if (furthest < DISTANT)
+            for (int i = 0; i < assoc; ++i)
+                set[i] += DISTANT - furthest;
+        int way = find(set, set + assoc, DISTANT) - set;
+        set[way] = bimodal && rng.next() % 32 != 0 ? DISTANT : DISTANT - 1;
+        return way;
+    }
+
+    template <class Archive>
+    void state(Archive &archive)
+    {
+        archive(&rng.state, 1);
+        archive(prediction.data(), prediction.size());
+    }
+};
+
+// What cache_model::sw needs from the level below
+const int STORE_PASS = 1;
+const int STORE_FETCH = 2;
+
+/*
+    A single cache level stored as flat arrays rather than a cell per way.
+    Each set owns a run of `stride` tags (the associativity rounded up to a
+    multiple of eight, so 8 and 16 ways are one or two SIMD registers) and
+    one packed word of valid bits per 64 ways. Tags are 16 bits: a tag is a
+    block number divided by the row count, and memory has only 8192 words.
+    Padding ways are never valid, so they never match.
+
+    The replacement policy is chosen per model. Only the selected policy's
+    metadata is allocated, and each access dispatches on it once. Dirty
+    bits, laid out like the valid bits, exist only for write-back models.
+
+    Sets are always written with the same width they are read with, so a
+    lookup right after an update of the same set is forwarded from the
+    store buffer instead of stalling on a partial write.
+*/
+struct cache_model
+{
+    int size, assoc, blocksize, rows;
+    int stride;      // tag slots per set
+    int valid_words; // 64 bit valid words per set
+    int block_shift, row_shift; // log2 of blocksize and rows, or -1 if not a power of two
+    vector<uint16_t, aligned_allocator<uint16_t, 16>> tags;
+    vector<uint64_t> valid;
+    vector<uint64_t> dirty;
+    vector<uint64_t> evictions; // valid lines each row has replaced
+    int victim = -1;            // address of a dirty block the last fill evicted, for the caller to write back
+
+    // Traffic with the level below, in words: blocks read in, and words
+    // written through or back
+    uint64_t fills = 0, words_written = 0, writebacks = 0;
+
+    write_policy write;
+    replacement_policy policy;
+    age_policy age;
+    lru_policy lru;
+    plru_policy plru;
+    fifo_policy fifo;
+    random_policy random_pick;
+    rrip_policy rrip;
+
+    /*
+        @param policy How to pick the way a miss or store fills. POLICY_PLRU
+            needs a power-of-two associativity
+        @param seed Seeds POLICY_RANDOM and POLICY_BRRIP
+        @param write How stores are handled
+    */
+    cache_model(int size, int assoc, int blocksize, replacement_policy policy = POLICY_AGE, uint32_t seed = 1,
+                write_policy write = WRITE_INSTALL)
+        : size(size), assoc(assoc), blocksize(blocksize), rows(size / (assoc * blocksize)),
+          stride((assoc + 7) / 8 * 8), valid_words((assoc + 63) / 64),
+          block_shift(log2_exact(blocksize)), row_shift(log2_exact(rows)),
+          tags(size_t(rows) * stride, 0), valid(size_t(rows) * valid_words, 0), evictions(rows, 0),
+          write(write), policy(policy)
+    {
+        if (write_back())
+            dirty.assign(valid.size(), 0);
+        switch (policy)
+        {
+        case POLICY_AGE:
+            age = age_policy(rows, assoc, stride);
+            break;
+        case POLICY_LRU:
+            lru = lru_policy(rows, assoc);
+            break;
+        case POLICY_PLRU:
+            plru = plru_policy(rows, assoc);
+            break;
+        case POLICY_FIFO:
+            fifo = fifo_policy(rows, assoc);
+            break;
+        case POLICY_RANDOM:
+            random_pick = random_policy(assoc, seed);
+            break;
+        case POLICY_SRRIP:
+        case POLICY_BRRIP:
+            rrip = rrip_policy(rows, assoc, policy == POLICY_BRRIP, seed);
+            break;
+        default:
+            break;
+        }
+    }
+
+    explicit cache_model(const cache_geometry &geometry)
+        : cache_model(geometry.size, geometry.assoc, geometry.blocksize, geometry.policy, geometry.seed,
+                      geometry.write)
+    {
+    }
+
+    bool write_back() const
+    {
+        return write == WRITE_BACK_ALLOCATE || write == WRITE_BACK_NO_ALLOCATE;
+    }
+
+    static int log2_exact(int n)
+    {
+        return n > 0 && (n & (n - 1)) == 0 ? __builtin_ctz(n) : -1;
+    }
+
+    /*
+        Splits addr into the row it maps to and the tag stored there.
+        Addresses are never negative, so shifts give the same answer as
+        dividing whenever the geometry allows them.
+    */
+    uint16_t locate(int addr, int &row) const
+    {
+        int block_id = block_shift >= 0 ? addr >> block_shift : addr / blocksize;
+        if (row_shift >= 0)
+        {
+            row = block_id & (rows - 1);
+            return block_id >> row_shift;
+        }
+        row = block_id % rows;
+        return block_id / rows;
+    }
+
+    /*
+        Finds the first valid way of row holding tag.
+
+        @return The way, or -1 if the tag isn't cached
+    */
+    int find(int row, uint16_t tag) const
+    {
+        const uint16_t *set_tags = &tags[size_t(row) * stride];
+        const uint64_t *set_valid = &valid[size_t(row) * valid_words];
+        for (int first = 0; first < stride; first += 16)
+        {
+            uint64_t bits = set_valid[first / 64] >> (first % 64);
+            unsigned mask = match_tags8(set_tags + first, tag);
+            if (first + 8 < stride)
+                mask |= match_tags8(set_tags + first + 8, tag) << 8;
+            mask &= bits;
+            if (mask)
+                return first + __builtin_ctz(mask);
+        }
+        return -1;
+    }
+
+    // Tells the policy that a load hit way of row
+    void touch(int row, int way)
+    {
+        switch (policy)
+        {
+        case POLICY_AGE:
+            age.touch(row, way);
+            break;
+        case POLICY_LRU:
+            lru.touch(row, way);
+            break;
+        case POLICY_PLRU:
+            plru.touch(row, way);
+            break;
+        case POLICY_SRRIP:
+        case POLICY_BRRIP:
+            rrip.touch(row, way);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Asks the policy which way of row to fill
+    int replace(int row)
+    {
+        const uint64_t *set_valid = &valid[size_t(row) * valid_words];
+        switch (policy)
+        {
+        case POLICY_LRU:
+            return lru.replace(row, set_valid);
+        case POLICY_PLRU:
+            return plru.replace(row, set_valid);
+        case POLICY_FIFO:
+            return fifo.replace(row, set_valid);
+        case POLICY_RANDOM:
+            return random_pick.replace(row, set_valid);
+        case POLICY_SRRIP:
+        case POLICY_BRRIP:
+            return rrip.replace(row, set_valid);
+        default:
+            return age.replace(row, set_valid);
+        }
+    }
+
+    // Puts tag into way of row and marks it valid and clean
+    void fill(int row, int way, uint16_t tag)
+    {
+        uint16_t *set_tags = &tags[size_t(row) * stride];
+        if (!dirty.empty())
+            evict_dirty(row, way, set_tags[way]);
+#if defined(__SSE2__)
+        int first = way & ~7;
+        __m128i t = _mm_load_si128((const __m128i *)(set_tags + first));
+        __m128i slot = _mm_cmpeq_epi16(_mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7), _mm_set1_epi16(way - first));
+        t = _mm_or_si128(_mm_andnot_si128(slot, t), _mm_and_si128(slot, _mm_set1_epi16(tag)));
+        _mm_store_si128((__m128i *)(set_tags + first), t);
+#else
+        set_tags[way] = tag;
+#endif
+        uint64_t &word = valid[size_t(row) * valid_words + way / 64];
+        uint64_t bit = uint64_t(1) << (way % 64);
+        evictions[row] += (word & bit) != 0;
+        word |= bit;
+    }
+
+    // Sets victim to the block in way of row if it is dirty, and cleans it
+    void evict_dirty(int row, int way, uint16_t tag)
+    {
+        uint64_t &word = dirty[size_t(row) * valid_words + way / 64];
+        uint64_t bit = uint64_t(1) << (way % 64);
+        if (!(word & bit))
+            return;
+        word &= ~bit;
+        victim = (tag * rows + row) * blocksize;
+        writebacks++;
+        words_written += blocksize;
+    }
+
+    // Address of the block in way of row, or -1 if the way isn't valid
+    int block_at(int row, int way) const
+    {
+        if (!(valid[size_t(row) * valid_words + way / 64] >> (way % 64) & 1))
+            return -1;
+        return (tags[size_t(row) * stride + way] * rows + row) * blocksize;
+    }
+
+    void mark_dirty(int row, int way)
+    {
+        dirty[size_t(row) * valid_words + way / 64] |= uint64_t(1) << (way % 64);
+    }
+
+    bool dirty_at(int row, int way) const
+    {
+        return !dirty.empty() && dirty[size_t(row) * valid_words + way / 64] >> (way % 64) & 1;
+    }
+
+    // Counts a dirty way as written back and clears its dirty bit
+    void clean(int row, int way)
+    {
+        dirty[size_t(row) * valid_words + way / 64] &= ~(uint64_t(1) << (way % 64));
+        writebacks++;
+        words_written += blocksize;
+    }
+
+    // Drops way of row without writing it back, as a coherence invalidation does
+    void invalidate(int row, int way)
+    {
+        uint64_t bit = uint64_t(1) << (way % 64);
+        valid[size_t(row) * valid_words + way / 64] &= ~bit;
+        if (!dirty.empty())
+            dirty[size_t(row) * valid_words + way / 64] &= ~bit;
+    }
+
+    // First way of row that isn't valid, or -1 if the row is full
+    int vacancy(int row) const
+    {
+        for (int i = 0; i < valid_words; ++i)
+        {
+            uint64_t free = ~valid[size_t(row) * valid_words + i];
+            if (free)
+            {
+                int way = i * 64 + __builtin_ctzll(free);
+                return way < assoc ? way : -1;
+            }
+        }
+        return -1;
+    }
+
+    // Number of valid ways in row
+    int occupancy(int row) const
+    {
+        int count = 0;
+        for (int i = 0; i < valid_words; ++i)
+            count += __builtin_popcountll(valid[size_t(row) * valid_words + i]);
+        return count;
+    }
+
+    /*
+        Saves or restores the contents: tags, valid and dirty bits and the
+        selected policy's metadata. The eviction and traffic counts are
+        statistics, not state.
+    */
+    template <class Archive>
+    void state(Archive &archive)
+    {
+        archive(tags.data(), tags.size());
+        archive(valid.data(), valid.size());
+        archive(dirty.data(), dirty.size());
+        switch (policy)
+        {
+        case POLICY_AGE:
+            age.state(archive);
+            break;
+        case POLICY_LRU:
+            lru.state(archive);
+            break;
+        case POLICY_PLRU:
+            plru.state(archive);
+            break;
+        case POLICY_FIFO:
+            fifo.state(archive);
+            break;
+        case POLICY_RANDOM:
+            random_pick.state(archive);
+            break;
+        case POLICY_SRRIP:
+        case POLICY_BRRIP:
+            rrip.state(archive);
+            break;
+        default:
+            break;
+        }
+    }
+
+    /*
+        Looks up addr for a load, filling the way the policy picks on a miss.
+
+        @param addr The memory address being read
+        @param row Set to the row the address maps to
+
+        @return true on a hit
+    */
+    bool lw(int addr, int &row)
+    {
+        uint16_t tag = locate(addr, row);
+        int way = find(row, tag);
+        if (way >= 0)
+        {
+            touch(row, way);
+            return true;
+        }
+        fill(row, replace(row), tag);
+        fills++;
+        return false;
+    }
+
+    /*
+        Writes words words starting at addr, a store or a block written
+        back from above, as the write policy says.
+
+        @param addr The memory address being written
+        @param row Set to the row the address maps to
+
+        @return STORE_PASS if the write goes on to the level below, and
+            STORE_FETCH if the rest of the block has to be read from it
+    */
+    int sw(int addr, int &row, int words = 1)
+    {
+        uint16_t tag = locate(addr, row);
+        if (write == WRITE_INSTALL)
+        {
+            fill(row, replace(row), tag);
+            words_written += words;
+            return STORE_PASS;
+        }
+        int below = 0;
+        int way = find(row, tag);
+        if (way >= 0)
+            touch(row, way);
+        else if (write == WRITE_THROUGH_ALLOCATE || write == WRITE_BACK_ALLOCATE)
+        {
+            way = replace(row);
+            fill(row, way, tag);
+            if (words < blocksize)
+            {
+                below |= STORE_FETCH;
+                fills++;
+            }
+        }
+        if (way >= 0 && write_back())
+        {
+            mark_dirty(row, way);
+            return below;
+        }
+        words_written += words;
+        return below | STORE_PASS;
+    }
+};
+
+/*
+    Loads an E20 program into the list provided by mem: an .e20img image
+    with one read, anything else as machine code text mapped into memory.
+    Exits with a message on any error.
+
+    @param filename The program file
+    @param mem Array representing memory into which to read program
+*/
+void load_machine_code(const string &filename, uint16_t mem[])
+{
+    string error;
+    if (!read_program(filename, mem, error))
+    {
+        cerr << error << endl;
+        exit(1);
+    }
+}
+
+/*
+    Prints out the correctly-formatted configuration of a cache.
+
+    @param cache_name The name of the cache. "L1" or "L2"
+
+    @param size The total size of the cache, measured in memory cells.
+        Excludes metadata
+
+    @param assoc The associativity of the cache. One of [1,2,4,8,16]
+
+    @param blocksize The blocksize of the cache. One of [1,2,4,8,16,32,64])
+
+    @param num_rows The number of rows in the given cache.
+*/
+void print_cache_config(const string &cache_name, int size, int assoc, int blocksize, int num_rows)
+{
+    cout << "Cache " << cache_name << " has size " << size << ", associativity " << assoc << ", blocksize " << blocksize << ", rows " << num_rows << endl;
+}
+
+/*
+    One LW or SW seen by the cache models.
+*/
+struct mem_access
+{
+    uint16_t pc;
+    uint16_t addr;
+    bool is_store;
+};
+
+/*
+    Runs e20 until halt, calling hook.step(pc) before every instruction,
+    hook.lw(pc, addr) before every load and hook.sw(pc, addr) before every
+    store.
+*/
+template <class Hook>
+void run_e20(uint16_t memory[], uint16_t regs[], uint16_t pc, Hook &hook)
+{
+    flat_memory words{memory};
+    bool halted;
+    run_e20_for(words, regs, pc, hook, UINT64_MAX, halted);
+}
+
+/*
+    One point of a sweep: an L1 and optional L2 model with their counters.
+*/
+struct sweep_point
+{
+    cache_model l1;
+    vector<cache_model> l2; // empty or one model
+    long long l1_hits = 0, l1_misses = 0, l1_sw = 0;
+    long long l2_hits = 0, l2_misses = 0, l2_sw = 0;
+
+    void access(const mem_access &a)
+    {
+        int row;
+        if (a.is_store)
+        {
+            l1.sw(a.addr, row);
+            l1_sw++;
+            if (!l2.empty())
+            {
+                l2[0].sw(a.addr, row);
+                l2_sw++;
+            }
+        }
+        else if (l1.lw(a.addr, row))
+            l1_hits++;
+        else
+        {
+            l1_misses++;
+            if (!l2.empty())
+            {
+                if (l2[0].lw(a.addr, row))
+                    l2_hits++;
+                else
+                    l2_misses++;
+            }
+        }
+    }
+};
+
+/*
+    Parses one sweep list such as "16,64" or "16-256" (every power of two
+    from 16 to 256) into values.
+
+    @return false if the list is malformed or a range has an end that
+        isn't a power of two
+*/
+bool parse_sweep_list(const string &list, vector<int> &values)
+{
+    size_t lastpos = 0;
+    while (lastpos <= list.size())
+    {
+        size_t pos = list.find(',', lastpos);
+        if (pos == string::npos)
+            pos = list.size();
+        string item = list.substr(lastpos, pos - lastpos);
+        size_t dash = item.find('-');
+        try
+        {
+            if (dash == string::npos)
+                values.push_back(stoi(item));
+            else
+            {
+                int lo = stoi(item.substr(0, dash));
+                int hi = stoi(item.substr(dash + 1));
+                if (lo <= 0 || hi < lo || (lo & (lo - 1)) != 0 || (hi & (hi - 1)) != 0)
+                    return false;
+                int v = lo;
+                values.push_back(v);
+                while (v <= hi / 2)
+                    values.push_back(v *= 2);
+            }
+        }
+        catch (const exception &)
+        {
+            return false;
+        }
+        lastpos = pos + 1;
+    }
+    for (int v : values)
+        if (v <= 0)
+            return false;
+    return true;
+}
+
+/*
+    Parses SIZES:ASSOCS:BLOCKSIZES into every valid geometry it describes.
+    Combinations that do not divide into a whole number of rows are skipped.
+
+    @return false if the spec is malformed
+*/
+bool parse_sweep_spec(const string &spec, vector<cache_geometry> &geometries)
+{
+    size_t first = spec.find(':');
+    size_t second = first == string::npos ? first : spec.find(':', first + 1);
+    if (second == string::npos)
+        return false;
+    vector<int> sizes, assocs, blocksizes;
+    if (!parse_sweep_list(spec.substr(0, first), sizes) ||
+        !parse_sweep_list(spec.substr(first + 1, second - first - 1), assocs) ||
+        !parse_sweep_list(spec.substr(second + 1), blocksizes))
+        return false;
+
+    for (int size : sizes)
+        for (int assoc : assocs)
+            for (int blocksize : blocksizes)
+                if (size % (assoc * blocksize) == 0)
+                    geometries.push_back({size, assoc, blocksize});
+    return true;
+}
+
+/*
+    Collects the accesses of one e20 run in chunks and feeds every chunk
+    to all sweep points. Each of num_threads workers owns every
+    num_threads-th point for the whole run. There are two chunks, so the
+    workers feed one to their points while the run fills the other.
+*/
+struct sweep_runner
+{
+    vector<sweep_point> &points;
+    unsigned num_threads;
+    vector<mem_access> chunks[2];
+    size_t filling = 0; // the chunk the run appends to
+    size_t posted = 0;  // the chunk the workers feed to their points
+    vector<thread> workers;
+    mutex lock;
+    condition_variable chunk_posted, chunk_done;
+    uint64_t generation = 0; // chunks posted so far
+    unsigned busy = 0;       // workers still feeding the posted chunk
+    bool closing = false;
+
+    static const size_t CHUNK_SIZE = 1 << 18;
+    static const size_t INTERLEAVE = 4;
+
+    static const bool skips_loops = true;
+
+    sweep_runner(vector<sweep_point> &points, unsigned num_threads)
+        : points(points), num_threads(num_threads)
+    {
+        for (vector<mem_access> &chunk : chunks)
+            chunk.reserve(CHUNK_SIZE);
+        for (unsigned t = 0; t < num_threads; ++t)
+            workers.emplace_back(&sweep_runner::work, this, t);
+    }
+
+    ~sweep_runner()
+    {
+        finish();
+    }
+
+    void step(uint16_t) {}
+
+    void lw(uint16_t pc, uint16_t addr)
+    {
+        chunks[filling].push_back({pc, addr, false});
+        if (chunks[filling].size() == CHUNK_SIZE)
+            flush();
+    }
+
+    void sw(uint16_t pc, uint16_t addr)
+    {
+        chunks[filling].push_back({pc, addr, true});
+        if (chunks[filling].size() == CHUNK_SIZE)
+            flush();
+    }
+
+    void jump(uint16_t, uint16_t) {}
+    void skip(uint16_t, uint64_t) {}
+
+    // Waits for the workers to finish the last chunk, posts the one being
+    // filled to them and starts filling the other
+    void flush()
+    {
+        {
+            unique_lock<mutex> guard(lock);
+            chunk_done.wait(guard, [this] { return busy == 0; });
+            posted = filling;
+            busy = num_threads;
+            generation++;
+        }
+        chunk_posted.notify_all();
+        filling ^= 1;
+        chunks[filling].clear();
+    }
+
+    // Feeds the rest of the run to the points and stops the workers
+    void finish()
+    {
+        if (workers.empty())
+            return;
+        if (!chunks[filling].empty())
+            flush();
+        {
+            unique_lock<mutex> guard(lock);
+            chunk_done.wait(guard, [this] { return busy == 0; });
+            closing = true;
+        }
+        chunk_posted.notify_all();
+        for (thread &t : workers)
+            t.join();
+        workers.clear();
+    }
+
+    // Body of worker first, which owns points first, first + num_threads, ...
+    void work(size_t first)
+    {
+        vector<sweep_point *> mine;
+        for (size_t p = first; p < points.size(); p += num_threads)
+            mine.push_back(&points[p]);
+        uint64_t seen = 0;
+        for (;;)
+        {
+            const vector<mem_access> *chunk;
+            {
+                unique_lock<mutex> guard(lock);
+                chunk_posted.wait(guard, [&] { return generation != seen || closing; });
+                if (generation == seen)
+                    return;
+                seen = generation;
+                chunk = &chunks[posted];
+            }
+            // Each access depends on the previous one to the same model, so
+            // feed a few points at once to overlap their work
+            for (size_t g = 0; g < mine.size(); g += INTERLEAVE)
+            {
+                size_t n = min(mine.size() - g, size_t(INTERLEAVE));
+                for (const mem_access &a : *chunk)
+                    for (size_t i = 0; i < n; ++i)
+                        mine[g + i]->access(a);
+            }
+            bool last;
+            {
+                lock_guard<mutex> guard(lock);
+                last = --busy == 0;
+            }
+            if (last)
+                chunk_done.notify_one();
+        }
+    }
+};
+
+/*
+    Prints the sweep results as CSV or JSON.
+*/
+void print_sweep_results(const vector<sweep_point> &points, bool two_levels, bool json)
+{
+    if (json)
+        cout << "[" << endl;
+    else
+    {
+        cout << "l1_size,l1_assoc,l1_blocksize,l1_rows,";
+        if (two_levels)
+            cout << "l2_size,l2_assoc,l2_blocksize,l2_rows,";
+        cout << "l1_hits,l1_misses,l1_sw";
+        if (two_levels)
+            cout << ",l2_hits,l2_misses,l2_sw";
+        cout << endl;
+    }
+
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        const sweep_point &p = points[i];
+        const cache_model &l1 = p.l1;
+        if (json)
+        {
+            cout << "  {\"l1\": {\"size\": " << l1.size << ", \"assoc\": " << l1.assoc
+                 << ", \"blocksize\": " << l1.blocksize << ", \"rows\": " << l1.rows
+                 << ", \"hits\": " << p.l1_hits << ", \"misses\": " << p.l1_misses << ", \"sw\": " << p.l1_sw << "}";
+            if (two_levels)
+            {
+                const cache_model &l2 = p.l2[0];
+                cout << ", \"l2\": {\"size\": " << l2.size << ", \"assoc\": " << l2.assoc
+                     << ", \"blocksize\": " << l2.blocksize << ", \"rows\": " << l2.rows
+                     << ", \"hits\": " << p.l2_hits << ", \"misses\": " << p.l2_misses << ", \"sw\": " << p.l2_sw << "}";
+            }
+            cout << "}" << (i + 1 < points.size() ? "," : "") << endl;
+        }
+        else
+        {
+            cout << l1.size << "," << l1.assoc << "," << l1.blocksize << "," << l1.rows << ",";
+            if (two_levels)
+                cout << p.l2[0].size << "," << p.l2[0].assoc << "," << p.l2[0].blocksize << "," << p.l2[0].rows << ",";
+            cout << p.l1_hits << "," << p.l1_misses << "," << p.l1_sw;
+            if (two_levels)
+                cout << "," << p.l2_hits << "," << p.l2_misses << "," << p.l2_sw;
+            cout << endl;
+        }
+    }
+
+    if (json)
+        cout << "]" << endl;
+}
+
+/*
+    Runs the program (or trace) once and reports hits, misses and SW counts for every
+    cache configuration in the sweep.
+
+    @param sweep_config L1SPEC or L1SPEC/L2SPEC, each SIZES:ASSOCS:BLOCKSIZES
+
+    @param policies Replacement policy of each level, see policy_for_level.
+        Geometries a level's policy can't run on are skipped
+
+    @param seed Seed of the L1 policy, L2 uses seed + 1
+
+    @param source Called once with the sweep hook; runs the program or
+        replays a trace through it
+
+    @return false if sweep_config is malformed or describes no valid cache
+*/
+template <class Source>
+bool run_sweep(const string &sweep_config, const vector<replacement_policy> &policies, uint32_t seed,
+               unsigned num_threads, bool json, Source source)
+{
+    size_t slash = sweep_config.find('/');
+    vector<cache_geometry> l1_geometries, l2_geometries;
+    if (!parse_sweep_spec(sweep_config.substr(0, slash), l1_geometries))
+        return false;
+    bool two_levels = slash != string::npos;
+    if (two_levels && !parse_sweep_spec(sweep_config.substr(slash + 1), l2_geometries))
+        return false;
+    if (!two_levels)
+        l2_geometries.push_back({0, 0, 0});
+    for (cache_geometry &g1 : l1_geometries)
+    {
+        g1.policy = policy_for_level(policies, 0);
+        g1.seed = seed;
+    }
+    for (cache_geometry &g2 : l2_geometries)
+    {
+        g2.policy = policy_for_level(policies, 1);
+        g2.seed = seed + 1;
+    }
+
+    vector<sweep_point> points;
+    for (const cache_geometry &g1 : l1_geometries)
+        for (const cache_geometry &g2 : l2_geometries)
+        {
+            if (!g1.policy_fits() || (two_levels && !g2.policy_fits()))
+                continue;
+            points.push_back({cache_model(g1), {}});
+            if (two_levels)
+                points.back().l2.push_back(cache_model(g2));
+        }
+    if (points.empty())
+        return false;
+
+    if (num_threads == 0)
+        num_threads = 1;
+    if (num_threads > points.size())
+        num_threads = points.size();
+    sweep_runner runner(points, num_threads);
+    source(runner);
+    runner.finish();
+
+    print_sweep_results(points, two_levels, json);
+    return true;
+}
+
+/*
+    LRU stack of one cache set. Each block's most recent access time is a
+    mark in a Fenwick tree, so the stack distance of a reuse (the number of
+    other blocks touched in the set since) is a prefix-sum query instead of
+    a walk down the stack. Times are renumbered when the tree fills up.
+*/
+struct lru_stack
+{
+    vector<int> tree;      // Fenwick tree over access times, 1-based
+    vector<int> last_time; // per tag, -1 until first touched
+    int now = 0;
+
+    explicit lru_stack(int num_tags)
+        : tree(2 * num_tags + 1, 0), last_time(num_tags, -1)
+    {
+    }
+
+    void add(int time, int delta)
+    {
+        for (int i = time + 1; i < (int)tree.size(); i += i & -i)
+            tree[i] += delta;
+    }
+
+    // Number of marks at times below time
+    int count_before(int time) const
+    {
+        int sum = 0;
+        for (int i = time; i > 0; i -= i & -i)
+            sum += tree[i];
+        return sum;
+    }
+
+    // Renumbers the live marks 0..k-1 in their current order
+    void compact()
+    {
+        vector<pair<int, int>> live; // (time, tag)
+        for (int tag = 0; tag < (int)last_time.size(); ++tag)
+            if (last_time[tag] >= 0)
+                live.push_back({last_time[tag], tag});
+        sort(live.begin(), live.end());
+        fill(tree.begin(), tree.end(), 0);
+        now = 0;
+        for (const pair<int, int> &mark : live)
+        {
+            last_time[mark.second] = now;
+            add(now++, 1);
+        }
+    }
+
+    /*
+        Touches a block.
+
+        @param tag The block's index within this set
+
+        @return The stack distance, or -1 on the first touch
+    */
+    int access(int tag)
+    {
+        if (now + 1 >= (int)tree.size())
+            compact();
+        int distance = -1;
+        int previous = last_time[tag];
+        if (previous >= 0)
+        {
+            distance = count_before(now) - count_before(previous + 1);
+            add(previous, -1);
+        }
+        last_time[tag] = now;
+        add(now++, 1);
+        return distance;
+    }
+};
+
+/*
+    Stack-distance histograms for every blocksize and number of sets, built
+    in one pass over the LW/SW stream. Every access updates the LRU stacks;
+    loads are counted in the histograms. An LRU cache with the same
+    blocksize and sets and associativity A hits exactly the loads with
+    distance below A, as long as stores allocate like loads: that is
+    simcache's --policy lru with --write wbwa or wtwa. The default install
+    store fills a fresh way even on a hit, which no stack models.
+*/
+struct stack_distance_analysis
+{
+    struct set_config
+    {
+        int blocksize, sets;
+        vector<lru_stack> stacks;
+        vector<long long> histogram; // index blocks per set holds first touches
+    };
+    vector<set_config> configs;
+    long long loads = 0, stores = 0;
+
+    explicit stack_distance_analysis(const vector<int> &blocksizes)
+    {
+        for (int blocksize : blocksizes)
+        {
+            int num_blocks = 8192 / blocksize;
+            for (int sets = 1; sets <= num_blocks; sets *= 2)
+            {
+                int per_set = num_blocks / sets;
+                configs.push_back({blocksize, sets, vector<lru_stack>(sets, lru_stack(per_set)),
+                                   vector<long long>(per_set + 1, 0)});
+            }
+        }
+    }
+
+    void access(uint16_t addr, bool is_load)
+    {
+        for (set_config &c : configs)
+        {
+            int block_id = addr / c.blocksize;
+            int distance = c.stacks[block_id % c.sets].access(block_id / c.sets);
+            if (is_load)
+                c.histogram[distance < 0 ? c.histogram.size() - 1 : distance]++;
+        }
+        if (is_load)
+            loads++;
+        else
+            stores++;
+    }
+
+    static const bool skips_loops = true;
+
+    void step(uint16_t) {}
+
+    void lw(uint16_t, uint16_t addr)
+    {
+        access(addr, true);
+    }
+
+    void sw(uint16_t, uint16_t addr)
+    {
+        access(addr, false);
+    }
+
+    void jump(uint16_t, uint16_t) {}
+    void skip(uint16_t, uint64_t) {}
+
+    /*
+        Prints the load hit ratio of every LRU cache the histograms
+        describe: each blocksize, number of sets and power-of-two
+        associativity up to the whole of memory.
+    */
+    void print(bool json) const
+    {
+        if (json)
+            cout << "[" << endl;
+        else
+            cout << "blocksize,rows,assoc,size,loads,hits,hit_ratio" << endl;
+
+        bool first = true;
+        for (const set_config &c : configs)
+        {
+            long long hits = 0;
+            int per_set = c.histogram.size() - 1;
+            int counted = 0;
+            for (int assoc = 1; assoc <= per_set; assoc *= 2)
+            {
+                for (; counted < assoc; ++counted)
+                    hits += c.histogram[counted];
+                double ratio = loads ? double(hits) / loads : 0.0;
+                int size = c.blocksize * c.sets * assoc;
+                if (json)
+                    cout << (first ? "" : ",\n") << "  {\"blocksize\": " << c.blocksize << ", \"rows\": " << c.sets
+                         << ", \"assoc\": " << assoc << ", \"size\": " << size << ", \"loads\": " << loads
+                         << ", \"hits\": " << hits << ", \"hit_ratio\": " << fixed << setprecision(6) << ratio << "}";
+                else
+                    cout << c.blocksize << "," << c.sets << "," << assoc << "," << size << "," << loads << ","
+                         << hits << "," << fixed << setprecision(6) << ratio << endl;
+                first = false;
+            }
+        }
+
+        if (json)
+            cout << endl
+                 << "]" << endl;
+    }
+};
+
+/*
+    Parses a cache config of 3xN comma separated values: size,
+    associativity and blocksize of each level, starting with L1.
+
+    @return false if the config is malformed or a level has no rows
+*/
+bool parse_cache_config(const string &config, vector<cache_geometry> &levels)
+{
+    vector<int> parts;
+    size_t lastpos = 0;
+    while (lastpos <= config.size())
+    {
+        size_t pos = config.find(',', lastpos);
+        if (pos == string::npos)
+            pos = config.size();
+        try
+        {
+            parts.push_back(stoi(config.substr(lastpos, pos - lastpos)));
+        }
+        catch (const exception &)
+        {
+            return false;
+        }
+        lastpos = pos + 1;
+    }
+    if (parts.size() % 3 != 0)
+        return false;
+    for (size_t i = 0; i < parts.size(); i += 3)
+    {
+        cache_geometry level = {parts[i], parts[i + 1], parts[i + 2]};
+        if (level.size <= 0 || level.assoc <= 0 || level.blocksize <= 0 || level.size / (level.assoc * level.blocksize) == 0)
+            return false;
+        levels.push_back(level);
+    }
+    return true;
+}
+
+// What a cache level did for one access
+enum cache_event
+{
+    CACHE_HIT,
+    CACHE_MISS,
+    CACHE_SW
+};
+
+// Swallows the events of accesses nothing should count
+struct discard_events
+{
+    void event(int, cache_event, uint16_t, uint16_t, int) {}
+};
+
+/*
+    A stack of cache levels, L1 first. A load checks one level after the
+    other until one hits, a store is written to every level. Each level
+    reports what it did to sink.event(depth, event, pc, addr, row), where
+    depth 0 is L1. lw returns whether any level hit, and lw_from starts a
+    load further down, for instruction fetches that share the lower
+    levels.
+
+    Levels with other write policies stop a store where it is absorbed,
+    and may read the rest of its block from below first. Dirty blocks a
+    level evicts are written to the next level down once the access that
+    evicted them is done there. Neither the reads nor the write backs
+    reach the sink; the levels count them as traffic.
+
+    The levels are a parameter pack, so fixed hierarchies such as one or
+    two cache_models unroll into straight-line code with no loop over
+    levels. cache_hierarchy<vector<Level>> takes any number of levels
+    chosen at run time.
+*/
+template <class... Levels>
+struct cache_hierarchy;
+
+template <>
+struct cache_hierarchy<>
+{
+    explicit cache_hierarchy(const vector<cache_geometry> &, size_t = 0) {}
+
+    template <class Sink>
+    bool lw(uint16_t, uint16_t, Sink &, int = 0)
+    {
+        return false;
+    }
+
+    template <class Sink>
+    bool lw_from(int, uint16_t, uint16_t, Sink &, int = 0)
+    {
+        return false;
+    }
+
+    template <class Sink>
+    void sw(uint16_t, uint16_t, Sink &, int = 0, int = 1) {}
+
+    template <class Visitor>
+    void visit(Visitor &&, int = 0) const {}
+
+    template <class Archive>
+    void state(Archive &) {}
+};
+
+template <class Level, class... Rest>
+struct cache_hierarchy<Level, Rest...>
+{
+    Level level;
+    cache_hierarchy<Rest...> lower;
+
+    /*
+        @param geometries One geometry per level of the whole hierarchy
+        @param depth Index into geometries of this level
+    */
+    explicit cache_hierarchy(const vector<cache_geometry> &geometries, size_t depth = 0)
+        : level(geometries[depth]),
+          lower(geometries, depth + 1)
+    {
+    }
+
+    template <class Sink>
+    bool lw(uint16_t pc, uint16_t addr, Sink &sink, int depth = 0)
+    {
+        int row;
+        bool hit = level.lw(addr, row);
+        sink.event(depth, hit ? CACHE_HIT : CACHE_MISS, pc, addr, row);
+        if (hit)
+            return true;
+        hit = lower.lw(pc, addr, sink, depth + 1);
+        write_back(pc, depth);
+        return hit;
+    }
+
+    // Loads through the levels from depth start down
+    template <class Sink>
+    bool lw_from(int start, uint16_t pc, uint16_t addr, Sink &sink, int depth = 0)
+    {
+        if (depth < start)
+            return lower.lw_from(start, pc, addr, sink, depth + 1);
+        return lw(pc, addr, sink, depth);
+    }
+
+    // Writes words words from addr, a store unless they come from a write back
+    template <class Sink>
+    void sw(uint16_t pc, uint16_t addr, Sink &sink, int depth = 0, int words = 1)
+    {
+        int row;
+        int below = level.sw(addr, row, words);
+        sink.event(depth, CACHE_SW, pc, addr, row);
+        discard_events discard;
+        if (below & STORE_FETCH)
+            lower.lw(pc, addr, discard, depth + 1);
+        write_back(pc, depth);
+        if (below & STORE_PASS)
+            lower.sw(pc, addr, sink, depth + 1, words);
+    }
+
+    // Writes the dirty block the last access evicted, if any, to the levels below
+    void write_back(uint16_t pc, int depth)
+    {
+        if (level.victim < 0)
+            return;
+        int victim = level.victim;
+        level.victim = -1;
+        discard_events discard;
+        lower.sw(pc, victim, discard, depth + 1, level.blocksize);
+    }
+
+    Level &first_level()
+    {
+        return level;
+    }
+
+    // Calls visitor(depth, level) for every level, L1 first
+    template <class Visitor>
+    void visit(Visitor &&visitor, int depth = 0) const
+    {
+        visitor(depth, level);
+        lower.visit(visitor, depth + 1);
+    }
+
+    // Saves or restores every level, L1 first
+    template <class Archive>
+    void state(Archive &archive)
+    {
+        level.state(archive);
+        lower.state(archive);
+    }
+};
+
+template <class Level>
+struct cache_hierarchy<vector<Level>>
+{
+    vector<Level> levels;
+
+    explicit cache_hierarchy(const vector<cache_geometry> &geometries, size_t depth = 0)
+    {
+        for (; depth < geometries.size(); ++depth)
+            levels.emplace_back(geometries[depth]);
+    }
+
+    template <class Sink>
+    bool lw(uint16_t pc, uint16_t addr, Sink &sink, int depth = 0)
+    {
+        return lw_from(depth, pc, addr, sink, depth);
+    }
+
+    template <class Sink>
+    bool lw_from(int start, uint16_t pc, uint16_t addr, Sink &sink, int depth = 0)
+    {
+        size_t first = start - depth, i = first;
+        bool hit = false;
+        for (; i < levels.size() && !hit; ++i)
+        {
+            int row;
+            hit = levels[i].lw(addr, row);
+            sink.event(depth + i, hit ? CACHE_HIT : CACHE_MISS, pc, addr, row);
+        }
+        // Deepest first, as the fixed hierarchy unwinds
+        while (i-- > first)
+            write_back(i, pc, depth);
+        return hit;
+    }
+
+    template <class Sink>
+    void sw(uint16_t pc, uint16_t addr, Sink &sink, int depth = 0, int words = 1)
+    {
+        sw_from(0, pc, addr, sink, depth, words);
+    }
+
+    // Writes from levels[first] down; depth is that of levels[0]
+    template <class Sink>
+    void sw_from(size_t first, uint16_t pc, uint16_t addr, Sink &sink, int depth, int words)
+    {
+        for (size_t i = first; i < levels.size(); ++i)
+        {
+            int row;
+            int below = levels[i].sw(addr, row, words);
+            sink.event(depth + i, CACHE_SW, pc, addr, row);
+            discard_events discard;
+            if (below & STORE_FETCH)
+                lw_from(depth + i + 1, pc, addr, discard, depth);
+            write_back(i, pc, depth);
+            if (!(below & STORE_PASS))
+                return;
+        }
+    }
+
+    void write_back(size_t i, uint16_t pc, int depth)
+    {
+        Level &level = levels[i];
+        if (level.victim < 0)
+            return;
+        int victim = level.victim;
+        level.victim = -1;
+        discard_events discard;
+        sw_from(i + 1, pc, victim, discard, depth, level.blocksize);
+    }
+
+    Level &first_level()
+    {
+        return levels[0];
+    }
+
+    template <class Visitor>
+    void visit(Visitor &&visitor, int depth = 0) const
+    {
+        for (const Level &level : levels)
+            visitor(depth++, level);
+    }
+
+    template <class Archive>
+    void state(Archive &archive)
+    {
+        for (Level &level : levels)
+            level.state(archive);
+    }
+};
+
+// How cache events are written out
+enum log_format
+{
+    LOG_TEXT,   // the original log lines
+    LOG_BINARY, // a log_header, then one log_record per event
+    LOG_CSV,
+    LOG_COUNTS, // only a count of each event per level, printed at exit
+    NUM_LOG_FORMATS
+};
+
+const char *const LOG_FORMAT_NAMES[NUM_LOG_FORMATS] = {"text", "binary", "csv", "counts"};
+const char *const EVENT_NAMES[] = {"HIT", "MISS", "SW"};
+
+/*
+    Looks up a log format by its command-line name.
+
+    @return false if there is no such format
+*/
+bool parse_log_format(const string &name, log_format &format)
+{
+    for (int i = 0; i < NUM_LOG_FORMATS; ++i)
+        if (name == LOG_FORMAT_NAMES[i])
+        {
+            format = log_format(i);
+            return true;
+        }
+    return false;
+}
+
+// One cache event as the simulation hands it to the log writer
+struct log_record
+{
+    uint8_t depth; // 0 for L1
+    uint8_t event; // a cache_event
+    uint16_t pc;
+    uint16_t addr;
+    uint16_t row;
+};
+
+const char LOG_MAGIC[8] = {'E', '2', '0', 'L', 'O', 'G', 0, 0};
+const uint32_t LOG_VERSION = 1;
+
+// Binary logs start with this header; records follow in host byte order
+struct log_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+/*
+    Single-producer, single-consumer ring of log records. The simulation
+    pushes and the writer thread pops, without locks: each side owns one
+    index and publishes it with a release store. The producer only waits
+    when the writer is a whole ring behind.
+*/
+struct log_ring
+{
+    static const size_t CAPACITY = 1 << 16; // a power of two
+
+    vector<log_record> records = vector<log_record>(CAPACITY);
+    alignas(64) atomic<size_t> head{0}; // next slot to fill
+    alignas(64) atomic<size_t> tail{0}; // next slot to drain
+    atomic<bool> closed{false};
+    size_t free_until = CAPACITY; // producer's last known bound on head
+
+    void push(const log_record &record)
+    {
+        size_t h = head.load(memory_order_relaxed);
+        while (h == free_until)
+        {
+            free_until = tail.load(memory_order_acquire) + CAPACITY;
+            if (h == free_until)
+                this_thread::yield();
+        }
+        records[h & (CAPACITY - 1)] = record;
+        head.store(h + 1, memory_order_release);
+    }
+};
+
+/*
+    Writes n right-aligned in a field of width characters, like setw.
+
+    @return The end of what was written
+*/
+inline char *put_right(char *out, unsigned n, int width)
+{
+    char digits[10];
+    int count = 0;
+    do
+    {
+        digits[count++] = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    for (int i = count; i < width; ++i)
+        *out++ = ' ';
+    while (count > 0)
+        *out++ = digits[--count];
+    return out;
+}
+
+/*
+    Formats record as the original log line, which was printed with
+    left << setw(8) << name + " " + status << right << " pc:" << setw(5) << pc
+    << "\taddr:" << setw(5) << addr << "\trow:" << setw(4) << row.
+
+    @return The end of what was written
+*/
+inline char *format_text(char *out, const log_record &record)
+{
+    char *start = out;
+    *out++ = 'L';
+    out = put_right(out, record.depth + 1, 0);
+    *out++ = ' ';
+    for (const char *c = EVENT_NAMES[record.event]; *c; ++c)
+        *out++ = *c;
+    while (out - start < 8)
+        *out++ = ' ';
+    memcpy(out, " pc:", 4);
+    out = put_right(out + 4, record.pc, 5);
+    memcpy(out, "\taddr:", 6);
+    out = put_right(out + 6, record.addr, 5);
+    memcpy(out, "\trow:", 5);
+    out = put_right(out + 5, record.row, 4);
+    *out++ = '\n';
+    return out;
+}
+
+// Formats record as a line of level,event,pc,addr,row
+inline char *format_csv(char *out, const log_record &record)
+{
+    *out++ = 'L';
+    out = put_right(out, record.depth + 1, 0);
+    *out++ = ',';
+    for (const char *c = EVENT_NAMES[record.event]; *c; ++c)
+        *out++ = *c;
+    *out++ = ',';
+    out = put_right(out, record.pc, 0);
+    *out++ = ',';
+    out = put_right(out, record.addr, 0);
+    *out++ = ',';
+    out = put_right(out, record.row, 0);
+    *out++ = '\n';
+    return out;
+}
+
+/*
+    Cache event sink for the hierarchy. Counts events itself in
+    LOG_COUNTS mode; otherwise queues them for a writer thread that
+    formats them into large buffers for stdout, so the simulation never
+    waits on formatting or I/O. finish() must be called before anything
+    else is printed to stdout.
+*/
+struct cache_log
+{
+    log_format format;
+    vector<array<uint64_t, 3>> counts; // per level, indexed by cache_event
+    log_ring ring;
+    thread writer;
+
+    explicit cache_log(log_format format, size_t depth) : format(format), counts(depth)
+    {
+        if (format != LOG_COUNTS)
+            writer = thread(&cache_log::write_records, this);
+    }
+
+    ~cache_log()
+    {
+        finish();
+    }
+
+    void event(int depth, cache_event event, uint16_t pc, uint16_t addr, int row)
+    {
+        if (format == LOG_COUNTS)
+            counts[depth][event]++;
+        else
+            ring.push({uint8_t(depth), uint8_t(event), pc, addr, uint16_t(row)});
+    }
+
+    // Drains the writer, or prints the counts, and flushes stdout
+    void finish()
+    {
+        if (writer.joinable())
+        {
+            ring.closed.store(true, memory_order_release);
+            writer.join();
+        }
+        else if (format == LOG_COUNTS)
+        {
+            for (size_t i = 0; i < counts.size(); ++i)
+                cout << "Cache L" << i + 1 << " hits " << counts[i][CACHE_HIT] << ", misses "
+                     << counts[i][CACHE_MISS] << ", sw " << counts[i][CACHE_SW] << endl;
+            counts.clear();
+        }
+        fflush(stdout);
+    }
+
+    // Empty polls the writer yields for before it starts sleeping between polls
+    static const unsigned WRITER_SPINS = 64;
+    static constexpr unsigned WRITER_NAP_US = 100;
+
+    // Body of the writer thread
+    void write_records()
+    {
+        static const size_t BUFFER_SIZE = 1 << 16;
+        static const size_t LONGEST_LINE = 64;
+        vector<char> buffer(BUFFER_SIZE);
+        char *out = buffer.data();
+        if (format == LOG_BINARY)
+        {
+            log_header header = {};
+            memcpy(header.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+            header.version = LOG_VERSION;
+            header.record_size = sizeof(log_record);
+            fwrite(&header, sizeof(header), 1, stdout);
+        }
+        else if (format == LOG_CSV)
+            fputs("level,event,pc,addr,row\n", stdout);
+
+        size_t t = ring.tail.load(memory_order_relaxed);
+        unsigned idle = 0; // polls in a row that found the ring empty
+        for (;;)
+        {
+            // Read closed before head, so no record pushed before closing is missed
+            bool closed = ring.closed.load(memory_order_acquire);
+            size_t h = ring.head.load(memory_order_acquire);
+            if (h == t)
+            {
+                if (closed)
+                    break;
+                // The simulator fills the ring far slower than this drains it,
+                // so sleep rather than spin a core. A full ring takes longer
+                // than WRITER_NAP_US to produce, so the producer doesn't stall
+                if (++idle < WRITER_SPINS)
+                    this_thread::yield();
+                else
+                    this_thread::sleep_for(chrono::microseconds(WRITER_NAP_US));
+                continue;
+            }
+            idle = 0;
+            for (; t != h; ++t)
+            {
+                const log_record &record = ring.records[t & (log_ring::CAPACITY - 1)];
+                if (format == LOG_BINARY)
+                {
+                    memcpy(out, &record, sizeof(record));
+                    out += sizeof(record);
+                }
+                else if (format == LOG_CSV)
+                    out = format_csv(out, record);
+                else
+                    out = format_text(out, record);
+                if (out > buffer.data() + BUFFER_SIZE - LONGEST_LINE)
+                {
+                    fwrite(buffer.data(), 1, out - buffer.data(), stdout);
+                    out = buffer.data();
+                }
+            }
+            ring.tail.store(t, memory_order_release);
+        }
+        fwrite(buffer.data(), 1, out - buffer.data(), stdout);
+    }
+};
+
+// Words per address range in the miss report
+const int STATS_RANGE = 64;
+
+/*
+    Counters one cache level keeps on every run: event totals, loads and
+    misses per pc, and misses per STATS_RANGE-word address range. They
+    are flat arrays indexed by pc and range, so an event costs a couple
+    of increments.
+*/
+struct level_stats
+{
+    uint64_t events[3] = {}; // indexed by cache_event
+    vector<uint64_t> pc_loads = vector<uint64_t>(REG_SIZE);
+    vector<uint64_t> pc_misses = vector<uint64_t>(REG_SIZE);
+    vector<uint64_t> range_misses = vector<uint64_t>(MEM_SIZE / STATS_RANGE);
+};
+
+struct cache_stats
+{
+    vector<level_stats> levels;
+
+    explicit cache_stats(size_t depth) : levels(depth) {}
+
+    void event(int depth, cache_event event, uint16_t pc, uint16_t addr)
+    {
+        level_stats &level = levels[depth];
+        level.events[event]++;
+        if (event == CACHE_SW)
+            return;
+        level.pc_loads[pc]++;
+        if (event == CACHE_MISS)
+        {
+            level.pc_misses[pc]++;
+            level.range_misses[addr / STATS_RANGE]++;
+        }
+    }
+};
+
+/*
+    Indices of the top_n largest nonzero counts, largest first, ties
+    going to the lower index.
+*/
+vector<size_t> top_counts(const vector<uint64_t> &counts, size_t top_n)
+{
+    vector<size_t> indices;
+    for (size_t i = 0; i < counts.size(); ++i)
+        if (counts[i] != 0)
+            indices.push_back(i);
+    auto larger = [&](size_t a, size_t b)
+    { return counts[a] != counts[b] ? counts[a] > counts[b] : a < b; };
+    top_n = min(top_n, indices.size());
+    partial_sort(indices.begin(), indices.begin() + top_n, indices.end(), larger);
+    indices.resize(top_n);
+    return indices;
+}
+
+/*
+    Prints a summary of every level: event totals, how full the sets
+    ended up, how many valid lines they replaced, the bytes read from
+    and written to the level below or memory, then the top_n
+    instructions, address ranges and rows with the most misses or
+    replacements. With fetches set the levels are instruction caches,
+    named L1I and so on, whose loads are fetches.
+*/
+template <class Hierarchy>
+void print_cache_report(ostream &out, const cache_stats &stats, const Hierarchy &caches, size_t top_n,
+                        bool fetches = false)
+{
+    const char *loads_name = fetches ? "fetches" : "loads";
+    size_t num_levels = 0;
+    caches.visit([&](int, const cache_model &) { num_levels++; });
+    out << fixed << setprecision(2);
+    caches.visit([&](int depth, const cache_model &model)
+                 {
+        const level_stats &level = stats.levels[depth];
+        uint64_t hits = level.events[CACHE_HIT], misses = level.events[CACHE_MISS];
+        uint64_t loads = hits + misses;
+        out << "Cache L" << depth + 1 << (fetches ? "I" : "") << ": " << loads << " " << loads_name << ", " << hits
+            << " hits, " << misses << " misses (" << (loads ? 100.0 * misses / loads : 0.0) << "% miss rate)";
+        if (!fetches)
+            out << ", " << level.events[CACHE_SW] << " sw";
+        out << endl;
+
+        int least = model.assoc, most = 0;
+        uint64_t filled = 0, full_rows = 0, replaced = 0;
+        for (int row = 0; row < model.rows; ++row)
+        {
+            int occupancy = model.occupancy(row);
+            least = min(least, occupancy);
+            most = max(most, occupancy);
+            filled += occupancy;
+            full_rows += occupancy == model.assoc;
+            replaced += model.evictions[row];
+        }
+        out << "  occupancy: min " << least << ", mean " << double(filled) / model.rows << ", max " << most
+            << " of " << model.assoc << " ways; " << full_rows << " of " << model.rows << " rows full" << endl;
+        out << "  replaced valid lines: " << replaced << endl;
+
+        // Instruction levels are followed by the shared levels, if any
+        string below = "memory";
+        if (size_t(depth) + 1 < num_levels)
+            below = "L" + to_string(depth + 2) + (fetches ? "I" : "");
+        else if (size_t(depth) + 1 < stats.levels.size())
+            below = "L" + to_string(depth + 2);
+        out << "  traffic with " << below << ": " << model.fills * model.blocksize * 2 << " bytes read in "
+            << model.fills << " fills, " << model.words_written * 2 << " bytes written, " << model.writebacks
+            << " writebacks" << endl;
+
+        vector<size_t> top = top_counts(level.pc_misses, top_n);
+        if (!top.empty())
+        {
+            out << "  top missing instructions:" << endl;
+            out << "       pc      misses " << setw(11) << loads_name << "   miss%" << endl;
+            for (size_t pc : top)
+                out << "    " << setw(5) << pc << setw(12) << level.pc_misses[pc] << setw(12) << level.pc_loads[pc]
+                    << setw(8) << 100.0 * level.pc_misses[pc] / level.pc_loads[pc] << endl;
+        }
+        top = top_counts(level.range_misses, top_n);
+        if (!top.empty())
+        {
+            out << "  top missing address ranges:" << endl;
+            out << "          addr      misses" << endl;
+            for (size_t range : top)
+                out << "    " << setw(4) << range * STATS_RANGE << "-" << left << setw(5) << (range + 1) * STATS_RANGE - 1
+                    << right << setw(12) << level.range_misses[range] << endl;
+        }
+        top = top_counts(model.evictions, top_n);
+        if (!top.empty())
+        {
+            out << "  top conflicting rows:" << endl;
+            out << "      row    replaced" << endl;
+            for (size_t row : top)
+                out << "    " << setw(5) << row << setw(12) << model.evictions[row] << endl;
+        } });
+}
+
+/*
+    Parses the --latency list: the hit latency in cycles of each of
+    num_levels levels, starting with L1, then the memory latency. An empty
+    list gives the defaults of 1 cycle for L1, 10 more for each level
+    below it and 100 for memory.
+
+    @return false unless there are num_levels + 1 positive values
+*/
+bool parse_latencies(const string &list, size_t num_levels, vector<uint64_t> &latencies)
+{
+    latencies.clear();
+    if (list.empty())
+    {
+        for (size_t i = 0; i < num_levels; ++i)
+            latencies.push_back(1 + 10 * i);
+        latencies.push_back(100);
+        return true;
+    }
+    size_t lastpos = 0;
+    while (lastpos <= list.size())
+    {
+        size_t pos = list.find(',', lastpos);
+        if (pos == string::npos)
+            pos = list.size();
+        try
+        {
+            int latency = stoi(list.substr(lastpos, pos - lastpos));
+            if (latency <= 0)
+                return false;
+            latencies.push_back(latency);
+        }
+        catch (const exception &)
+        {
+            return false;
+        }
+        lastpos = pos + 1;
+    }
+    return latencies.size() == num_levels + 1;
+}
+
+/*
+    Cycle estimate of a run. Every instruction takes one cycle, except a
+    LW, which takes as long as its access: the hit latency of each level
+    it looks in, plus the memory latency if it misses in all of them. A SW
+    takes the L1 hit latency, since stores drain through a write buffer
+    and the lower levels are written without stalling. With instruction
+    caches, a fetch stalls for however much longer than an L1 hit it
+    takes, an instruction level having the latency of the data level at
+    its depth, or of the last one.
+*/
+struct cache_timing
+{
+    vector<uint64_t> latencies; // of each level, then of memory
+    uint64_t instructions = 0;
+    uint64_t loads = 0, stores = 0;
+    uint64_t level_cycles = 0; // spent by loads looking in the caches
+    uint64_t cache_hits = 0;   // loads that never went to memory
+    uint64_t fetches = 0, fetch_level_cycles = 0, fetch_hits = 0;
+
+    explicit cache_timing(const vector<uint64_t> &latencies) : latencies(latencies) {}
+
+    void event(int depth, cache_event event)
+    {
+        if (event == CACHE_SW)
+            return;
+        level_cycles += latencies[depth];
+        cache_hits += event == CACHE_HIT;
+    }
+
+    void fetch_event(int depth)
+    {
+        fetch_level_cycles += latencies[min(size_t(depth), latencies.size() - 2)];
+    }
+
+    uint64_t load_cycles() const
+    {
+        return level_cycles + (loads - cache_hits) * latencies.back();
+    }
+
+    uint64_t fetch_cycles() const
+    {
+        return fetch_level_cycles + (fetches - fetch_hits) * latencies.back();
+    }
+
+    uint64_t cycles() const
+    {
+        return instructions - loads - stores + load_cycles() + stores * latencies[0] + fetch_cycles() -
+               fetches * latencies[0];
+    }
+};
+
+/*
+    Prints the latencies, then the cycles, CPI and average memory access
+    time of loads. A replayed trace has no instruction count, so only the
+    memory access time is known.
+*/
+void print_timing_report(ostream &out, const cache_timing &timing)
+{
+    out << "Latency:";
+    for (size_t i = 0; i + 1 < timing.latencies.size(); ++i)
+        out << " L" << i + 1 << " " << timing.latencies[i] << ",";
+    out << " memory " << timing.latencies.back() << " cycles" << endl;
+    out << fixed << setprecision(2);
+    if (timing.instructions > 0)
+        out << "Cycles: " << timing.cycles() << " for " << timing.instructions << " instructions, CPI "
+            << double(timing.cycles()) / timing.instructions << endl;
+    out << "AMAT: " << (timing.loads ? double(timing.load_cycles()) / timing.loads : 0.0) << " cycles over "
+        << timing.loads << " loads" << endl;
+    if (timing.fetches > 0)
+        out << "Fetch: " << double(timing.fetch_cycles()) / timing.fetches << " cycles over " << timing.fetches
+            << " fetches, " << timing.fetch_cycles() - timing.fetches * timing.latencies[0] << " stall cycles"
+            << endl;
+    out.unsetf(ios::floatfield);
+}
+
+// The fetch side of logged_caches when instruction fetches aren't modelled
+struct no_fetch
+{
+    no_fetch(const vector<cache_geometry> &, size_t, bool) {}
+
+    template <class Caches>
+    void fetch(uint16_t, Caches &, cache_timing &) {}
+
+    template <class Caches>
+    void warm(uint16_t, Caches &) {}
+
+    template <class Archive>
+    void state(Archive &) {}
+};
+
+// Counts and times the events of instruction fetches
+struct fetch_events
+{
+    cache_stats &stats;
+    cache_timing &timing;
+
+    void event(int depth, cache_event event, uint16_t pc, uint16_t addr, int)
+    {
+        stats.event(depth, event, pc, addr);
+        timing.fetch_event(depth);
+    }
+};
+
+/*
+    Instruction caches that every instruction is fetched through before
+    it runs. Their misses go to memory, or with unified set, on into the
+    data caches below as many levels as there are instruction caches, so
+    an L1I in front of a two-level --cache shares its L2. Fetches are
+    counted in stats of their own and never logged.
+*/
+struct fetch_caches
+{
+    cache_hierarchy<vector<cache_model>> icaches;
+    bool unified;
+    cache_stats stats; // of each instruction level, then each shared level
+
+    fetch_caches(const vector<cache_geometry> &ilevels, size_t data_levels, bool unified)
+        : icaches(ilevels), unified(unified), stats(unified ? max(ilevels.size(), data_levels) : ilevels.size())
+    {
+    }
+
+    template <class Caches>
+    void fetch(uint16_t pc, Caches &caches, cache_timing &timing)
+    {
+        fetch_events sink{stats, timing};
+        timing.fetches++;
+        timing.fetch_hits += access(pc, caches, sink);
+    }
+
+    // Fetches without counting anything, to warm the caches
+    template <class Caches>
+    void warm(uint16_t pc, Caches &caches)
+    {
+        discard_events discard;
+        access(pc, caches, discard);
+    }
+
+    template <class Caches, class Sink>
+    bool access(uint16_t pc, Caches &caches, Sink &sink)
+    {
+        uint16_t addr = pc % MEM_SIZE;
+        return icaches.lw(pc, addr, sink) || (unified && caches.lw_from(icaches.levels.size(), pc, addr, sink));
+    }
+
+    template <class Archive>
+    void state(Archive &archive)
+    {
+        icaches.state(archive);
+    }
+};
+
+// Nothing to report without instruction caches
+void print_fetch_report(ostream &, const no_fetch &, size_t) {}
+
+/*
+    Prints the cache report of the instruction levels, then the fetches
+    that went on to each shared level.
+*/
+void print_fetch_report(ostream &out, const fetch_caches &fetch, size_t top_n)
+{
+    print_cache_report(out, fetch.stats, fetch.icaches, top_n, true);
+    out << fixed << setprecision(2);
+    for (size_t d = fetch.icaches.levels.size(); d < fetch.stats.levels.size(); ++d)
+    {
+        const uint64_t *events = fetch.stats.levels[d].events;
+        uint64_t fetches = events[CACHE_HIT] + events[CACHE_MISS];
+        out << "Cache L" << d + 1 << " (shared): " << fetches << " fetches, " << events[CACHE_HIT] << " hits, "
+            << events[CACHE_MISS] << " misses (" << (fetches ? 100.0 * events[CACHE_MISS] / fetches : 0.0)
+            << "% miss rate)" << endl;
+    }
+    out.unsetf(ios::floatfield);
+}
+
+// Prefetchers that can sit in front of L1
+enum prefetch_kind
+{
+    PREFETCH_NONE,
+    PREFETCH_NEXT_LINE,
+    PREFETCH_STRIDE,
+    PREFETCH_STREAM,
+    NUM_PREFETCH_KINDS
+};
+
+const char *const PREFETCH_NAMES[NUM_PREFETCH_KINDS] = {"none", "next", "stride", "stream"};
+
+/*
+    What to prefetch: degree blocks per trigger, starting distance blocks
+    (or strides, for the stride prefetcher) ahead of the access that
+    triggered them.
+*/
+struct prefetch_config
+{
+    prefetch_kind kind = PREFETCH_NONE;
+    int degree = 1, distance = 1;
+};
+
+/*
+    Parses the --prefetch argument KIND[,DEGREE[,DISTANCE]].
+
+    @return false if the kind is unknown or a number isn't positive
+*/
+bool parse_prefetch_config(const string &spec, prefetch_config &config)
+{
+    vector<string> parts;
+    size_t lastpos = 0;
+    while (lastpos <= spec.size())
+    {
+        size_t pos = spec.find(',', lastpos);
+        if (pos == string::npos)
+            pos = spec.size();
+        parts.push_back(spec.substr(lastpos, pos - lastpos));
+        lastpos = pos + 1;
+    }
+    if (parts.size() > 3 || !parse_policy(parts[0], PREFETCH_NAMES, config.kind))
+        return false;
+    int *values[2] = {&config.degree, &config.distance};
+    for (size_t i = 1; i < parts.size(); ++i)
+    {
+        try
+        {
+            size_t used;
+            *values[i - 1] = stoi(parts[i], &used);
+            if (used != parts[i].size() || *values[i - 1] <= 0)
+                return false;
+        }
+        catch (const exception &)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The prefetch side of logged_caches when nothing is prefetched
+struct no_prefetch
+{
+    no_prefetch(const prefetch_config &, const vector<cache_geometry> &) {}
+
+    template <class Caches, class Sink>
+    void lw(uint16_t pc, uint16_t addr, Caches &caches, Sink &sink, cache_timing &)
+    {
+        caches.lw(pc, addr, sink);
+    }
+
+    template <class Caches, class Sink>
+    void sw(uint16_t pc, uint16_t addr, Caches &caches, Sink &sink)
+    {
+        caches.sw(pc, addr, sink);
+    }
+};
+
+// Adds up how long a prefetch takes to come back from the levels it looks in
+struct prefetch_latency
+{
+    const vector<uint64_t> &latencies;
+    uint64_t cycles = 0;
+
+    void event(int depth, cache_event, uint16_t, uint16_t, int)
+    {
+        cycles += latencies[depth];
+    }
+};
+
+/*
+    A prefetcher trained on the loads that reach L1, which loads the
+    blocks it predicts through the whole hierarchy without counting or
+    logging them.
+
+    next prefetches the blocks after one that missed, stride keeps the
+    last address and stride of every load pc and prefetches along a
+    stride seen at least twice in a row, and stream follows up to
+    PREFETCH_STREAMS ascending or descending runs of misses. next and
+    stream also run on the first hit to a prefetched line, so a stream
+    the prefetches keep up with keeps going.
+
+    Each L1 way remembers the block a prefetch put there and when its
+    data arrives, counting the cycles of the levels the prefetch looked
+    in. A load that hits the line uses the prefetch, waiting out the
+    rest if it is late. A way whose prefetched block has gone by the
+    next time it is looked at was never used. L1 misses on blocks a
+    prefetch evicted are pollution.
+*/
+struct prefetcher
+{
+    // A way's prefetch, or block -1 if it holds none
+    struct prefetched_line
+    {
+        int block = -1;
+        uint64_t ready = 0; // cycle the data arrives
+    };
+
+    struct stride_entry
+    {
+        uint16_t last_addr = 0;
+        int16_t stride = 0;
+        int confidence = 0; // 0 to 3, prefetching from 2
+    };
+
+    struct stream
+    {
+        int head = -1;     // last block of the stream accessed
+        int direction = 0; // +1 or -1 once a second miss shows which way it runs
+        uint64_t last_use = 0;
+    };
+
+    static const int PREFETCH_STREAMS = 8;
+
+    prefetch_config config;
+    vector<prefetched_line> lines; // per L1 way, row by row
+    vector<uint8_t> evicted;       // per block, whether a prefetch threw it out of L1 and it hasn't been back
+    vector<stride_entry> strides;  // per load pc
+    vector<stream> streams;
+    vector<int> row_blocks; // scratch for the blocks of a row before a prefetch fills it
+    uint64_t stream_clock = 0;
+
+    uint64_t issued = 0, redundant = 0, useful = 0, late = 0, late_cycles = 0, unused = 0, pollution = 0;
+
+    prefetcher(const prefetch_config &config, const vector<cache_geometry> &levels)
+        : config(config), lines(levels[0].size / levels[0].blocksize),
+          evicted(MEM_SIZE / levels[0].blocksize + 1, 0)
+    {
+        if (config.kind == PREFETCH_STRIDE)
+            strides.resize(REG_SIZE);
+        if (config.kind == PREFETCH_STREAM)
+            streams.resize(PREFETCH_STREAMS);
+    }
+
+    prefetched_line &line(const cache_model &l1, int row, int way)
+    {
+        return lines[size_t(row) * l1.assoc + way];
+    }
+
+    // Forgets the prefetch in way of row unless it still holds block, counting it as never used
+    void drop_unless(const cache_model &l1, int row, int way, int block)
+    {
+        prefetched_line &pf = line(l1, row, way);
+        if (pf.block >= 0 && pf.block != block)
+        {
+            unused++;
+            pf.block = -1;
+        }
+    }
+
+    template <class Caches, class Sink>
+    void lw(uint16_t pc, uint16_t addr, Caches &caches, Sink &sink, cache_timing &timing)
+    {
+        cache_model &l1 = caches.first_level();
+        int row;
+        uint16_t tag = l1.locate(addr, row);
+        int way = l1.find(row, tag);
+        caches.lw(pc, addr, sink);
+        int block = addr / l1.blocksize * l1.blocksize;
+        bool hit_prefetch = false;
+        if (way >= 0)
+        {
+            drop_unless(l1, row, way, block);
+            prefetched_line &pf = line(l1, row, way);
+            if (pf.block >= 0)
+            {
+                hit_prefetch = true;
+                useful++;
+                int64_t wait = int64_t(pf.ready - timing.cycles());
+                if (wait > 0)
+                {
+                    late++;
+                    late_cycles += wait;
+                    timing.level_cycles += wait;
+                }
+                pf.block = -1;
+            }
+        }
+        else
+        {
+            drop_unless(l1, row, l1.find(row, tag), -1);
+            uint8_t &gone = evicted[addr / l1.blocksize];
+            pollution += gone;
+            gone = 0;
+        }
+        train(pc, addr, way < 0, hit_prefetch, caches, timing);
+    }
+
+    template <class Caches, class Sink>
+    void sw(uint16_t pc, uint16_t addr, Caches &caches, Sink &sink)
+    {
+        caches.sw(pc, addr, sink);
+        cache_model &l1 = caches.first_level();
+        int row;
+        int way = l1.find(row, l1.locate(addr, row));
+        if (way >= 0)
+            drop_unless(l1, row, way, addr / l1.blocksize * l1.blocksize);
+    }
+
+    template <class Caches>
+    void train(uint16_t pc, uint16_t addr, bool miss, bool hit_prefetch, Caches &caches, cache_timing &timing)
+    {
+        int blocksize = caches.first_level().blocksize;
+        int block = addr / blocksize;
+        switch (config.kind)
+        {
+        case PREFETCH_NEXT_LINE:
+            if (miss || hit_prefetch)
+                for (int k = 0; k < config.degree; ++k)
+                    prefetch(pc, long(block + config.distance + k) * blocksize, caches, timing);
+            break;
+        case PREFETCH_STRIDE:
+        {
+            stride_entry &entry = strides[pc];
+            int16_t delta = int16_t(addr - entry.last_addr);
+            if (delta == entry.stride && delta != 0)
+                entry.confidence = min(entry.confidence + 1, 3);
+            else if (entry.confidence > 0)
+                entry.confidence--;
+            else
+                entry.stride = delta;
+            entry.last_addr = addr;
+            if (entry.confidence >= 2)
+                for (int k = 0; k < config.degree; ++k)
+                    prefetch(pc, addr + long(entry.stride) * (config.distance + k), caches, timing);
+            break;
+        }
+        case PREFETCH_STREAM:
+            if (miss || hit_prefetch)
+                follow_stream(pc, block, caches, timing);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Moves the stream block belongs to along, or starts one there
+    template <class Caches>
+    void follow_stream(uint16_t pc, int block, Caches &caches, cache_timing &timing)
+    {
+        stream_clock++;
+        int window = config.distance + config.degree;
+        stream *found = nullptr;
+        for (stream &s : streams)
+            if (s.direction != 0 && (block - s.head) * s.direction > 0 && (block - s.head) * s.direction <= window)
+                found = &s;
+        // A stream that has seen one miss gets its direction from a second one nearby
+        for (stream &s : streams)
+            if (found == nullptr && s.head >= 0 && s.direction == 0 && block != s.head && abs(block - s.head) <= window)
+            {
+                found = &s;
+                s.direction = block > s.head ? 1 : -1;
+            }
+        if (found == nullptr)
+        {
+            stream &oldest = *min_element(streams.begin(), streams.end(), [](const stream &a, const stream &b)
+                                          { return a.last_use < b.last_use; });
+            oldest = {block, 0, stream_clock};
+            return;
+        }
+        found->head = block;
+        found->last_use = stream_clock;
+        int blocksize = caches.first_level().blocksize;
+        for (int k = 0; k < config.degree; ++k)
+            prefetch(pc, long(block + found->direction * (config.distance + k)) * blocksize, caches, timing);
+    }
+
+    /*
+        Loads the block holding target into L1 unless it is there already,
+        tagging the way it lands in. target wraps around the 13-bit address
+        space the way a load's address does, so prefetches past either end
+        of memory land on blocks at the other end.
+    */
+    template <class Caches>
+    void prefetch(uint16_t pc, long target, Caches &caches, cache_timing &timing)
+    {
+        cache_model &l1 = caches.first_level();
+        int block = int(target & (MEM_SIZE - 1)) / l1.blocksize;
+        uint16_t addr = block * l1.blocksize;
+        int row;
+        uint16_t tag = l1.locate(addr, row);
+        if (l1.find(row, tag) >= 0)
+        {
+            redundant++;
+            return;
+        }
+        row_blocks.resize(l1.assoc);
+        for (int way = 0; way < l1.assoc; ++way)
+            row_blocks[way] = l1.block_at(row, way);
+
+        prefetch_latency arrival{timing.latencies};
+        if (!caches.lw(pc, addr, arrival))
+            arrival.cycles += timing.latencies.back();
+        issued++;
+
+        int way = l1.find(row, tag);
+        drop_unless(l1, row, way, -1);
+        if (row_blocks[way] >= 0)
+            evicted[row_blocks[way] / l1.blocksize] = 1;
+        evicted[block] = 0;
+        line(l1, row, way) = {int(addr), timing.cycles() + arrival.cycles};
+    }
+
+    // Prefetched lines whose block has gone from L1 since without being used
+    uint64_t unused_now(const cache_model &l1) const
+    {
+        uint64_t count = unused;
+        for (int row = 0; row < l1.rows; ++row)
+            for (int way = 0; way < l1.assoc; ++way)
+            {
+                int block = lines[size_t(row) * l1.assoc + way].block;
+                count += block >= 0 && block != l1.block_at(row, way);
+            }
+        return count;
+    }
+};
+
+// Nothing to report without a prefetcher
+template <class Caches>
+void print_prefetch_report(ostream &, const no_prefetch &, Caches &, const cache_stats &)
+{
+}
+
+/*
+    Prints what the prefetcher did: how many prefetches were issued and
+    used, how many came late, and its accuracy, coverage of the L1 misses
+    there would have been without it, and pollution.
+*/
+template <class Caches>
+void print_prefetch_report(ostream &out, const prefetcher &prefetch, Caches &caches, const cache_stats &stats)
+{
+    const prefetch_config &config = prefetch.config;
+    uint64_t misses = stats.levels[0].events[CACHE_MISS];
+    uint64_t unused = prefetch.unused_now(caches.first_level());
+    out << fixed << setprecision(2);
+    out << "Prefetch: " << PREFETCH_NAMES[config.kind] << ", degree " << config.degree << ", distance "
+        << config.distance << endl;
+    out << "  issued " << prefetch.issued << ", dropped " << prefetch.redundant << " already in L1, used "
+        << prefetch.useful << ", evicted unused " << unused << endl;
+    out << "  accuracy " << (prefetch.issued ? 100.0 * prefetch.useful / prefetch.issued : 0.0) << "%, coverage "
+        << (prefetch.useful + misses ? 100.0 * prefetch.useful / (prefetch.useful + misses) : 0.0) << "% of "
+        << prefetch.useful + misses << " L1 misses" << endl;
+    out << "  late " << prefetch.late << " of " << prefetch.useful << " used ("
+        << (prefetch.useful ? 100.0 * prefetch.late / prefetch.useful : 0.0) << "%), waiting "
+        << prefetch.late_cycles << " cycles" << endl;
+    out << "  pollution: " << prefetch.pollution << " L1 misses on blocks prefetches evicted" << endl;
+    out.unsetf(ios::floatfield);
+}
+
+/*
+    Hook for run_e20 and replay_trace that sends every access through a
+    cache hierarchy, then counts, times and logs what the caches did.
+    Fetch is no_fetch, or fetch_caches to send instruction fetches
+    through instruction caches as well. Prefetch is no_prefetch, or a
+    prefetcher that loads and stores go through.
+*/
+template <class Hierarchy, class Fetch = no_fetch, class Prefetch = no_prefetch>
+struct logged_caches
+{
+    Hierarchy caches;
+    cache_log &log;
+    cache_stats &stats;
+    cache_timing &timing;
+    Fetch fetch;
+    Prefetch prefetch;
+
+    // Every instruction is a fetch once fetches are modelled
+    static const bool skips_loops = is_same<Fetch, no_fetch>::value;
+
+    void step(uint16_t pc)
+    {
+        timing.instructions++;
+        fetch.fetch(pc, caches, timing);
+    }
+
+    void skip(uint16_t, uint64_t steps)
+    {
+        timing.instructions += steps;
+    }
+
+    void lw(uint16_t pc, uint16_t addr)
+    {
+        timing.loads++;
+        prefetch.lw(pc, addr, caches, *this, timing);
+    }
+
+    void sw(uint16_t pc, uint16_t addr)
+    {
+        timing.stores++;
+        prefetch.sw(pc, addr, caches, *this);
+    }
+
+    void jump(uint16_t, uint16_t) {}
+
+    void event(int depth, cache_event event, uint16_t pc, uint16_t addr, int row)
+    {
+        stats.event(depth, event, pc, addr);
+        timing.event(depth, event);
+        log.event(depth, event, pc, addr, row);
+    }
+
+    // Saves or restores the data caches, then the instruction caches
+    template <class Archive>
+    void state(Archive &archive)
+    {
+        caches.state(archive);
+        fetch.state(archive);
+    }
+};
+
+/*
+    Memory access trace files start with this header, followed by one
+    record per access. A record is a varint holding the zigzag-encoded pc
+    delta from the previous record shifted left by one, with the low bit
+    set for SW, then a varint holding the zigzag-encoded address delta.
+    Deltas wrap at 16 bits, so no record is longer than six bytes.
+*/
+struct trace_header
+{
+    char magic[8]; // "E20TRACE"
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t count; // number of records
+};
+
+const char TRACE_MAGIC[8] = {'E', '2', '0', 'T', 'R', 'A', 'C', 'E'};
+uint32_t const static TRACE_VERSION = 1;
+
+// Zigzag-encodes a 16 bit delta so small negative steps stay small
+inline uint32_t zigzag(uint16_t delta)
+{
+    int16_t d = delta;
+    return (uint32_t(d) << 1) ^ uint32_t(d >> 15);
+}
+
+inline uint16_t unzigzag(uint32_t value)
+{
+    return uint16_t((value >> 1) ^ -(value & 1));
+}
+
+/*
+    Hook that appends every access to a trace file, then passes it on to
+    the cache models.
+*/
+template <class Caches>
+struct trace_recorder
+{
+    FILE *out;
+    Caches &caches;
+    uint64_t count = 0;
+    uint16_t last_pc = 0, last_addr = 0;
+    vector<uint8_t> buffer;
+
+    trace_recorder(FILE *out, Caches &caches) : out(out), caches(caches)
+    {
+    }
+
+    void put_varint(uint32_t value)
+    {
+        while (value >= 0x80)
+        {
+            buffer.push_back(uint8_t(value | 0x80));
+            value >>= 7;
+        }
+        buffer.push_back(uint8_t(value));
+    }
+
+    void record(uint16_t pc, uint16_t addr, bool is_store)
+    {
+        put_varint(zigzag(pc - last_pc) << 1 | is_store);
+        put_varint(zigzag(addr - last_addr));
+        last_pc = pc;
+        last_addr = addr;
+        count++;
+        if (buffer.size() >= (1 << 16))
+        {
+            fwrite(buffer.data(), 1, buffer.size(), out);
+            buffer.clear();
+        }
+    }
+
+    static const bool skips_loops = hook_skips_loops<Caches>::value;
+
+    void step(uint16_t pc)
+    {
+        caches.step(pc);
+    }
+
+    void skip(uint16_t pc, uint64_t steps)
+    {
+        caches.skip(pc, steps);
+    }
+
+    void lw(uint16_t pc, uint16_t addr)
+    {
+        record(pc, addr, false);
+        caches.lw(pc, addr);
+    }
+
+    void sw(uint16_t pc, uint16_t addr)
+    {
+        record(pc, addr, true);
+        caches.sw(pc, addr);
+    }
+
+    void jump(uint16_t, uint16_t) {}
+
+    /*
+        Flushes the records and fills in the header.
+
+        @return false on a write error
+    */
+    bool finish()
+    {
+        fwrite(buffer.data(), 1, buffer.size(), out);
+        buffer.clear();
+        trace_header header = {};
+        memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+        header.version = TRACE_VERSION;
+        header.count = count;
+        fseek(out, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, out);
+        return !ferror(out) && fclose(out) == 0;
+    }
+};
 
-uint16_t memory[MEM_SIZE] = {0};
-uint16_t registers[NUM_REGS] = {0};
-uint16_t pc = 0;
-// Struct for representing a cache cell
-struct cache_cell
+/*
+    Maps a trace file into memory and feeds every record to hook, in order,
+    without copying or allocating per record.
+
+    @param filename The trace written by --record
+    @param error Set to a message when the trace can't be read
+
+    @return false if the file is missing, not a trace, or truncated
+*/
+template <class Hook>
+bool replay_trace(const char *filename, Hook &hook, string &error)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        error = string("Can't open file ") + filename;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(trace_header))
+    {
+        close(fd);
+        error = string("Not a trace file: ") + filename;
+        return false;
+    }
+    size_t length = st.st_size;
+    void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        error = string("Can't map file ") + filename;
+        return false;
+    }
+    madvise(mapping, length, MADV_SEQUENTIAL);
+
+    const uint8_t *data = static_cast<const uint8_t *>(mapping);
+    trace_header header;
+    memcpy(&header, data, sizeof(header));
+    bool ok = memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0 && header.version == TRACE_VERSION;
+    if (!ok)
+        error = string("Not a trace file: ") + filename;
+
+    const uint8_t *p = data + sizeof(header);
+    const uint8_t *end = data + length;
+    auto get_varint = [&](uint32_t &value)
+    {
+        value = 0;
+        for (int shift = 0; shift < 21; shift += 7)
+        {
+            if (p == end)
+                return false;
+            uint8_t byte = *p++;
+            value |= uint32_t(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    };
+
+    uint16_t pc = 0, addr = 0;
+    for (uint64_t i = 0; ok && i < header.count; ++i)
+    {
+        uint32_t first, second;
+        if (!get_varint(first) || !get_varint(second))
+        {
+            error = string("Truncated trace file: ") + filename;
+            ok = false;
+            break;
+        }
+        pc += unzigzag(first >> 1);
+        addr += unzigzag(second);
+        if (first & 1)
+            hook.sw(pc, addr);
+        else
+            hook.lw(pc, addr);
+    }
+
+    munmap(mapping, length);
+    return ok;
+}
+
+/*
+    The configuration a checkpointed cache level had. After the
+    checkpoint_header and memory, simcache writes one of these per cache
+    level, then each level's state() in turn from L1 down, the data
+    levels first and then any instruction levels.
+*/
+struct checkpoint_level
+{
+    int32_t size, assoc, blocksize;
+    int32_t policy; // replacement policy | write policy << 8, with CHECKPOINT_ICACHE set for an instruction level
+
+    bool operator==(const checkpoint_level &other) const
+    {
+        return size == other.size && assoc == other.assoc && blocksize == other.blocksize && policy == other.policy;
+    }
+};
+
+const int32_t CHECKPOINT_ICACHE = 0x10000;
+
+/*
+    Everything in a checkpoint except memory, which is read and written
+    in place.
+*/
+struct machine_checkpoint
+{
+    uint16_t pc = 0;
+    uint16_t regs[NUM_REGS] = {};
+    uint64_t instructions = 0;
+    vector<checkpoint_level> levels;
+    vector<uint8_t> caches;
+};
+
+vector<checkpoint_level> checkpoint_levels(const vector<cache_geometry> &geometries,
+                                           const vector<cache_geometry> &ilevels = {})
+{
+    vector<checkpoint_level> levels;
+    for (const cache_geometry &g : geometries)
+        levels.push_back({g.size, g.assoc, g.blocksize, g.policy | g.write << 8});
+    for (const cache_geometry &g : ilevels)
+        levels.push_back({g.size, g.assoc, g.blocksize, g.policy | g.write << 8 | CHECKPOINT_ICACHE});
+    return levels;
+}
+
+/*
+    Writes a checkpoint with a single write.
+
+    @param error Set to a message when the file can't be written
+
+    @return false on any error
+*/
+bool write_checkpoint(const char *filename, const machine_checkpoint &checkpoint, const uint16_t memory[],
+                      string &error)
+{
+    checkpoint_header header = {};
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header.version = CHECKPOINT_VERSION;
+    header.pc = checkpoint.pc;
+    memcpy(header.regs, checkpoint.regs, sizeof(header.regs));
+    header.instructions = checkpoint.instructions;
+    header.levels = checkpoint.levels.size();
+    header.cache_bytes = checkpoint.caches.size();
+
+    vector<uint8_t> blob(sizeof(header) + MEM_SIZE * sizeof(uint16_t));
+    memcpy(blob.data(), &header, sizeof(header));
+    memcpy(blob.data() + sizeof(header), memory, MEM_SIZE * sizeof(uint16_t));
+    const uint8_t *levels = reinterpret_cast<const uint8_t *>(checkpoint.levels.data());
+    blob.insert(blob.end(), levels, levels + checkpoint.levels.size() * sizeof(checkpoint_level));
+    blob.insert(blob.end(), checkpoint.caches.begin(), checkpoint.caches.end());
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && write(fd, blob.data(), blob.size()) == ssize_t(blob.size());
+    if (fd >= 0)
+        ok = close(fd) == 0 && ok;
+    if (!ok)
+        error = string("Can't write file ") + filename;
+    return ok;
+}
+
+/*
+    Reads a checkpoint written by e20sim or simcache, loading its memory
+    straight into memory.
+
+    @param error Set to a message when the checkpoint can't be read
+
+    @return false if the file is missing, not a checkpoint, or truncated
+*/
+bool read_checkpoint(const char *filename, machine_checkpoint &checkpoint, uint16_t memory[], string &error)
 {
-    bool valid;
-    int tag;
-    int last_access; //  used to determine LRU, tracks how long a cell has NOT been used, the higher the less recent
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        error = string("Can't open file ") + filename;
+        return false;
+    }
+    vector<uint8_t> blob(st.st_size);
+    bool ok = read(fd, blob.data(), blob.size()) == ssize_t(blob.size());
+    close(fd);
+
+    checkpoint_header header;
+    size_t fixed = sizeof(header) + MEM_SIZE * sizeof(uint16_t);
+    ok = ok && blob.size() >= fixed;
+    if (ok)
+    {
+        memcpy(&header, blob.data(), sizeof(header));
+        ok = memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) == 0 &&
+             header.version == CHECKPOINT_VERSION &&
+             blob.size() == fixed + uint64_t(header.levels) * sizeof(checkpoint_level) + header.cache_bytes;
+    }
+    if (!ok)
+    {
+        error = string("Not a checkpoint file: ") + filename;
+        return false;
+    }
+
+    memcpy(memory, blob.data() + sizeof(header), MEM_SIZE * sizeof(uint16_t));
+    checkpoint.pc = header.pc;
+    memcpy(checkpoint.regs, header.regs, sizeof(header.regs));
+    checkpoint.instructions = header.instructions;
+    checkpoint.levels.resize(header.levels);
+    memcpy(checkpoint.levels.data(), blob.data() + fixed, header.levels * sizeof(checkpoint_level));
+    checkpoint.caches.assign(blob.end() - header.cache_bytes, blob.end());
+    return true;
+}
+
+// Archive for state() that appends every piece of state to bytes
+struct state_saver
+{
+    vector<uint8_t> &bytes;
+
+    template <class T>
+    void operator()(const T *data, size_t count)
+    {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+        bytes.insert(bytes.end(), p, p + count * sizeof(T));
+    }
+};
+
+// Archive for state() that copies every piece of state back from [p, end)
+struct state_loader
+{
+    const uint8_t *p, *end;
+    bool ok = true;
+
+    template <class T>
+    void operator()(T *data, size_t count)
+    {
+        size_t length = count * sizeof(T);
+        ok = ok && size_t(end - p) >= length;
+        if (!ok)
+            return;
+        memcpy(data, p, length);
+        p += length;
+    }
+};
+
+// When to write a checkpoint during a run
+struct checkpoint_request
+{
+    const char *filename = nullptr; // no checkpoint when null
+    uint64_t at_instr = UINT64_MAX; // once this many instructions have run
+    int at_pc = -1;                 // or just before pc first reaches this
+};
+
+/*
+    Hook that passes everything on to inner, and writes a checkpoint of
+    the machine and caches just before the instruction request asks for.
+    instructions counts from the start of the program, including any run
+    before a restored checkpoint.
+*/
+template <class Hook, class Caches>
+struct checkpoint_hook
+{
+    Hook &inner;
+    Caches &caches;
+    const checkpoint_request &request;
+    const vector<checkpoint_level> &levels;
+    const uint16_t *memory;
+    const uint16_t *regs;
+    uint64_t instructions;
+    bool written = false;
+    string error;
+
+    checkpoint_hook(Hook &inner, Caches &caches, const checkpoint_request &request,
+                    const vector<checkpoint_level> &levels, const uint16_t *memory, const uint16_t *regs,
+                    uint64_t instructions)
+        : inner(inner), caches(caches), request(request), levels(levels), memory(memory), regs(regs),
+          instructions(instructions)
+    {
+    }
+
+    void step(uint16_t pc)
+    {
+        if (!written && (instructions >= request.at_instr || pc == request.at_pc))
+            write(pc);
+        instructions++;
+        inner.step(pc);
+    }
+
+    void lw(uint16_t pc, uint16_t addr)
+    {
+        inner.lw(pc, addr);
+    }
+
+    void sw(uint16_t pc, uint16_t addr)
+    {
+        inner.sw(pc, addr);
+    }
+
+    void jump(uint16_t, uint16_t) {}
+
+    void write(uint16_t pc)
+    {
+        machine_checkpoint checkpoint;
+        checkpoint.pc = pc;
+        memcpy(checkpoint.regs, regs, sizeof(checkpoint.regs));
+        checkpoint.instructions = instructions;
+        checkpoint.levels = levels;
+        state_saver saver{checkpoint.caches};
+        caches.state(saver);
+        write_checkpoint(request.filename, checkpoint, memory, error);
+        written = true;
+    }
 };
 
+// Phase lengths of a sampled run, in instructions; detail 0 means no sampling
+struct sample_plan
+{
+    uint64_t skip = 0, warm = 0, detail = 0;
+};
+
+/*
+    Parses the --sample list SKIP,WARM,DETAIL.
+
+    @return false unless there are three values and DETAIL is positive
+*/
+bool parse_sample_plan(const string &list, sample_plan &plan)
+{
+    uint64_t values[3];
+    size_t lastpos = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        size_t pos = list.find(',', lastpos);
+        if ((pos == string::npos) != (i == 2))
+            return false;
+        if (pos == string::npos)
+            pos = list.size();
+        try
+        {
+            size_t used;
+            string value = list.substr(lastpos, pos - lastpos);
+            values[i] = stoull(value, &used);
+            if (used != value.size() || value[0] == '-')
+                return false;
+        }
+        catch (const exception &)
+        {
+            return false;
+        }
+        lastpos = pos + 1;
+    }
+    plan = {values[0], values[1], values[2]};
+    return plan.detail > 0;
+}
+
 /*
-    Loads an E20 machine code file into the list
-    provided by mem. We assume that mem is
-    large enough to hold the values in the machine
-    code file.
+    Running sums over sample windows for estimating sum(y) / sum(x), the
+    ratio estimator. The confidence interval comes from how far each
+    window's y strays from ratio() times its x, so windows of any size
+    can be combined.
+*/
+struct ratio_estimate
+{
+    double windows = 0, x = 0, y = 0, xx = 0, yy = 0, xy = 0;
+
+    void add(double xi, double yi)
+    {
+        windows++;
+        x += xi;
+        y += yi;
+        xx += xi * xi;
+        yy += yi * yi;
+        xy += xi * yi;
+    }
 
-    @param f Open file to read from
-    @param mem Array represetnting memory into which to read program
+    double ratio() const
+    {
+        return x > 0 ? y / x : 0;
+    }
+
+    // Half width of the 95% confidence interval of ratio(), or NAN
+    // with fewer than two windows
+    double half_width() const
+    {
+        if (windows < 2 || x <= 0)
+            return NAN;
+        double r = ratio();
+        double spread = max(0.0, (yy - 2 * r * xy + r * r * xx) / (windows - 1));
+        return 1.96 * sqrt(spread / windows) / (x / windows);
+    }
+};
+
+/*
+    Hook that samples a run instead of simulating all of it. It skips
+    plan.skip instructions without touching the caches, warms them for
+    plan.warm instructions without counting anything, then passes
+    plan.detail instructions on to inner to be counted, timed and
+    logged, and starts over. Loads and stores are counted in every phase,
+    so the detailed windows can be scaled up to the whole run.
 */
-void load_machine_code(ifstream &f, uint16_t mem[])
+template <class Logged>
+struct sampled_caches
 {
-    regex machine_code_re("^ram\\[(\\d+)\\] = 16'b(\\d+);.*$");
-    size_t expectedaddr = 0;
-    string line;
-    while (getline(f, line))
+    enum phase_kind
+    {
+        SKIP,
+        WARM,
+        DETAIL
+    };
+
+    Logged &inner;
+    sample_plan plan;
+    phase_kind phase = DETAIL; // so the first step starts skipping
+    uint64_t phase_left = 0;
+    uint64_t instructions = 0, loads = 0;
+    vector<ratio_estimate> local;    // misses over accesses of each level
+    vector<ratio_estimate> per_load; // misses of each level over loads
+    vector<uint64_t> window_start;   // each level's hits and misses when the window opened
+    discard_events discard;
+
+    sampled_caches(Logged &inner, const sample_plan &plan)
+        : inner(inner), plan(plan), local(inner.stats.levels.size()), per_load(inner.stats.levels.size()),
+          window_start(2 * inner.stats.levels.size())
+    {
+    }
+
+    void step(uint16_t pc)
+    {
+        while (phase_left == 0)
+            next_phase();
+        phase_left--;
+        instructions++;
+        if (phase == DETAIL)
+            inner.step(pc);
+        else if (phase == WARM)
+            inner.fetch.warm(pc, inner.caches);
+    }
+
+    void lw(uint16_t pc, uint16_t addr)
+    {
+        loads++;
+        if (phase == DETAIL)
+            inner.lw(pc, addr);
+        else if (phase == WARM)
+            inner.caches.lw(pc, addr, discard);
+    }
+
+    void sw(uint16_t pc, uint16_t addr)
+    {
+        if (phase == DETAIL)
+            inner.sw(pc, addr);
+        else if (phase == WARM)
+            inner.caches.sw(pc, addr, discard);
+    }
+
+    void jump(uint16_t, uint16_t) {}
+
+    void next_phase()
     {
-        smatch sm;
-        if (!regex_match(line, sm, machine_code_re))
+        if (phase == DETAIL)
         {
-            cerr << "Can't parse line: " << line << endl;
-            exit(1);
+            close_window();
+            phase = SKIP;
+            phase_left = plan.skip;
         }
-        size_t addr = stoi(sm[1], nullptr, 10);
-        unsigned instr = stoi(sm[2], nullptr, 2);
-        if (addr != expectedaddr)
+        else if (phase == SKIP)
         {
-            cerr << "Memory addresses encountered out of sequence: " << addr << endl;
-            exit(1);
+            phase = WARM;
+            phase_left = plan.warm;
         }
-        if (addr >= MEM_SIZE)
+        else
+        {
+            phase = DETAIL;
+            phase_left = plan.detail;
+            for (size_t d = 0; d < local.size(); ++d)
+            {
+                const uint64_t *events = inner.stats.levels[d].events;
+                window_start[2 * d] = events[CACHE_HIT];
+                window_start[2 * d + 1] = events[CACHE_MISS];
+            }
+        }
+    }
+
+    // Adds the window that just ended, if it measured any loads
+    void close_window()
+    {
+        if (local.empty())
+            return;
+        const uint64_t *first = inner.stats.levels[0].events;
+        double window_loads = first[CACHE_HIT] + first[CACHE_MISS] - window_start[0] - window_start[1];
+        if (window_loads == 0)
+            return;
+        for (size_t d = 0; d < local.size(); ++d)
         {
-            cerr << "Program too big for memory" << endl;
-            exit(1);
+            const uint64_t *events = inner.stats.levels[d].events;
+            double hits = events[CACHE_HIT] - window_start[2 * d];
+            double misses = events[CACHE_MISS] - window_start[2 * d + 1];
+            local[d].add(hits + misses, misses);
+            per_load[d].add(window_loads, misses);
         }
-        expectedaddr++;
-        mem[addr] = instr;
     }
+
+    // Ends the run, counting a detailed window cut short by the halt
+    void finish()
+    {
+        if (phase == DETAIL)
+            close_window();
+        phase = SKIP;
+    }
+};
+
+/*
+    Prints how much of a sampled run was measured, then each level's
+    miss rate and the misses it extrapolates to over the whole run, with
+    95% confidence intervals.
+*/
+template <class Logged>
+void print_sampling_report(ostream &out, const sampled_caches<Logged> &sampler)
+{
+    const sample_plan &plan = sampler.plan;
+    uint64_t measured = sampler.inner.timing.instructions;
+    out << fixed << setprecision(2);
+    out << "Sampling: skip " << plan.skip << ", warm " << plan.warm << ", measure " << plan.detail
+        << " instructions; measured " << measured << " of " << sampler.instructions << " instructions ("
+        << (sampler.instructions ? 100.0 * measured / sampler.instructions : 0.0) << "%)" << endl;
+    for (size_t d = 0; d < sampler.local.size(); ++d)
+    {
+        const ratio_estimate &local = sampler.local[d];
+        const ratio_estimate &per_load = sampler.per_load[d];
+        out << "Cache L" << d + 1 << ": miss rate " << 100 * local.ratio() << "%";
+        if (local.x == 0)
+            out << " (no accesses measured)";
+        else if (isnan(local.half_width()))
+            out << " (too few windows for a confidence interval)";
+        else
+            out << " +/- " << 100 * local.half_width() << "%";
+        out << ", about " << llround(per_load.ratio() * sampler.loads);
+        if (!isnan(per_load.half_width()))
+            out << " +/- " << llround(per_load.half_width() * sampler.loads);
+        out << " misses over " << sampler.loads << " loads in " << size_t(local.windows) << " windows" << endl;
+    }
+    out.unsetf(ios::floatfield);
 }
+
 /*
-    Prints out the correctly-formatted configuration of a cache.
+    Prints the configuration of every level, then runs the program (or
+    replays replay_file) through the cache hierarchy built from levels,
+    logging every cache event in log_format. The accesses are also
+    recorded to record_file when it isn't null, and a checkpoint is
+    written where save asks for one. The caches start out as restored
+    holds them, if they match levels. With a sample plan only its
+    detailed windows are logged and counted, and the estimates they give
+    are reported too. Instructions are fetched through the instruction
+    caches built from ilevels when Fetch is fetch_caches, unified with
+    the data caches below them if unified is set, and loads and stores go
+    through the prefetcher Prefetch built from prefetch. At exit the timing with
+    the given latencies goes to stderr, followed by a report with
+    report_top entries per list unless report_top is 0.
 
-    @param cache_name The name of the cache. "L1" or "L2"
+    @return The exit status for main
+*/
+template <class Hierarchy, class Fetch = no_fetch, class Prefetch = no_prefetch>
+int simulate_caches(const vector<cache_geometry> &levels, const vector<cache_geometry> &ilevels, bool unified,
+                    const prefetch_config &prefetch, uint16_t memory[], uint16_t regs[], uint16_t pc,
+                    const char *record_file, const char *replay_file, log_format format,
+                    const vector<uint64_t> &latencies, size_t report_top, const checkpoint_request &save,
+                    const machine_checkpoint &restored, const sample_plan &sample)
+{
+    // Binary and CSV logs hold nothing but records
+    if (format == LOG_TEXT || format == LOG_COUNTS)
+    {
+        for (size_t i = 0; i < levels.size(); ++i)
+        {
+            const cache_geometry &level = levels[i];
+            print_cache_config("L" + to_string(i + 1), level.size, level.assoc, level.blocksize,
+                               level.size / (level.assoc * level.blocksize));
+        }
+        for (size_t i = 0; i < ilevels.size(); ++i)
+        {
+            const cache_geometry &level = ilevels[i];
+            print_cache_config("L" + to_string(i + 1) + "I", level.size, level.assoc, level.blocksize,
+                               level.size / (level.assoc * level.blocksize));
+        }
+    }
 
-    @param size The total size of the cache, measured in memory cells.
-        Excludes metadata
+    FILE *out = nullptr;
+    if (record_file != nullptr && (out = fopen(record_file, "wb")) == nullptr)
+    {
+        cerr << "Can't open file " << record_file << endl;
+        return 1;
+    }
 
-    @param assoc The associativity of the cache. One of [1,2,4,8,16]
+    cache_log log(format, levels.size());
+    cache_stats stats(levels.size());
+    cache_timing timing(latencies);
+    logged_caches<Hierarchy, Fetch, Prefetch> caches{Hierarchy(levels), log, stats, timing,
+                                                     Fetch(ilevels, levels.size(), unified),
+                                                     Prefetch(prefetch, levels)};
 
-    @param blocksize The blocksize of the cache. One of [1,2,4,8,16,32,64])
+    vector<checkpoint_level> shape = checkpoint_levels(levels, ilevels);
+    if (!restored.levels.empty() && restored.levels == shape)
+    {
+        state_loader loader{restored.caches.data(), restored.caches.data() + restored.caches.size()};
+        caches.state(loader);
+        if (!loader.ok || loader.p != loader.end)
+        {
+            cerr << "Corrupt cache contents in checkpoint" << endl;
+            return 1;
+        }
+    }
+    else if (!restored.levels.empty())
+        cerr << "Checkpoint caches don't match --cache and --icache, starting with empty caches" << endl;
 
-    @param num_rows The number of rows in the given cache.
+    bool ok = true;
+    string error;
+    // Runs the program through hook, writing the checkpoint on the way if asked to
+    auto run = [&](auto &hook)
+    {
+        if (save.filename == nullptr)
+        {
+            run_e20(memory, regs, pc, hook);
+            return;
+        }
+        checkpoint_hook<remove_reference_t<decltype(hook)>, decltype(caches)> checkpointer(
+            hook, caches, save, shape, memory, regs, restored.instructions);
+        run_e20(memory, regs, pc, checkpointer);
+        if (!checkpointer.written)
+            checkpointer.error = "Program halted before the checkpoint";
+        if (!checkpointer.error.empty())
+        {
+            ok = false;
+            error = checkpointer.error;
+        }
+    };
+    sampled_caches<decltype(caches)> sampler(caches, sample);
+    if (replay_file != nullptr)
+        ok = replay_trace(replay_file, caches, error);
+    else if (sample.detail > 0)
+    {
+        run(sampler);
+        sampler.finish();
+    }
+    else if (out == nullptr)
+        run(caches);
+    else
+    {
+        trace_recorder<decltype(caches)> recorder(out, caches);
+        trace_header placeholder = {};
+        fwrite(&placeholder, sizeof(placeholder), 1, out);
+        run(recorder);
+        if (!recorder.finish())
+        {
+            ok = false;
+            error = string("Can't write file ") + record_file;
+        }
+    }
+    log.finish();
+    if (!ok)
+    {
+        cerr << error << endl;
+        return 1;
+    }
+    if (sample.detail > 0)
+        print_sampling_report(cerr, sampler);
+    print_timing_report(cerr, timing);
+    print_prefetch_report(cerr, caches.prefetch, caches.caches, stats);
+    if (report_top > 0)
+    {
+        print_cache_report(cerr, stats, caches.caches, report_top);
+        print_fetch_report(cerr, caches.fetch, report_top);
+    }
+    return 0;
+}
+
+// Coherence protocols of the private L1s in a multicore run
+enum coherence_protocol
+{
+    COHERENCE_MSI,
+    COHERENCE_MESI,
+    NUM_COHERENCE_PROTOCOLS
+};
+
+const char *const COHERENCE_NAMES[NUM_COHERENCE_PROTOCOLS] = {"msi", "mesi"};
+
+/*
+    Parses the --entry list: the pc each core starts at, comma separated
+    from core 0.
+
+    @return false unless every value is a number below 65536
 */
-void print_cache_config(const string &cache_name, int size, int assoc, int blocksize, int num_rows)
+bool parse_entries(const string &list, vector<uint16_t> &entries)
 {
-    cout << "Cache " << cache_name << " has size " << size << ", associativity " << assoc << ", blocksize " << blocksize << ", rows " << num_rows << endl;
+    size_t lastpos = 0;
+    while (lastpos <= list.size())
+    {
+        size_t pos = list.find(',', lastpos);
+        if (pos == string::npos)
+            pos = list.size();
+        string item = list.substr(lastpos, pos - lastpos);
+        char *end;
+        unsigned long value = strtoul(item.c_str(), &end, 0);
+        if (item.empty() || *end != '\0' || value > UINT16_MAX)
+            return false;
+        entries.push_back(value);
+        lastpos = pos + 1;
+    }
+    return true;
 }
 
 /*
-    Prints out a correctly-formatted log entry.
+    A core's view of memory during a quantum: the shared memory as the
+    last barrier left it, overlaid with the core's own stores. commit
+    copies those stores into the shared memory at the barrier.
+*/
+struct buffered_memory
+{
+    const uint16_t *shared;
+    vector<uint16_t> words = vector<uint16_t>(MEM_SIZE);
+    vector<uint8_t> written = vector<uint8_t>(MEM_SIZE);
+    vector<uint16_t> stored; // addresses with written set
+
+    explicit buffered_memory(const uint16_t *shared) : shared(shared) {}
+
+    uint16_t load(uint16_t addr) const
+    {
+        return written[addr] ? words[addr] : shared[addr];
+    }
+
+    void store(uint16_t addr, uint16_t value)
+    {
+        if (!written[addr])
+        {
+            written[addr] = 1;
+            stored.push_back(addr);
+        }
+        words[addr] = value;
+    }
+
+    void commit(uint16_t memory[])
+    {
+        for (uint16_t addr : stored)
+        {
+            memory[addr] = words[addr];
+            written[addr] = 0;
+        }
+        stored.clear();
+    }
+};
+
+// An access a core made, and how many instructions it had run by then
+struct core_access
+{
+    uint64_t step;
+    mem_access access;
+};
+
+/*
+    One simulated core: its registers, pc and buffered memory, and the
+    hook collecting the accesses of a quantum for the coherent caches.
+*/
+struct core_state
+{
+    uint16_t regs[NUM_REGS] = {};
+    uint16_t pc = 0;
+    bool halted = false;
+    uint64_t instructions = 0;
+    buffered_memory memory;
+    vector<core_access> accesses;
+
+    explicit core_state(const uint16_t *shared) : memory(shared) {}
+
+    static const bool skips_loops = true;
+
+    void step(uint16_t)
+    {
+        instructions++;
+    }
+
+    void skip(uint16_t, uint64_t steps)
+    {
+        instructions += steps;
+    }
 
-    @param cache_name The name of the cache where the event
-        occurred. "L1" or "L2"
+    void lw(uint16_t pc, uint16_t addr)
+    {
+        accesses.push_back({instructions, {pc, addr, false}});
+    }
 
-    @param status The kind of cache event. "SW", "HIT", or
-        "MISS"
+    void sw(uint16_t pc, uint16_t addr)
+    {
+        accesses.push_back({instructions, {pc, addr, true}});
+    }
 
-    @param pc The program counter of the memory
-        access instruction
+    void jump(uint16_t, uint16_t) {}
 
-    @param addr The memory address being accessed.
+    // Runs at most quantum instructions
+    void run(uint64_t quantum)
+    {
+        run_e20_for(memory, regs, pc, *this, quantum, halted);
+    }
+};
 
-    @param row The cache row or set number where the data
-        is stored.
+/*
+    Lets count threads meet between quanta. A waiter spins for a few
+    yields, which is enough when quanta are long and every thread has a
+    core. Then it blocks, so lock-step quanta or more cores than host
+    CPUs don't leave the threads spinning against each other.
 */
-void print_log_entry(const string &cache_name, const string &status, int pc, int addr, int row)
+struct thread_barrier
 {
-    cout << left << setw(8) << cache_name + " " + status << right << " pc:" << setw(5) << pc << "\taddr:" << setw(5) << addr << "\trow:" << setw(4) << row << endl;
-}
+    static const unsigned SPINS = 64;
+
+    unsigned count;
+    unsigned arrived = 0; // guarded by lock
+    atomic<unsigned> generation{0};
+    mutex lock;
+    condition_variable released;
+
+    explicit thread_barrier(unsigned count) : count(count) {}
+
+    void wait()
+    {
+        unique_lock<mutex> guard(lock);
+        unsigned seen = generation.load(memory_order_relaxed);
+        if (++arrived == count)
+        {
+            arrived = 0;
+            generation.store(seen + 1, memory_order_release);
+            guard.unlock();
+            released.notify_all();
+            return;
+        }
+        guard.unlock();
+        for (unsigned i = 0; i < SPINS; i++)
+        {
+            if (generation.load(memory_order_acquire) != seen)
+                return;
+            this_thread::yield();
+        }
+        guard.lock();
+        released.wait(guard, [&] { return generation.load(memory_order_acquire) != seen; });
+    }
+};
 
 /*
-    Simulates e20 with L1 cache
+    Private L1s kept coherent by snooping, in front of the shared levels
+    below them. Every L1 is write-back with write-allocate, so a dirty
+    way is Modified, and a clean one is Exclusive if its exclusive flag
+    is set and Shared if not; MSI never sets the flag.
+
+    A load miss puts a BusRd on the bus and a store miss a BusRdX, and a
+    store to a Shared way a BusUpgr. A Modified copy that snoops a miss
+    is flushed to the shared levels and hands the block over, which is an
+    intervention; any other miss reads the block through the shared
+    levels. BusRdX and BusUpgr invalidate every other copy, and an
+    invalidation is false sharing if the core losing the block never
+    touched the word being stored since it filled the block.
 */
-void simulate_one_cache(uint16_t memory[], uint16_t regs[], uint16_t pc, vector<vector<cache_cell>> cache, int l1_size, int l1_assoc, int l1_blocksize, int l1_rows)
+struct coherent_caches
 {
-    // Do simulation
-    bool halt = false; // Flag for when encounter halt instruction
-    while (!halt)      // Keep looping through instructions until halt
+    struct core_cache
     {
-        // Get e20 instruction fields
-        uint16_t opcode = memory[pc % 8192] >> 13;
-        uint16_t regA = memory[pc % 8192] >> 10 & 0b111;
-        uint16_t regB = memory[pc % 8192] >> 7 & 0b111;
-        uint16_t regC = memory[pc % 8192] >> 4 & 0b111;
-        uint16_t lsb = memory[pc % 8192] & 0b1111; // Four least significant bits
-        uint16_t imm13 = memory[pc % 8192] & 0b1111111111111;
+        cache_model l1;
+        vector<uint8_t> exclusive; // per way, row by row
+        vector<uint64_t> touched;  // per way, words used since the fill, modulo 64
+        uint64_t loads = 0, stores = 0, hits = 0, misses = 0;
 
-        signed imm7 = memory[pc % 8192] & 0b1111111;
-        uint16_t imm_slti = imm7;                // Specifically for slti
-        if (memory[pc % 8192] >> 6 & 0b1 == 0b1) // imm is negative
+        explicit core_cache(const cache_geometry &geometry)
+            : l1(geometry), exclusive(size_t(l1.rows) * l1.assoc), touched(size_t(l1.rows) * l1.assoc)
         {
-            imm7 = ((imm7 ^ 0b1111111) + 1) * -1; // Convert imm7 to two's complement
-            // Convert imm_slti to unsigned 16 bit by sign extending the 7 bit two's complement
-            imm_slti = ((imm_slti ^ 0b1111111) + 1) | 0b1111111110000000;
         }
+    };
 
-        // Useful cache variables
-        int mem_addr;
-        int block_id;
-        int row;
-        int tag;
-        bool hit;
-        int lru;             // tracks LRU, stores which cell to evict/write
-        int lru_last_access; // helps track LRU, determines if there is a new LRU
+    coherence_protocol protocol;
+    vector<core_cache> cores;
+    cache_hierarchy<vector<cache_model>> shared;
+    cache_stats stats; // events of the shared levels, at their depth
+    uint64_t bus_reads = 0, bus_read_exclusives = 0, bus_upgrades = 0;
+    uint64_t interventions = 0, invalidations = 0, false_sharing = 0;
+    vector<uint64_t> block_invalidations, block_false_sharing; // indexed by L1 block
 
-        switch (opcode)
-        {
-        case 0:
-            // Check last four least significant bits
-            switch (lsb)
-            {
-            case 0: // add
-                regs[regC] = (regs[regA] + regs[regB]);
-                ++pc;
-                break;
-            case 1: // sub
-                regs[regC] = (regs[regA] - regs[regB]);
-                ++pc;
-                break;
-            case 2: // or
-                regs[regC] = (regs[regA] | regs[regB]);
-                ++pc;
-                break;
-            case 3: // and
-                regs[regC] = (regs[regA] & regs[regB]);
-                ++pc;
-                break;
-            case 4: // slt
-                regs[regC] = (regs[regA] < regs[regB]) ? 1 : 0;
-                ++pc;
-                break;
-            case 8: // jr
-                // Keep all 16 bits
-                pc = regs[regA];
-                break;
-            }
-            break;
-        case 1: // addi
-            regs[regB] = (regs[regA] + imm7);
-            ++pc;
-            break;
-        case 2:              // j
-            if (pc == imm13) // halt
-                halt = true;
-            else
-                pc = imm13;
-            break;
-        case 3: // jal
-            regs[7] = pc + 1;
-            pc = imm13;
-            break;
-        case 4: // lw (read)
-            // initialize useful cache variables
-            mem_addr = (regs[regA] + imm7) & 0b1111111111111;
-            block_id = mem_addr / l1_blocksize;
-            row = block_id % l1_rows;
-            tag = block_id / l1_rows;
-
-            // cache hit or miss
-            hit = false;
-            lru = 0;
-            lru_last_access = 0;
-            for (size_t i = 0; i < l1_assoc; ++i)
-            {
-                if (cache[row][i].valid && cache[row][i].tag == tag) // handle hit
-                {
-                    hit = true;
-                    cache[row][i].last_access = 0; // reset last access
-                    print_log_entry("L1", "HIT", pc, mem_addr, row);
-                    break;
-                }
+    /*
+        @param levels The private L1 geometry, then the shared levels
+    */
+    coherent_caches(const vector<cache_geometry> &levels, size_t num_cores, coherence_protocol protocol)
+        : protocol(protocol), shared(levels, 1), stats(levels.size()),
+          block_invalidations(MEM_SIZE / levels[0].blocksize + 1),
+          block_false_sharing(MEM_SIZE / levels[0].blocksize + 1)
+    {
+        cache_geometry private_level = levels[0];
+        private_level.write = WRITE_BACK_ALLOCATE;
+        for (size_t i = 0; i < num_cores; ++i)
+            cores.emplace_back(private_level);
+    }
 
-                if (cache[row][i].last_access > lru_last_access) // find LRU
-                {
-                    lru = i;
-                    lru_last_access = cache[row][i].last_access;
-                }
+    // Sink for the shared levels
+    void event(int depth, cache_event event, uint16_t pc, uint16_t addr, int)
+    {
+        stats.event(depth, event, pc, addr);
+    }
 
-                cache[row][i].last_access += 1; // update last access
-            }
+    uint64_t word_bit(const cache_model &l1, uint16_t addr) const
+    {
+        return uint64_t(1) << (addr % l1.blocksize % 64);
+    }
 
-            if (!hit) // handle miss
+    // Sends core c's load or store through its L1 and the bus
+    void access(size_t c, const mem_access &access)
+    {
+        core_cache &core = cores[c];
+        cache_model &l1 = core.l1;
+        (access.is_store ? core.stores : core.loads)++;
+        int row;
+        uint16_t tag = l1.locate(access.addr, row);
+        int way = l1.find(row, tag);
+        if (way >= 0)
+        {
+            size_t slot = size_t(row) * l1.assoc + way;
+            core.hits++;
+            l1.touch(row, way);
+            core.touched[slot] |= word_bit(l1, access.addr);
+            if (access.is_store && !l1.dirty_at(row, way))
             {
-                cache[row][lru].valid = true;
-                cache[row][lru].tag = tag;
-                cache[row][lru].last_access = 0; // reset last access
-                print_log_entry("L1", "MISS", pc, mem_addr, row);
-            }
-
-            // read memory to registers
-            regs[regB] = memory[(regs[regA] + imm7) & 0b1111111111111];
-            ++pc;
-            break;
-        case 5: // sw (write)
-            // initialize useful cache variables
-            mem_addr = (regs[regA] + imm7) & 0b1111111111111;
-            block_id = mem_addr / l1_blocksize;
-            row = block_id % l1_rows;
-            tag = block_id / l1_rows;
-
-            // find LRU
-            lru = 0;
-            lru_last_access = 0;
-            for (size_t i = 0; i < l1_assoc; ++i)
-            {
-                if (cache[row][i].last_access > lru_last_access)
+                if (!core.exclusive[slot])
                 {
-                    lru = i;
-                    lru_last_access = cache[row][i].last_access;
+                    bus_upgrades++;
+                    snoop(c, access);
                 }
-
-                cache[row][i].last_access += 1; // update last access
+                core.exclusive[slot] = 0;
+                l1.mark_dirty(row, way);
             }
-
-            // write to LRU
-            cache[row][lru].valid = true;
-            cache[row][lru].tag = tag;
-            cache[row][lru].last_access = 0; // reset last access
-            print_log_entry("L1", "SW", pc, mem_addr, row);
-
-            // write registers to memory
-            memory[(regs[regA] + imm7) & 0b1111111111111] = regs[regB];
-            ++pc;
-            break;
-        case 6: // jeq
-            pc = (regs[regA] == regs[regB]) ? (pc + 1 + imm7) : pc + 1;
-            break;
-        case 7: // slti
-            regs[regB] = (regs[regA] < imm_slti) ? 1 : 0;
-            ++pc;
-            break;
-        defualt:
-            cerr << opcode << " is not a valid opcode" << endl;
-            break;
+            return;
         }
 
-        regs[0] = 0; // Ensure $0 is still 0
-    }
-}
-
-/*
-    Simulates e20 with L1 and L2 cache
-*/
-void simulate_two_cache(uint16_t memory[], uint16_t regs[], uint16_t pc,
-                        vector<vector<cache_cell>> l1_cache, vector<vector<cache_cell>> l2_cache,
-                        int l1_size, int l1_assoc, int l1_blocksize, int l1_rows,
-                        int l2_size, int l2_assoc, int l2_blocksize, int l2_rows)
-{
-    // Do simulation
-    bool halt = false; // Flag for when encounter halt instruction
-    while (!halt)      // Keep looping through instructions until halt
-    {
-        // Get e20 instruction fields
-        uint16_t opcode = memory[pc % 8192] >> 13;
-        uint16_t regA = memory[pc % 8192] >> 10 & 0b111;
-        uint16_t regB = memory[pc % 8192] >> 7 & 0b111;
-        uint16_t regC = memory[pc % 8192] >> 4 & 0b111;
-        uint16_t lsb = memory[pc % 8192] & 0b1111; // Four least significant bits
-        uint16_t imm13 = memory[pc % 8192] & 0b1111111111111;
-
-        signed imm7 = memory[pc % 8192] & 0b1111111;
-        uint16_t imm_slti = imm7;                // Specifically for slti
-        if (memory[pc % 8192] >> 6 & 0b1 == 0b1) // imm is negative
+        core.misses++;
+        (access.is_store ? bus_read_exclusives : bus_reads)++;
+        bool supplied = false;
+        bool others = snoop(c, access, &supplied);
+        // A store that covers the whole block needs nothing from below
+        if (!supplied && !(access.is_store && l1.blocksize == 1))
+            shared.lw(access.pc, access.addr, *this, 1);
+        way = l1.vacancy(row);
+        if (way >= 0)
+            l1.touch(row, way);
+        else
+            way = l1.replace(row);
+        l1.fill(row, way, tag);
+        l1.fills++;
+        if (l1.victim >= 0)
         {
-            imm7 = ((imm7 ^ 0b1111111) + 1) * -1; // Convert imm7 to two's complement
-            // Convert imm_slti to unsigned 16 bit by sign extending the 7 bit two's complement
-            imm_slti = ((imm_slti ^ 0b1111111) + 1) | 0b1111111110000000;
+            discard_events discard;
+            shared.sw(access.pc, l1.victim, discard, 1, l1.blocksize);
+            l1.victim = -1;
         }
+        size_t slot = size_t(row) * l1.assoc + way;
+        core.exclusive[slot] = protocol == COHERENCE_MESI && !access.is_store && !others;
+        core.touched[slot] = word_bit(l1, access.addr);
+        if (access.is_store)
+            l1.mark_dirty(row, way);
+    }
 
-        // Useful cache variables
-        int mem_addr;
-        int l1_block_id, l2_block_id;
-        int l1_row, l2_row;
-        int l1_tag, l2_tag;
-        bool l1_hit, l2_hit;
-        int l1_lru, l2_lru;                         // tracks LRU, stores which cell to evict/write
-        int l1_lru_last_access, l2_lru_last_access; // helps track LRU, determines if there is a new LRU
+    /*
+        Lets every other core's L1 answer core c's bus request: a Modified
+        copy is flushed, a load leaves the copies Shared and a store
+        invalidates them.
 
-        switch (opcode)
+        @param supplied Set if a Modified copy handed the block over
+        @return true if any other L1 held the block
+    */
+    bool snoop(size_t c, const mem_access &access, bool *supplied = nullptr)
+    {
+        bool found = false;
+        for (size_t d = 0; d < cores.size(); ++d)
         {
-        case 0:
-            // Check last four least significant bits
-            switch (lsb)
+            core_cache &other = cores[d];
+            int row;
+            uint16_t tag = other.l1.locate(access.addr, row);
+            int way = d == c ? -1 : other.l1.find(row, tag);
+            if (way < 0)
+                continue;
+            found = true;
+            size_t slot = size_t(row) * other.l1.assoc + way;
+            other.exclusive[slot] = 0;
+            if (other.l1.dirty_at(row, way))
             {
-            case 0: // add
-                regs[regC] = (regs[regA] + regs[regB]);
-                ++pc;
-                break;
-            case 1: // sub
-                regs[regC] = (regs[regA] - regs[regB]);
-                ++pc;
-                break;
-            case 2: // or
-                regs[regC] = (regs[regA] | regs[regB]);
-                ++pc;
-                break;
-            case 3: // and
-                regs[regC] = (regs[regA] & regs[regB]);
-                ++pc;
-                break;
-            case 4: // slt
-                regs[regC] = (regs[regA] < regs[regB]) ? 1 : 0;
-                ++pc;
-                break;
-            case 8: // jr
-                // Keep all 16 bits
-                pc = regs[regA];
-                break;
-            }
-            break;
-        case 1: // addi
-            regs[regB] = (regs[regA] + imm7);
-            ++pc;
-            break;
-        case 2:              // j
-            if (pc == imm13) // halt
-                halt = true;
-            else
-                pc = imm13;
-            break;
-        case 3: // jal
-            regs[7] = pc + 1;
-            pc = imm13;
-            break;
-        case 4: // lw (read)
-            // initialize useful cache variables
-            mem_addr = (regs[regA] + imm7) & 0b1111111111111;
-            l1_block_id = mem_addr / l1_blocksize;
-            l1_row = l1_block_id % l1_rows;
-            l1_tag = l1_block_id / l1_rows;
-            l2_block_id = mem_addr / l2_blocksize;
-            l2_row = l2_block_id % l2_rows;
-            l2_tag = l2_block_id / l2_rows;
-
-            // L1 cache hit or miss
-            l1_hit = false;
-            l1_lru = 0;
-            l1_lru_last_access = 0;
-            for (size_t i = 0; i < l1_assoc; ++i)
-            {
-                if (l1_cache[l1_row][i].valid && l1_cache[l1_row][i].tag == l1_tag) // handle hit in L1
-                {
-                    l1_hit = true;
-                    l1_cache[l1_row][i].last_access = 0; // reset last access
-                    print_log_entry("L1", "HIT", pc, mem_addr, l1_row);
-                    break;
-                }
-
-                if (l1_cache[l1_row][i].last_access > l1_lru_last_access) // find LRU
-                {
-                    l1_lru = i;
-                    l1_lru_last_access = l1_cache[l1_row][i].last_access;
-                }
-
-                l1_cache[l1_row][i].last_access += 1; // update last access
+                other.l1.clean(row, way);
+                discard_events discard;
+                shared.sw(access.pc, other.l1.block_at(row, way), discard, 1, other.l1.blocksize);
+                interventions++;
+                if (supplied != nullptr)
+                    *supplied = true;
             }
-
-            if (!l1_hit) // handle miss in L1, move to L2
+            if (!access.is_store)
+                continue;
+            size_t block = access.addr / other.l1.blocksize;
+            other.l1.invalidate(row, way);
+            invalidations++;
+            block_invalidations[block]++;
+            if (!(other.touched[slot] & word_bit(other.l1, access.addr)))
             {
-                // update LRU in L1
-                l1_cache[l1_row][l1_lru].valid = true;
-                l1_cache[l1_row][l1_lru].tag = l1_tag;
-                l1_cache[l1_row][l1_lru].last_access = 0; // reset last access
-                print_log_entry("L1", "MISS", pc, mem_addr, l1_row);
-
-                // L2 cache hit or miss
-                l2_hit = false;
-                l2_lru = 0;
-                l2_lru_last_access = 0;
-                for (size_t i = 0; i < l2_assoc; ++i)
-                {
-                    if (l2_cache[l2_row][i].valid && l2_cache[l2_row][i].tag == l2_tag) // handle hit in L2
-                    {
-                        l2_hit = true;
-                        l2_cache[l2_row][i].last_access = 0; // reset last access
-                        print_log_entry("L2", "HIT", pc, mem_addr, l2_row);
-                        break;
-                    }
-
-                    if (l2_cache[l2_row][i].last_access > l2_lru_last_access) // find LRU
-                    {
-                        l2_lru = i;
-                        l2_lru_last_access = l2_cache[l2_row][i].last_access;
-                    }
-
-                    l2_cache[l2_row][i].last_access += 1; // update last access
-                }
-
-                if (!l2_hit) // handle miss in L2
-                {
-                    // update LRU in L2
-                    l2_cache[l2_row][l2_lru].valid = true;
-                    l2_cache[l2_row][l2_lru].tag = l2_tag;
-                    l2_cache[l2_row][l2_lru].last_access = 0; // reset last access
-                    print_log_entry("L2", "MISS", pc, mem_addr, l2_row);
-                }
+                false_sharing++;
+                block_false_sharing[block]++;
             }
+        }
+        return found;
+    }
+};
 
-            // read memory to registers
-            regs[regB] = memory[(regs[regA] + imm7) & 0b1111111111111];
-            ++pc;
+/*
+    Sends the accesses the cores made in the last quantum through the
+    coherent caches in the order of the instructions that made them,
+    lower cores first when two ran at the same step.
+*/
+void replay_quantum(vector<core_state> &states, coherent_caches &caches)
+{
+    vector<size_t> next(states.size(), 0);
+    for (;;)
+    {
+        size_t pick = states.size();
+        for (size_t c = 0; c < states.size(); ++c)
+            if (next[c] < states[c].accesses.size() &&
+                (pick == states.size() || states[c].accesses[next[c]].step < states[pick].accesses[next[pick]].step))
+                pick = c;
+        if (pick == states.size())
             break;
-        case 5: // sw (write)
-            // initialize useful cache variables
-            mem_addr = (regs[regA] + imm7) & 0b1111111111111;
-            l1_block_id = mem_addr / l1_blocksize;
-            l1_row = l1_block_id % l1_rows;
-            l1_tag = l1_block_id / l1_rows;
-            l2_block_id = mem_addr / l2_blocksize;
-            l2_row = l2_block_id % l2_rows;
-            l2_tag = l2_block_id / l2_rows;
-
-            // find LRU in L1
-            l1_lru = 0;
-            l1_lru_last_access = 0;
-            for (size_t i = 0; i < l1_assoc; ++i)
-            {
-                if (l1_cache[l1_row][i].last_access > l1_lru_last_access)
-                {
-                    l1_lru = i;
-                    l1_lru_last_access = l1_cache[l1_row][i].last_access;
-                }
+        caches.access(pick, states[pick].accesses[next[pick]++].access);
+    }
+    for (core_state &state : states)
+        state.accesses.clear();
+}
 
-                l1_cache[l1_row][i].last_access += 1; // update last access
-            }
+// The shared levels as print_cache_report walks them, from L2
+struct shared_levels
+{
+    const cache_hierarchy<vector<cache_model>> &levels;
 
-            // find LRU in L2
-            l2_lru = 0;
-            l2_lru_last_access = 0;
-            for (size_t i = 0; i < l2_assoc; ++i)
-            {
-                if (l2_cache[l2_row][i].last_access > l2_lru_last_access)
-                {
-                    l2_lru = i;
-                    l2_lru_last_access = l2_cache[l2_row][i].last_access;
-                }
+    template <class Visitor>
+    void visit(Visitor &&visitor) const
+    {
+        levels.visit(visitor, 1);
+    }
+};
 
-                l2_cache[l2_row][i].last_access += 1; // update last access
-            }
+/*
+    Prints each core's instructions and L1 counts, the bus transactions,
+    invalidations and false sharing of all of them, the top_n blocks
+    invalidated most, and with top_n set the shared levels' report.
+*/
+void print_multicore_report(ostream &out, const vector<core_state> &states, const coherent_caches &caches,
+                            size_t top_n)
+{
+    out << fixed << setprecision(2);
+    out << "Cores: " << states.size() << ", " << COHERENCE_NAMES[caches.protocol] << " coherence" << endl;
+    uint64_t writebacks = 0;
+    for (size_t c = 0; c < states.size(); ++c)
+    {
+        const coherent_caches::core_cache &core = caches.cores[c];
+        uint64_t accesses = core.loads + core.stores;
+        out << "Core " << c << ": " << states[c].instructions << " instructions, halted at pc " << states[c].pc
+            << "; L1 " << core.loads << " loads, " << core.stores << " stores, " << core.hits << " hits, "
+            << core.misses << " misses (" << (accesses ? 100.0 * core.misses / accesses : 0.0) << "% miss rate)"
+            << endl;
+        writebacks += core.l1.writebacks;
+    }
+    out << "Bus: " << caches.bus_reads << " BusRd, " << caches.bus_read_exclusives << " BusRdX, "
+        << caches.bus_upgrades << " BusUpgr, " << caches.interventions << " interventions, " << writebacks
+        << " L1 writebacks" << endl;
+    out << "Coherence: " << caches.invalidations << " invalidations, " << caches.false_sharing
+        << " of them false sharing" << endl;
+    int blocksize = caches.cores[0].l1.blocksize;
+    vector<size_t> top = top_counts(caches.block_invalidations, top_n);
+    if (!top.empty())
+    {
+        out << "  top invalidated blocks:" << endl;
+        out << "          addr  invalidations  false sharing" << endl;
+        for (size_t block : top)
+            out << "    " << setw(4) << block * blocksize << "-" << left << setw(5)
+                << min(size_t(MEM_SIZE), (block + 1) * blocksize) - 1 << right << setw(15)
+                << caches.block_invalidations[block] << setw(15) << caches.block_false_sharing[block] << endl;
+    }
+    out.unsetf(ios::floatfield);
+    if (top_n > 0)
+        print_cache_report(out, caches.stats, shared_levels{caches.shared}, top_n);
+}
 
-            // write to LRU in L1
-            l1_cache[l1_row][l1_lru].valid = true;
-            l1_cache[l1_row][l1_lru].tag = l1_tag;
-            l1_cache[l1_row][l1_lru].last_access = 0; // reset last access
-            print_log_entry("L1", "SW", pc, mem_addr, l1_row);
+/*
+    Runs one E20 core per entry in entries on its own thread, all on
+    memory, until every core halts. Core i starts at entries[i], or the
+    last entry, with $1 set to i. The threads run quantum instructions
+    at a time, their stores buffered, then meet; the stores are copied
+    into memory in core order and the accesses sent through the coherent
+    caches before the next quantum, so the run doesn't depend on how the
+    host schedules the threads. A quantum of 1 runs the cores in lock
+    step.
+*/
+int simulate_multicore(const vector<cache_geometry> &levels, size_t num_cores, coherence_protocol protocol,
+                       const vector<uint16_t> &entries, uint64_t quantum, uint16_t memory[], size_t report_top)
+{
+    print_cache_config("L1", levels[0].size, levels[0].assoc, levels[0].blocksize,
+                       levels[0].size / (levels[0].assoc * levels[0].blocksize));
+    for (size_t i = 1; i < levels.size(); ++i)
+    {
+        const cache_geometry &level = levels[i];
+        print_cache_config("L" + to_string(i + 1), level.size, level.assoc, level.blocksize,
+                           level.size / (level.assoc * level.blocksize));
+    }
 
-            // write to LRU in L2
-            l2_cache[l2_row][l2_lru].valid = true;
-            l2_cache[l2_row][l2_lru].tag = l2_tag;
-            l2_cache[l2_row][l2_lru].last_access = 0; // reset last access
-            print_log_entry("L2", "SW", pc, mem_addr, l2_row);
+    vector<core_state> states(num_cores, core_state(memory));
+    for (size_t i = 0; i < num_cores; ++i)
+    {
+        states[i].pc = entries.empty() ? 0 : entries[min(i, entries.size() - 1)];
+        states[i].regs[1] = i;
+    }
+    coherent_caches caches(levels, num_cores, protocol);
 
-            // write registers to memory
-            memory[(regs[regA] + imm7) & 0b1111111111111] = regs[regB];
-            ++pc;
-            break;
-        case 6: // jeq
-            pc = (regs[regA] == regs[regB]) ? (pc + 1 + imm7) : pc + 1;
-            break;
-        case 7: // slti
-            regs[regB] = (regs[regA] < imm_slti) ? 1 : 0;
-            ++pc;
-            break;
-        defualt:
-            cerr << opcode << " is not a valid opcode" << endl;
+    thread_barrier barrier(num_cores + 1);
+    bool done = false;
+    vector<thread> threads;
+    for (size_t i = 0; i < num_cores; ++i)
+        threads.emplace_back([&, i]()
+                             {
+            core_state &state = states[i];
+            for (;;)
+            {
+                barrier.wait();
+                if (done)
+                    return;
+                if (!state.halted)
+                    state.run(quantum);
+                barrier.wait();
+            } });
+    for (;;)
+    {
+        bool running = false;
+        for (const core_state &state : states)
+            running = running || !state.halted;
+        done = !running;
+        barrier.wait();
+        if (done)
             break;
-        }
-
-        regs[0] = 0; // Ensure $0 is still 0
+        barrier.wait();
+        for (core_state &state : states)
+            state.memory.commit(memory);
+        replay_quantum(states, caches);
     }
+    for (thread &t : threads)
+        t.join();
+
+    print_multicore_report(cerr, states, caches, report_top);
+    return 0;
 }
 
 /**
@@ -524,6 +4141,31 @@ int main(int argc, char *argv[])
     bool do_help = false;
     bool arg_error = false;
     string cache_config;
+    string icache_config;
+    bool unified = false;
+    prefetch_config prefetch;
+    string sweep_config;
+    string sweep_format = "csv";
+    string stackdist_config;
+    char *record_file = nullptr;
+    char *replay_file = nullptr;
+    unsigned num_threads = thread::hardware_concurrency();
+    vector<replacement_policy> policies;
+    vector<write_policy> write_policies;
+    uint32_t seed = 1;
+    log_format log_mode = LOG_TEXT;
+    bool log_mode_given = false;
+    size_t report_top = 10;
+    bool report_top_given = false;
+    string latency_config;
+    checkpoint_request save;
+    sample_plan sample;
+    char *restore_file = nullptr;
+    size_t num_cores = 0;
+    coherence_protocol protocol = COHERENCE_MESI;
+    bool protocol_given = false;
+    vector<uint16_t> entries;
+    uint64_t quantum = 0;
     for (int i = 1; i < argc; i++)
     {
         string arg(argv[i]);
@@ -531,13 +4173,121 @@ int main(int argc, char *argv[])
         {
             if (arg == "-h" || arg == "--help")
                 do_help = true;
-            else if (arg == "--cache")
+            else if (arg == "--cache" || arg == "--icache" || arg == "--latency")
             {
                 i++;
                 if (i >= argc)
                     arg_error = true;
-                else
+                else if (arg == "--cache")
                     cache_config = argv[i];
+                else if (arg == "--icache")
+                    icache_config = argv[i];
+                else
+                    latency_config = argv[i];
+            }
+            else if (arg == "--unified")
+                unified = true;
+            else if (arg == "--prefetch")
+            {
+                i++;
+                if (i >= argc || !parse_prefetch_config(argv[i], prefetch))
+                    arg_error = true;
+            }
+            else if (arg == "--cores" || arg == "--quantum")
+            {
+                i++;
+                if (i >= argc)
+                    arg_error = true;
+                else if (arg == "--cores")
+                    num_cores = strtoul(argv[i], nullptr, 10);
+                else
+                    quantum = strtoull(argv[i], nullptr, 10);
+                arg_error = arg_error || (arg == "--cores" ? num_cores : quantum) == 0;
+            }
+            else if (arg == "--coherence")
+            {
+                i++;
+                if (i >= argc || !parse_policy(argv[i], COHERENCE_NAMES, protocol))
+                    arg_error = true;
+                protocol_given = true;
+            }
+            else if (arg == "--entry")
+            {
+                i++;
+                if (i >= argc || !parse_entries(argv[i], entries))
+                    arg_error = true;
+            }
+            else if (arg == "--sample")
+            {
+                i++;
+                if (i >= argc || !parse_sample_plan(argv[i], sample))
+                    arg_error = true;
+            }
+            else if (arg == "--record" || arg == "--replay")
+            {
+                i++;
+                if (i >= argc)
+                    arg_error = true;
+                else if (arg == "--record")
+                    record_file = argv[i];
+                else
+                    replay_file = argv[i];
+            }
+            else if (arg == "--checkpoint" || arg == "--restore" || arg == "--at-instr" || arg == "--at-pc")
+            {
+                i++;
+                if (i >= argc)
+                    arg_error = true;
+                else if (arg == "--checkpoint")
+                    save.filename = argv[i];
+                else if (arg == "--restore")
+                    restore_file = argv[i];
+                else if (arg == "--at-instr")
+                    save.at_instr = strtoull(argv[i], nullptr, 10);
+                else
+                    save.at_pc = strtoul(argv[i], nullptr, 0);
+            }
+            else if (arg == "--log")
+            {
+                i++;
+                if (i >= argc || !parse_log_format(argv[i], log_mode))
+                    arg_error = true;
+                log_mode_given = true;
+            }
+            else if (arg == "--top")
+            {
+                i++;
+                if (i >= argc)
+                    arg_error = true;
+                else
+                    report_top = strtoul(argv[i], nullptr, 10);
+                report_top_given = true;
+            }
+            else if (arg == "--policy" || arg == "--write" || arg == "--seed")
+            {
+                i++;
+                if (i >= argc)
+                    arg_error = true;
+                else if (arg == "--policy")
+                    arg_error = arg_error || !parse_policy_list(argv[i], POLICY_NAMES, policies);
+                else if (arg == "--write")
+                    arg_error = arg_error || !parse_policy_list(argv[i], WRITE_POLICY_NAMES, write_policies);
+                else
+                    seed = strtoul(argv[i], nullptr, 10);
+            }
+            else if (arg == "--sweep" || arg == "--stackdist" || arg == "--format" || arg == "--threads")
+            {
+                i++;
+                if (i >= argc)
+                    arg_error = true;
+                else if (arg == "--sweep")
+                    sweep_config = argv[i];
+                else if (arg == "--stackdist")
+                    stackdist_config = argv[i];
+                else if (arg == "--format")
+                    sweep_format = argv[i];
+                else
+                    num_threads = atoi(argv[i]);
             }
             else
                 arg_error = true;
@@ -550,10 +4300,61 @@ int main(int argc, char *argv[])
                 arg_error = true;
         }
     }
+    if (sweep_format != "csv" && sweep_format != "json")
+        arg_error = true;
+    if (!sweep_config.empty() + !cache_config.empty() + !stackdist_config.empty() > 1)
+        arg_error = true;
+    if (!policies.empty() && !stackdist_config.empty())
+        arg_error = true;
+    if ((log_mode_given || report_top_given || !latency_config.empty() || !write_policies.empty()) &&
+        (!sweep_config.empty() || !stackdist_config.empty()))
+        arg_error = true;
+    if (record_file != nullptr && (replay_file != nullptr || !sweep_config.empty() || !stackdist_config.empty()))
+        arg_error = true;
+    // A replay reads the trace, and a restore the checkpoint, instead of a program
+    if ((filename != nullptr) + (replay_file != nullptr) + (restore_file != nullptr) != 1)
+        arg_error = true;
+    if ((save.filename != nullptr) != (save.at_instr != UINT64_MAX || save.at_pc != -1))
+        arg_error = true;
+    if (save.filename != nullptr && (replay_file != nullptr || !sweep_config.empty() || !stackdist_config.empty()))
+        arg_error = true;
+    // Instruction caches sit beside the data caches of --cache and need fetches to run
+    if (!icache_config.empty() && (cache_config.empty() || replay_file != nullptr))
+        arg_error = true;
+    if (unified && icache_config.empty())
+        arg_error = true;
+    // Sampling needs a program to run, and only the caches of --cache
+    if (sample.detail > 0 && (cache_config.empty() || replay_file != nullptr || record_file != nullptr))
+        arg_error = true;
+    // A prefetcher feeds L1, and isn't trained while sampling warms the caches
+    if (prefetch.kind != PREFETCH_NONE && (cache_config.empty() || sample.detail > 0))
+        arg_error = true;
+    // Cores share --cache past their private L1s, and run nothing but a program
+    if ((protocol_given || !entries.empty() || quantum != 0) && num_cores == 0)
+        arg_error = true;
+    if (num_cores != 0 &&
+        (cache_config.empty() || filename == nullptr || record_file != nullptr || save.filename != nullptr ||
+         sample.detail > 0 || !icache_config.empty() || prefetch.kind != PREFETCH_NONE || log_mode_given ||
+         !latency_config.empty()))
+        arg_error = true;
+
     /* Display error message if appropriate */
-    if (arg_error || do_help || filename == nullptr)
+    if (arg_error || do_help)
     {
-        cerr << "usage " << argv[0] << " [-h] [--cache CACHE] filename" << endl
+        cerr << "usage " << argv[0] << " [-h] [--cache CACHE | --sweep SWEEP | --stackdist BLOCKSIZES]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--icache CACHE [--unified]] [--write POLICIES]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--prefetch KIND[,DEGREE[,DISTANCE]]]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--policy POLICIES] [--seed N] [--log FORMAT] [--top N]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--latency LATENCIES] [--sample SKIP,WARM,DETAIL]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--record TRACE] [--checkpoint FILE (--at-instr N | --at-pc PC)]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " (filename | --restore FILE)" << endl;
+        cerr << "      " << argv[0] << " [-h] --cache CACHE --cores N [--coherence PROTOCOL]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--entry PCS] [--quantum N] [--policy POLICIES] [--seed N]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--write POLICIES] [--top N] filename" << endl;
+        cerr << "      " << argv[0] << " [-h] [--cache CACHE | --sweep SWEEP | --stackdist BLOCKSIZES]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--policy POLICIES] [--seed N] [--log FORMAT] [--top N]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " [--latency LATENCIES]" << endl;
+        cerr << "      " << string(strlen(argv[0]), ' ') << " --replay TRACE" << endl
              << endl;
         cerr << "Simulate E20 cache" << endl
              << endl;
@@ -562,10 +4363,75 @@ int main(int argc, char *argv[])
              << endl;
         cerr << "optional arguments:" << endl;
         cerr << "  -h, --help  show this help message and exit" << endl;
-        cerr << "  --cache CACHE  Cache configuration: size,associativity,blocksize (for one" << endl;
-        cerr << "                 cache) or" << endl;
-        cerr << "                 size,associativity,blocksize,size,associativity,blocksize" << endl;
-        cerr << "                 (for two caches)" << endl;
+        cerr << "  --cache CACHE  Cache configuration: size,associativity,blocksize for each" << endl;
+        cerr << "                 level, starting with L1, e.g. 16,1,1 (one cache) or" << endl;
+        cerr << "                 16,1,1,64,4,2,256,8,4 (three caches)" << endl;
+        cerr << "  --icache CACHE  Also fetch every instruction through instruction caches" << endl;
+        cerr << "                 configured like --cache, starting with L1I. Their misses" << endl;
+        cerr << "                 go to memory, so the sides are split all the way down" << endl;
+        cerr << "  --unified      Send misses in the last instruction cache on into the" << endl;
+        cerr << "                 --cache levels below it instead, e.g. an L1I in front of" << endl;
+        cerr << "                 the L2 of a two-level --cache" << endl;
+        cerr << "  --sweep SWEEP  Run the program once and report every cache configuration" << endl;
+        cerr << "                 in SIZES:ASSOCS:BLOCKSIZES (for one cache) or" << endl;
+        cerr << "                 SIZES:ASSOCS:BLOCKSIZES/SIZES:ASSOCS:BLOCKSIZES (for two" << endl;
+        cerr << "                 caches). Each list is comma separated values or a range" << endl;
+        cerr << "                 LO-HI of powers of two, e.g. 16-256:1,2,4:1-8" << endl;
+        cerr << "  --stackdist BLOCKSIZES  Build LRU stack-distance histograms for each" << endl;
+        cerr << "                 blocksize in one pass and report the load hit ratio of" << endl;
+        cerr << "                 every rows x associativity cache with that blocksize, as" << endl;
+        cerr << "                 --cache reports it with --policy lru --write wbwa (or wtwa)" << endl;
+        cerr << "  --format FORMAT  Sweep and stackdist results as csv (default) or json" << endl;
+        cerr << "  --threads N    Threads for the sweep cache models (default: one per core)" << endl;
+        cerr << "  --policy POLICIES  Replacement policy of each level, comma separated from" << endl;
+        cerr << "                 L1; the last one listed also applies to deeper levels." << endl;
+        cerr << "                 age (default, the original LRU counters), lru, plru," << endl;
+        cerr << "                 fifo, random, srrip or brrip" << endl;
+        cerr << "  --seed N       Seed for the random and brrip policies (default 1)" << endl;
+        cerr << "  --write POLICIES  Write policy of each level, comma separated from L1" << endl;
+        cerr << "                 like --policy. install (default, the original: every" << endl;
+        cerr << "                 store fills a way of every level), wtwa, wtnwa, wbwa or" << endl;
+        cerr << "                 wbnwa (write-through or write-back, with or without" << endl;
+        cerr << "                 write-allocate)" << endl;
+        cerr << "  --log FORMAT   Cache event log as text (default), binary records, csv," << endl;
+        cerr << "                 or counts of each event per level only" << endl;
+        cerr << "  --top N        Entries in each list of the cache report printed to stderr" << endl;
+        cerr << "                 at exit, 0 for no report (default 10)" << endl;
+        cerr << "  --prefetch KIND[,DEGREE[,DISTANCE]]  Prefetch into L1 with next (next-line)," << endl;
+        cerr << "                 stride (per-pc stride) or stream (stream buffers):" << endl;
+        cerr << "                 DEGREE blocks per trigger, from DISTANCE blocks or strides" << endl;
+        cerr << "                 ahead (default 1,1). Reports accuracy, coverage," << endl;
+        cerr << "                 timeliness and pollution to stderr at exit" << endl;
+        cerr << "  --latency LATENCIES  Hit latency in cycles of each level, starting with" << endl;
+        cerr << "                 L1, then the memory latency, for the cycles, CPI and AMAT" << endl;
+        cerr << "                 printed to stderr at exit (default 1 for L1, 10 more for" << endl;
+        cerr << "                 each level below it, and 100 for memory)" << endl;
+        cerr << "  --sample SKIP,WARM,DETAIL  Sample the run: skip SKIP instructions with" << endl;
+        cerr << "                 the caches off, warm them for WARM, log and count the next" << endl;
+        cerr << "                 DETAIL, and repeat. Reports each level's miss rate and" << endl;
+        cerr << "                 total misses estimated from the windows, with 95% confidence" << endl;
+        cerr << "                 intervals" << endl;
+        cerr << "  --record TRACE  Also write every LW/SW to the compact binary trace TRACE" << endl;
+        cerr << "  --replay TRACE  Drive the caches from TRACE instead of running a program" << endl;
+        cerr << "  --checkpoint FILE  Save memory, registers, pc and the contents of every" << endl;
+        cerr << "                 cache level to FILE once N instructions have run" << endl;
+        cerr << "                 (--at-instr N) or just before pc first reaches PC" << endl;
+        cerr << "                 (--at-pc PC), then carry on" << endl;
+        cerr << "  --restore FILE  Resume from a checkpoint written by e20sim or simcache" << endl;
+        cerr << "                 instead of loading a program. The caches continue warm" << endl;
+        cerr << "                 if they were saved with the same --cache, --icache," << endl;
+        cerr << "                 --policy and --write" << endl;
+        cerr << "  --cores N      Run N cores on one thread each, sharing memory. The first" << endl;
+        cerr << "                 --cache level is each core's private, write-back L1 and the" << endl;
+        cerr << "                 rest are shared. Reports each core, the bus transactions," << endl;
+        cerr << "                 invalidations and false sharing to stderr at exit" << endl;
+        cerr << "  --coherence PROTOCOL  Keep the L1s coherent with msi or mesi (default)" << endl;
+        cerr << "  --entry PCS    The pc each core starts at, comma separated from core 0;" << endl;
+        cerr << "                 the last one listed also applies to later cores (default" << endl;
+        cerr << "                 0). Core i starts with $1 set to i" << endl;
+        cerr << "  --quantum N    Instructions each core runs before the cores meet to" << endl;
+        cerr << "                 exchange stores and update the caches; 1 is lock step" << endl;
+        cerr << "                 (default 1000)" << endl;
         return 1;
     }
 
@@ -586,113 +4452,138 @@ int main(int argc, char *argv[])
     for (size_t i = 0; i < 8; ++i)
         regs[i] = 0;
 
-    ifstream f(filename);
-    if (!f.is_open())
+    machine_checkpoint restored;
+    if (restore_file != nullptr)
     {
-        cerr << "Can't open file " << filename << endl;
-        return 1;
+        string error;
+        if (!read_checkpoint(restore_file, restored, memory, error))
+        {
+            cerr << error << endl;
+            return 1;
+        }
+        memcpy(regs, restored.regs, sizeof(restored.regs));
+        pc = restored.pc;
+    }
+    else if (replay_file == nullptr)
+    {
+        load_machine_code(filename, memory);
     }
-    // Load f and parse using load_machine_code
-    load_machine_code(f, memory);
 
     /*
         ========== Cache simulation ==========
     */
 
-    /* parse cache config */
-    if (cache_config.size() > 0)
+    if (!sweep_config.empty())
     {
-        vector<int> parts;
-        size_t pos;
-        size_t lastpos = 0;
-        while ((pos = cache_config.find(",", lastpos)) != string::npos)
+        string error;
+        bool ok = run_sweep(sweep_config, policies, seed, num_threads, sweep_format == "json", [&](sweep_runner &runner)
+                            {
+                                if (replay_file == nullptr)
+                                    run_e20(memory, regs, pc, runner);
+                                else if (!replay_trace(replay_file, runner, error))
+                                {
+                                    cerr << error << endl;
+                                    exit(1);
+                                } });
+        if (!ok)
         {
-            parts.push_back(stoi(cache_config.substr(lastpos, pos)));
-            lastpos = pos + 1;
+            cerr << "Invalid sweep config" << endl;
+            return 1;
         }
-        parts.push_back(stoi(cache_config.substr(lastpos)));
-        if (parts.size() == 3)
-        {
-            int L1size = parts[0];
-            int L1assoc = parts[1];
-            int L1blocksize = parts[2];
-            int L1rows = L1size / (L1assoc * L1blocksize);
-
-            vector<vector<cache_cell>> cache;
-            for (size_t i = 0; i < L1rows; ++i)
-            {
-                vector<cache_cell> row;
-                for (size_t j = 0; j < L1assoc; ++j)
-                {
-                    cache_cell c;
-                    c.valid = false;
-                    c.tag = 0;
-                    c.last_access = 0;
-                    row.push_back(c);
-                }
-                cache.push_back(row);
-            }
-
-            print_cache_config("L1", L1size, L1assoc, L1blocksize, L1rows);
+        return 0;
+    }
 
-            // Simulate
-            simulate_one_cache(memory, regs, pc, cache, L1size, L1assoc, L1blocksize, L1rows);
+    if (!stackdist_config.empty())
+    {
+        vector<int> blocksizes;
+        bool ok = parse_sweep_list(stackdist_config, blocksizes);
+        for (int blocksize : blocksizes)
+            ok = ok && blocksize <= 8192 && (blocksize & (blocksize - 1)) == 0;
+        if (!ok)
+        {
+            cerr << "Invalid stackdist config" << endl;
+            return 1;
         }
-        else if (parts.size() == 6)
+        stack_distance_analysis analysis(blocksizes);
+        string error;
+        if (replay_file == nullptr)
+            run_e20(memory, regs, pc, analysis);
+        else if (!replay_trace(replay_file, analysis, error))
         {
-            int L1size = parts[0];
-            int L1assoc = parts[1];
-            int L1blocksize = parts[2];
-            int L1rows = L1size / (L1assoc * L1blocksize);
-
-            int L2size = parts[3];
-            int L2assoc = parts[4];
-            int L2blocksize = parts[5];
-            int L2rows = L2size / (L2assoc * L2blocksize);
-
-            vector<vector<cache_cell>> l1_cache;
-            for (size_t i = 0; i < L1rows; ++i)
-            {
-                vector<cache_cell> row;
-                for (size_t j = 0; j < L1assoc; ++j)
-                {
-                    cache_cell c;
-                    c.valid = false;
-                    c.tag = 0;
-                    c.last_access = 0;
-                    row.push_back(c);
-                }
-                l1_cache.push_back(row);
-            }
-
-            vector<vector<cache_cell>> l2_cache;
-            for (size_t i = 0; i < L2rows; ++i)
-            {
-                vector<cache_cell> row;
-                for (size_t j = 0; j < L2assoc; ++j)
-                {
-                    cache_cell c;
-                    c.valid = false;
-                    c.tag = 0;
-                    c.last_access = 0;
-                    row.push_back(c);
-                }
-                l2_cache.push_back(row);
-            }
-
-            print_cache_config("L1", L1size, L1assoc, L1blocksize, L1rows);
-            print_cache_config("L2", L2size, L2assoc, L2blocksize, L2rows);
+            cerr << error << endl;
+            return 1;
+        }
+        analysis.print(sweep_format == "json");
+        return 0;
+    }
 
-            // Simulate
-            simulate_two_cache(memory, regs, pc, l1_cache, l2_cache, L1size, L1assoc, L1blocksize, L1rows, L2size, L2assoc, L2blocksize, L2rows);
+    vector<cache_geometry> levels;
+    if (!cache_config.empty() && !parse_cache_config(cache_config, levels))
+    {
+        cerr << "Invalid cache config" << endl;
+        return 1;
+    }
+    for (size_t i = 0; i < levels.size(); ++i)
+    {
+        levels[i].policy = policy_for_level(policies, i);
+        levels[i].seed = seed + i;
+        levels[i].write = policy_for_level(write_policies, i);
+        if (!levels[i].policy_fits())
+        {
+            cerr << "Policy " << POLICY_NAMES[levels[i].policy] << " needs a power-of-two associativity" << endl;
+            return 1;
         }
-        else
+    }
+    vector<cache_geometry> ilevels;
+    if (!icache_config.empty() && !parse_cache_config(icache_config, ilevels))
+    {
+        cerr << "Invalid icache config" << endl;
+        return 1;
+    }
+    for (size_t i = 0; i < ilevels.size(); ++i)
+    {
+        ilevels[i].policy = policy_for_level(policies, i);
+        ilevels[i].seed = seed + levels.size() + i;
+        if (!ilevels[i].policy_fits())
         {
-            cerr << "Invalid cache config" << endl;
+            cerr << "Policy " << POLICY_NAMES[ilevels[i].policy] << " needs a power-of-two associativity" << endl;
             return 1;
         }
     }
+    if (levels.empty() && record_file == nullptr && replay_file == nullptr && save.filename == nullptr)
+        return 0;
+    if (num_cores != 0)
+        return simulate_multicore(levels, num_cores, protocol, entries, quantum ? quantum : 1000, memory,
+                                  report_top);
+    vector<uint64_t> latencies;
+    if (!parse_latencies(latency_config, levels.size(), latencies))
+    {
+        cerr << "Invalid latencies, expected " << levels.size() + 1 << " positive values" << endl;
+        return 1;
+    }
 
-    return 0;
+    // Give the usual depths their own unrolled hierarchy. Fetching through instruction caches and
+    // prefetching are the slow paths anyway, so they only get the general one
+    typedef cache_hierarchy<vector<cache_model>> any_depth;
+    bool prefetching = prefetch.kind != PREFETCH_NONE;
+    if (!ilevels.empty() && prefetching)
+        return simulate_caches<any_depth, fetch_caches, prefetcher>(levels, ilevels, unified, prefetch, memory, regs, pc, record_file, replay_file, log_mode, latencies, report_top, save, restored, sample);
+    if (!ilevels.empty())
+        return simulate_caches<any_depth, fetch_caches>(levels, ilevels, unified, prefetch, memory, regs, pc, record_file, replay_file, log_mode, latencies, report_top, save, restored, sample);
+    if (prefetching)
+        return simulate_caches<any_depth, no_fetch, prefetcher>(levels, ilevels, unified, prefetch, memory, regs, pc, record_file, replay_file, log_mode, latencies, report_top, save, restored, sample);
+    switch (levels.size())
+    {
+    case 0:
+        return simulate_caches<cache_hierarchy<>>(levels, ilevels, unified, prefetch, memory, regs, pc, record_file, replay_file, log_mode, latencies, report_top, save, restored, sample);
+    case 1:
+        return simulate_caches<cache_hierarchy<cache_model>>(levels, ilevels, unified, prefetch, memory, regs, pc, record_file, replay_file, log_mode, latencies, report_top, save, restored, sample);
+    case 2:
+        return simulate_caches<cache_hierarchy<cache_model, cache_model>>(levels, ilevels, unified, prefetch, memory, regs, pc, record_file, replay_file, log_mode, latencies, report_top, save, restored, sample);
+    case 3:
+        return simulate_caches<cache_hierarchy<cache_model, cache_model, cache_model>>(levels, ilevels, unified, prefetch, memory, regs, pc, record_file, replay_file, log_mode, latencies, report_top, save, restored, sample);
+    default:
+        return simulate_caches<cache_hierarchy<vector<cache_model>>>(levels, ilevels, unified, prefetch, memory, regs, pc, record_file, replay_file, log_mode, latencies, report_top, save, restored, sample);
+    }
 }
 // ra0Eequ6ucie6Jei0koh6phishohm9
\ No newline at end of file